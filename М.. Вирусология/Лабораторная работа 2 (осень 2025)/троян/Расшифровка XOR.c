@@ -0,0 +1,660 @@
+/*
+ * xordec.c - Расшифровка стадий трояна ED2D527E... (ANSI C / C89).
+ *
+ * Задача: снять XOR-шифрование с ключом, зависящим от смещения
+ * (см. анализ_stage2.txt, разделы 2.4 и 5), над целым дампом.
+ * Данные обрабатываются двойными словами (little-endian) с шагом 4;
+ * offset - смещение слова от начала расшифровываемого участка.
+ *
+ * Схема ключа задается строкой из шагов через запятую:
+ *     <операция>:<выражение>
+ * операция - add, sub или xor; выражение - сумма/разность слагаемых
+ * "off" (смещение), чисел (0x5FE9, 24553) и "?" (перебираемая константа).
+ * Все вычисления по модулю 2^32. Готовые схемы:
+ *     stage1 = add:off,xor:off+0x5FEA-1   (start, 0x004016A6 - 0x004016F1)
+ *     stage2 = add:off,xor:off+0x5FE9     (start, 0x0040183E - 0x00401885)
+ * В Stage1 ключ offset + 0x5FEA уменьшается на 1 перед xor, так что
+ * фактически обе стадии используют одну и ту же константу.
+ *
+ * Режимы:
+ *     --decode <схема> <вход> <выход> [начало [длина]]
+ *     --encode <схема> <вход> <выход> [начало [длина]]
+ *     --brute  <схема с ?> <вход> <от> <до> [начало [лучших]]
+ * Перебор расшифровывает только заголовок участка для каждой константы
+ * и оценивает, насколько он похож на PE-файл.
+ *
+ * Если компилятор поддерживает SSE2, за итерацию обрабатываются четыре
+ * двойных слова. При сборке с -DXOR_DECODE_THREADS (и -pthread) перебор
+ * делится между несколькими потоками POSIX.
+ *
+ * Автор: Старший разработчик / Эксперт по ИБ.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef XOR_DECODE_THREADS
+#include <pthread.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* --- Константы и Макросы --- */
+
+/* Логические константы для ANSI C */
+#define TRUE  1
+#define FALSE 0
+
+#define WORD_MASK 0xFFFFFFFFUL   /* Арифметика по модулю 2^32 */
+
+#define MAX_STEPS        16      /* Наибольшее число шагов схемы */
+#define PROBE_SIZE       0x200   /* Байт заголовка, расшифровываемых при переборе */
+#define DEFAULT_TOP      10      /* Лучших кандидатов по умолчанию */
+#define MAX_TOP          256
+#define BRUTE_THREADS    4       /* Потоков перебора */
+
+/* Вес признака PE в оценке; младшие разряды - число нулевых байт */
+#define SCORE_POINT      1024UL
+
+/* Операция шага схемы */
+typedef enum {
+    STEP_ADD,
+    STEP_SUB,
+    STEP_XOR
+} StepOp;
+
+/*
+ * Шаг схемы: word = word <op> (off_coef * offset + constant + guess_coef * ?).
+ * Коэффициенты - сколько раз (со знаком) слагаемое встречается в выражении.
+ */
+typedef struct {
+    StepOp        op;
+    unsigned long off_coef;
+    unsigned long constant;
+    unsigned long guess_coef;
+} KeyStep;
+
+/* Схема ключа: последовательность шагов над каждым двойным словом */
+typedef struct {
+    KeyStep steps[MAX_STEPS];
+    int     count;
+    int     has_guess;   /* TRUE, если в схеме есть "?" */
+} KeySchedule;
+
+/* Кандидат перебора */
+typedef struct {
+    unsigned long guess;
+    unsigned long score;
+} Candidate;
+
+/* Задание потока перебора: поддиапазон констант и свои лучшие кандидаты */
+typedef struct {
+    const KeySchedule*   schedule;
+    const unsigned char* probe;       /* Зашифрованный заголовок */
+    size_t               probe_len;
+    unsigned long        first;
+    unsigned long        last;        /* Включительно */
+    Candidate            top[MAX_TOP];
+    int                  top_count;
+    int                  top_limit;
+} BruteJob;
+
+
+/* --- Прототипы функций --- */
+
+/*
+ * Разбирает схему ключа (или имя готовой схемы stage1/stage2).
+ * Возвращает FALSE при синтаксической ошибке.
+ */
+int parseSchedule(const char* text, KeySchedule* schedule);
+
+/*
+ * Применяет схему к len байтам data на месте; guess подставляется
+ * вместо "?". Хвост короче двойного слова не изменяется.
+ */
+void applySchedule(const KeySchedule* schedule, unsigned long guess,
+                   unsigned char* data, size_t len);
+
+/* Применяет обратную схему (шаги в обратном порядке, add <-> sub). */
+void invertSchedule(const KeySchedule* schedule, KeySchedule* inverse);
+
+/* Оценивает сходство буфера с началом PE-файла; больше - лучше. */
+unsigned long scorePeHeader(const unsigned char* data, size_t len);
+
+/* Перебирает константы поддиапазона задания, сохраняя лучшие оценки. */
+void bruteRange(BruteJob* job);
+
+/* Читает файл целиком; NULL при ошибке. */
+unsigned char* readWholeFile(const char* path, size_t* out_len);
+
+
+/* --- Основная программа --- */
+
+/* Разбирает число в любой системе счисления C; FALSE при ошибке */
+static int parseNumber(const char* text, unsigned long* value)
+{
+    char* end;
+
+    *value = strtoul(text, &end, 0);
+    return end != text && *end == '\0';
+}
+
+/* Ограничивает участок [start, start + length) размером файла */
+static int selectRange(int argc, char* argv[], int first, size_t size,
+                       size_t* start, size_t* length)
+{
+    unsigned long value;
+
+    *start = 0;
+    *length = size;
+    if (argc > first) {
+        if (!parseNumber(argv[first], &value) || value > size) return FALSE;
+        *start = (size_t)value;
+        *length = size - *start;
+    }
+    if (argc > first + 1) {
+        if (!parseNumber(argv[first + 1], &value) || value > *length) return FALSE;
+        *length = (size_t)value;
+    }
+    return TRUE;
+}
+
+/* Режимы --decode и --encode: преобразует участок файла и пишет весь файл */
+static int runTransform(int argc, char* argv[], int encode)
+{
+    KeySchedule schedule;
+    KeySchedule inverse;
+    unsigned char* data;
+    size_t size;
+    size_t start;
+    size_t length;
+    FILE* out;
+    int status = 0;
+
+    if (!parseSchedule(argv[2], &schedule) || schedule.has_guess) {
+        fprintf(stderr, "bad schedule: %s\n", argv[2]);
+        return 2;
+    }
+    data = readWholeFile(argv[3], &size);
+    if (data == NULL) {
+        return 1;
+    }
+    if (!selectRange(argc, argv, 5, size, &start, &length)) {
+        fprintf(stderr, "bad range\n");
+        free(data);
+        return 2;
+    }
+
+    if (encode) {
+        invertSchedule(&schedule, &inverse);
+        applySchedule(&inverse, 0, data + start, length);
+    } else {
+        applySchedule(&schedule, 0, data + start, length);
+    }
+
+    out = fopen(argv[4], "wb");
+    if (out == NULL || fwrite(data, 1, size, out) != size) {
+        status = 1;
+    }
+    if (out != NULL && fclose(out) != 0) {
+        status = 1;
+    }
+
+    free(data);
+    return status;
+}
+
+#ifdef XOR_DECODE_THREADS
+static void* bruteThread(void* arg)
+{
+    bruteRange((BruteJob*)arg);
+    return NULL;
+}
+#endif
+
+static int compareCandidates(const void* a, const void* b)
+{
+    const Candidate* x = (const Candidate*)a;
+    const Candidate* y = (const Candidate*)b;
+
+    if (x->score != y->score) return (x->score > y->score) ? -1 : 1;
+    if (x->guess != y->guess) return (x->guess < y->guess) ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Режим --brute: делит диапазон констант между заданиями, затем
+ * сливает их лучших кандидатов и печатает "константа<TAB>оценка".
+ */
+static int runBrute(int argc, char* argv[])
+{
+    KeySchedule schedule;
+    BruteJob* jobs;
+#ifdef XOR_DECODE_THREADS
+    pthread_t threads[BRUTE_THREADS];
+    int started[BRUTE_THREADS];
+#endif
+    Candidate merged[MAX_TOP * BRUTE_THREADS];
+    unsigned char* data;
+    size_t size;
+    size_t start = 0;
+    unsigned long first;
+    unsigned long last;
+    unsigned long chunk;
+    unsigned long value;
+    int top = DEFAULT_TOP;
+    int merged_count = 0;
+    int k;
+    int i;
+
+    if (!parseSchedule(argv[2], &schedule) || !schedule.has_guess) {
+        fprintf(stderr, "bad schedule (expected '?'): %s\n", argv[2]);
+        return 2;
+    }
+    if (!parseNumber(argv[4], &first) || !parseNumber(argv[5], &last) ||
+        first > last || last > WORD_MASK) {
+        fprintf(stderr, "bad constant range\n");
+        return 2;
+    }
+    if (argc > 7) {
+        if (!parseNumber(argv[7], &value) || value == 0 || value > MAX_TOP) {
+            fprintf(stderr, "bad top count\n");
+            return 2;
+        }
+        top = (int)value;
+    }
+
+    data = readWholeFile(argv[3], &size);
+    if (data == NULL) {
+        return 1;
+    }
+    if (argc > 6) {
+        if (!parseNumber(argv[6], &value) || value > size) {
+            fprintf(stderr, "bad range\n");
+            free(data);
+            return 2;
+        }
+        start = (size_t)value;
+    }
+
+    jobs = (BruteJob*)malloc(BRUTE_THREADS * sizeof(BruteJob));
+    if (jobs == NULL) {
+        free(data);
+        return 1;
+    }
+
+    /* Поддиапазоны по chunk констант; хвостовые могут оказаться пустыми */
+    chunk = (last - first) / BRUTE_THREADS + 1;
+    for (k = 0; k < BRUTE_THREADS; k++) {
+        jobs[k].schedule = &schedule;
+        jobs[k].probe = data + start;
+        jobs[k].probe_len = (size - start < PROBE_SIZE) ? size - start : PROBE_SIZE;
+        jobs[k].top_count = 0;
+        jobs[k].top_limit = top;
+        if (chunk * (unsigned long)k > last - first) {
+            jobs[k].first = 1;
+            jobs[k].last = 0;
+        } else {
+            jobs[k].first = first + chunk * (unsigned long)k;
+            jobs[k].last = (last - jobs[k].first < chunk) ? last : jobs[k].first + chunk - 1;
+        }
+    }
+
+#ifdef XOR_DECODE_THREADS
+    for (k = 0; k < BRUTE_THREADS; k++) {
+        started[k] = (pthread_create(&threads[k], NULL, bruteThread, &jobs[k]) == 0);
+        if (!started[k]) {
+            bruteRange(&jobs[k]);
+        }
+    }
+    for (k = 0; k < BRUTE_THREADS; k++) {
+        if (started[k]) {
+            pthread_join(threads[k], NULL);
+        }
+    }
+#else
+    for (k = 0; k < BRUTE_THREADS; k++) {
+        bruteRange(&jobs[k]);
+    }
+#endif
+
+    for (k = 0; k < BRUTE_THREADS; k++) {
+        for (i = 0; i < jobs[k].top_count; i++) {
+            merged[merged_count++] = jobs[k].top[i];
+        }
+    }
+    qsort(merged, (size_t)merged_count, sizeof(Candidate), compareCandidates);
+    for (i = 0; i < merged_count && i < top; i++) {
+        printf("0x%08lX\t%lu\n", merged[i].guess, merged[i].score);
+    }
+
+    free(jobs);
+    free(data);
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc >= 5 && argc <= 7 && strcmp(argv[1], "--decode") == 0) {
+        return runTransform(argc, argv, FALSE);
+    }
+    if (argc >= 5 && argc <= 7 && strcmp(argv[1], "--encode") == 0) {
+        return runTransform(argc, argv, TRUE);
+    }
+    if (argc >= 6 && argc <= 8 && strcmp(argv[1], "--brute") == 0) {
+        return runBrute(argc, argv);
+    }
+
+    fprintf(stderr, "usage: %s --decode <schedule> <in> <out> [start [length]]\n"
+                    "       %s --encode <schedule> <in> <out> [start [length]]\n"
+                    "       %s --brute <schedule with ?> <in> <from> <to> [start [top]]\n"
+                    "schedule: stage1, stage2 or steps like add:off,xor:off+0x5FE9\n",
+            argv[0], argv[0], argv[0]);
+    return 2;
+}
+
+
+/* --- Реализация функций --- */
+
+/* Сравнивает начало s с ключевым словом word */
+static int startsWith(const char* s, const char* word)
+{
+    return strncmp(s, word, strlen(word)) == 0;
+}
+
+int parseSchedule(const char* text, KeySchedule* schedule)
+{
+    KeyStep* step;
+    const char* p;
+    char* end;
+    unsigned long value;
+    int negative;
+
+    if (strcmp(text, "stage1") == 0) text = "add:off,xor:off+0x5FEA-1";
+    if (strcmp(text, "stage2") == 0) text = "add:off,xor:off+0x5FE9";
+
+    memset(schedule, 0, sizeof(*schedule));
+    p = text;
+
+    while (*p != '\0') {
+        if (schedule->count == MAX_STEPS) return FALSE;
+        step = &schedule->steps[schedule->count++];
+
+        if (startsWith(p, "add:")) {
+            step->op = STEP_ADD;
+        } else if (startsWith(p, "sub:")) {
+            step->op = STEP_SUB;
+        } else if (startsWith(p, "xor:")) {
+            step->op = STEP_XOR;
+        } else {
+            return FALSE;
+        }
+        p += 4;
+
+        /* Выражение: [+|-]слагаемое {(+|-)слагаемое} */
+        negative = FALSE;
+        if (*p == '+' || *p == '-') {
+            negative = (*p == '-');
+            p++;
+        }
+        for (;;) {
+            if (startsWith(p, "off")) {
+                step->off_coef += negative ? WORD_MASK : 1;
+                p += 3;
+            } else if (*p == '?') {
+                step->guess_coef += negative ? WORD_MASK : 1;
+                schedule->has_guess = TRUE;
+                p++;
+            } else if (*p >= '0' && *p <= '9') {
+                value = strtoul(p, &end, 0) & WORD_MASK;
+                step->constant += negative ? (WORD_MASK - value + 1) : value;
+                p = end;
+            } else {
+                return FALSE;
+            }
+            step->off_coef &= WORD_MASK;
+            step->guess_coef &= WORD_MASK;
+            step->constant &= WORD_MASK;
+
+            if (*p != '+' && *p != '-') break;
+            negative = (*p == '-');
+            p++;
+        }
+
+        if (*p == ',') {
+            p++;
+            if (*p == '\0') return FALSE;
+        } else if (*p != '\0') {
+            return FALSE;
+        }
+    }
+    return schedule->count > 0;
+}
+
+void invertSchedule(const KeySchedule* schedule, KeySchedule* inverse)
+{
+    int k;
+
+    *inverse = *schedule;
+    for (k = 0; k < schedule->count; k++) {
+        inverse->steps[k] = schedule->steps[schedule->count - 1 - k];
+        if (inverse->steps[k].op == STEP_ADD) {
+            inverse->steps[k].op = STEP_SUB;
+        } else if (inverse->steps[k].op == STEP_SUB) {
+            inverse->steps[k].op = STEP_ADD;
+        }
+    }
+}
+
+/* Читает/пишет двойное слово little-endian */
+static unsigned long loadWord(const unsigned char* p)
+{
+    return (unsigned long)p[0] | ((unsigned long)p[1] << 8) |
+           ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+static void storeWord(unsigned char* p, unsigned long w)
+{
+    p[0] = (unsigned char)(w & 0xFF);
+    p[1] = (unsigned char)((w >> 8) & 0xFF);
+    p[2] = (unsigned char)((w >> 16) & 0xFF);
+    p[3] = (unsigned char)((w >> 24) & 0xFF);
+}
+
+/*
+ * Ключ шага для смещения offset линеен по offset, поэтому его не
+ * умножают заново: key(offset + 4) = key(offset) + 4 * off_coef.
+ */
+void applySchedule(const KeySchedule* schedule, unsigned long guess,
+                   unsigned char* data, size_t len)
+{
+    unsigned long key[MAX_STEPS];
+    unsigned long stride[MAX_STEPS];
+    unsigned long w;
+    size_t words = len / 4;
+    size_t i = 0;
+    int k;
+#ifdef __SSE2__
+    __m128i vkey[MAX_STEPS];
+    __m128i vstride[MAX_STEPS];
+    __m128i v;
+#endif
+
+    for (k = 0; k < schedule->count; k++) {
+        key[k] = (schedule->steps[k].constant + schedule->steps[k].guess_coef * guess) & WORD_MASK;
+        stride[k] = (schedule->steps[k].off_coef * 4) & WORD_MASK;
+    }
+
+#ifdef __SSE2__
+    /* Четыре соседних слова: ключи key, key + stride, key + 2*stride, ... */
+    for (k = 0; k < schedule->count; k++) {
+        vkey[k] = _mm_set_epi32((int)((key[k] + 3 * stride[k]) & WORD_MASK),
+                                (int)((key[k] + 2 * stride[k]) & WORD_MASK),
+                                (int)((key[k] + stride[k]) & WORD_MASK),
+                                (int)key[k]);
+        vstride[k] = _mm_set1_epi32((int)((4 * stride[k]) & WORD_MASK));
+    }
+    for (; i + 4 <= words; i += 4) {
+        v = _mm_loadu_si128((const __m128i*)(data + i * 4));
+        for (k = 0; k < schedule->count; k++) {
+            switch (schedule->steps[k].op) {
+            case STEP_ADD: v = _mm_add_epi32(v, vkey[k]); break;
+            case STEP_SUB: v = _mm_sub_epi32(v, vkey[k]); break;
+            default:       v = _mm_xor_si128(v, vkey[k]); break;
+            }
+            vkey[k] = _mm_add_epi32(vkey[k], vstride[k]);
+        }
+        _mm_storeu_si128((__m128i*)(data + i * 4), v);
+    }
+    for (k = 0; k < schedule->count; k++) {
+        key[k] = (key[k] + stride[k] * (unsigned long)i) & WORD_MASK;
+    }
+#endif
+
+    for (; i < words; i++) {
+        w = loadWord(data + i * 4);
+        for (k = 0; k < schedule->count; k++) {
+            switch (schedule->steps[k].op) {
+            case STEP_ADD: w = (w + key[k]) & WORD_MASK; break;
+            case STEP_SUB: w = (w - key[k]) & WORD_MASK; break;
+            default:       w ^= key[k]; break;
+            }
+            key[k] = (key[k] + stride[k]) & WORD_MASK;
+        }
+        storeWord(data + i * 4, w);
+    }
+}
+
+/* Читает слово из 2 байт little-endian */
+static unsigned int loadHalf(const unsigned char* p)
+{
+    return (unsigned int)p[0] | ((unsigned int)p[1] << 8);
+}
+
+/*
+ * Признаки (по SCORE_POINT каждый, "PE\0\0" - четыре):
+ * "MZ", разумный e_lfanew, сигнатура "PE\0\0", известная машина,
+ * размер и магия опционального заголовка, заглушка DOS.
+ * При равенстве выигрывает буфер с большим числом нулевых байт:
+ * заголовки PE в основном состоят из нулей.
+ */
+unsigned long scorePeHeader(const unsigned char* data, size_t len)
+{
+    static const char stub[] = "This program";
+    unsigned long score = 0;
+    unsigned long lfanew;
+    unsigned int machine;
+    unsigned int optional;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (data[i] == 0) score++;
+    }
+
+    if (len < 0x40 || data[0] != 'M' || data[1] != 'Z') {
+        return score;
+    }
+    score += 2 * SCORE_POINT;
+
+    for (i = 0x40; i + sizeof(stub) - 1 <= len && i < 0x80; i++) {
+        if (memcmp(data + i, stub, sizeof(stub) - 1) == 0) {
+            score += SCORE_POINT;
+            break;
+        }
+    }
+
+    lfanew = loadWord(data + 0x3C);
+    if (lfanew < 0x40 || (lfanew & 3) != 0 || lfanew + 24 > len) {
+        return score;
+    }
+    score += SCORE_POINT;
+
+    if (memcmp(data + lfanew, "PE\0\0", 4) != 0) {
+        return score;
+    }
+    score += 4 * SCORE_POINT;
+
+    machine = loadHalf(data + lfanew + 4);
+    if (machine == 0x014C || machine == 0x8664) {
+        score += SCORE_POINT;
+    }
+    optional = loadHalf(data + lfanew + 20);
+    if (optional == 0xE0 || optional == 0xF0) {
+        score += SCORE_POINT;
+        if (lfanew + 26 <= len) {
+            optional = loadHalf(data + lfanew + 24);
+            if (optional == 0x10B || optional == 0x20B) {
+                score += SCORE_POINT;
+            }
+        }
+    }
+    return score;
+}
+
+/* Вставляет кандидата в упорядоченный по убыванию список лучших */
+static void keepCandidate(BruteJob* job, unsigned long guess, unsigned long score)
+{
+    int pos;
+
+    if (job->top_count == job->top_limit) {
+        if (score <= job->top[job->top_count - 1].score) return;
+        job->top_count--;
+    }
+    pos = job->top_count;
+    while (pos > 0 && job->top[pos - 1].score < score) {
+        job->top[pos] = job->top[pos - 1];
+        pos--;
+    }
+    job->top[pos].guess = guess;
+    job->top[pos].score = score;
+    job->top_count++;
+}
+
+void bruteRange(BruteJob* job)
+{
+    unsigned char buffer[PROBE_SIZE];
+    unsigned long guess;
+
+    if (job->first > job->last) return;
+
+    for (guess = job->first; ; guess++) {
+        memcpy(buffer, job->probe, job->probe_len);
+        applySchedule(job->schedule, guess, buffer, job->probe_len);
+        keepCandidate(job, guess, scorePeHeader(buffer, job->probe_len));
+        if (guess == job->last) break;
+    }
+}
+
+unsigned char* readWholeFile(const char* path, size_t* out_len)
+{
+    FILE* f;
+    unsigned char* buffer;
+    long size;
+
+    f = fopen(path, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0) {
+        fclose(f);
+        return NULL;
+    }
+
+    buffer = (unsigned char*)malloc((size_t)size + 1);
+    if (buffer == NULL) {
+        fclose(f);
+        return NULL;
+    }
+    if (fread(buffer, 1, (size_t)size, f) != (size_t)size) {
+        free(buffer);
+        fclose(f);
+        return NULL;
+    }
+
+    fclose(f);
+    *out_len = (size_t)size;
+    return buffer;
+}
\ No newline at end of file
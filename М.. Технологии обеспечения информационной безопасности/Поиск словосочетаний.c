@@ -3,16 +3,32 @@
  *
  * Задача: Найти вхождения фразы в тексте.
  * Особенности:
- * 1. Гибкие разделители (пробел, tab, \n, \r).
+ * 1. Гибкие разделители (пробел, tab, \n, \r; набор можно расширить).
  * 2. Частичные совпадения слов разрешены (согласно примеру 4).
  * 3. Поддержка Win-1251 (русский текст).
  *
+ * Файл можно использовать как библиотеку: при сборке с
+ * -DPHRASE_SEARCH_NO_MAIN функция main() исключается, а доступен только
+ * программный интерфейс PhraseMatcher (см. раздел "Библиотечный интерфейс").
+ * При сборке с -DPHRASE_SEARCH_THREADS (и -pthread) подсчет n-грамм
+ * выполняется в нескольких потоках POSIX. Если компилятор поддерживает
+ * SSE2, проверка кодировки использует его для ASCII-участков.
+ *
  * Автор: Старший разработчик / Эксперт по ИБ.
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#ifdef PHRASE_SEARCH_THREADS
+#include <pthread.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /* --- Константы и Макросы --- */
 
 /* Максимальный размер фразы и текста согласно заданию */
@@ -27,157 +43,3622 @@
 #define INPUT_FILE  "input.txt"
 #define OUTPUT_FILE "output.txt"
 
+/* Параметры подсчета n-грамм */
+#define NGRAM_MAX_N          8        /* Наибольшая длина n-граммы в словах */
+#define NGRAM_SHARDS         8        /* Шардов (и потоков) на файл */
+#define NGRAM_MIN_CANDIDATES 256      /* Наименьший набор кандидатов шарда */
+#define NGRAM_SKETCH_DEPTH   4        /* Строк эскиза Count-Min */
+#define NGRAM_SKETCH_WIDTH   (1L << 18) /* Счетчиков в строке (степень двойки) */
+
+/* Параметры индекса листинга */
+#define LISTING_INDEX_SUFFIX  ".idx"     /* Индекс лежит рядом с листингом */
+#define LISTING_NAME_MAX      255        /* Более длинные имена не индексируются */
+#define LISTING_CONTEXT_LINES 5          /* Строк контекста по умолчанию */
+
+/* Параметры поиска почти одинаковых документов */
+#define SHINGLE_WORDS  5                               /* Слов в шингле */
+#define MINHASH_BANDS  32                              /* Полос LSH */
+#define MINHASH_ROWS   4                               /* Значений в полосе */
+#define MINHASH_SIZE   (MINHASH_BANDS * MINHASH_ROWS)  /* Длина сигнатуры */
+
+/* --- Библиотечный интерфейс --- */
+
+/*
+ * Набор разделителей: по одному биту на каждое значение байта.
+ * Все режимы поиска проверяют разделители через isSeparator, то есть
+ * одним обращением к этой таблице, без ветвлений по символам.
+ */
+typedef struct {
+    unsigned char bits[32];
+} SeparatorSet;
+
+/*
+ * Скомпилированная фраза.
+ * Фраза один раз разбирается на куски без разделителей ("сегменты"),
+ * между соседними сегментами всегда стоит группа разделителей.
+ * Поиск затем работает с буфером вызывающей стороны (указатель + длина)
+ * и не требует завершающего '\0'.
+ */
+typedef struct {
+    char*   literals;      /* Сегменты фразы, записанные подряд */
+    size_t* segment_len;   /* Длины сегментов */
+    size_t  segment_count; /* Количество сегментов */
+    int     leading_sep;   /* TRUE, если фраза начинается с разделителя */
+    int     trailing_sep;  /* TRUE, если фраза заканчивается разделителем */
+} PhraseMatcher;
+
+/*
+ * Обработчик найденного совпадения.
+ * position - смещение начала совпадения в буфере.
+ * Ненулевой код возврата прекращает поиск.
+ */
+typedef int (*PhraseMatchCallback)(size_t position, void* context);
+
+/*
+ * Набор фраз для одновременного поиска (алгоритм Рабина-Карпа).
+ * Текст и фразы рассматриваются в нормализованном виде: каждая группа
+ * разделителей заменяется одним условным символом. Фразы группируются по
+ * длине нормализованной формы; для каждой группы поддерживается скользящий
+ * хэш окна текста, а кандидаты из хэш-таблицы проверяются phraseMatchAt.
+ * Память зависит от числа фраз, а не от размера автомата.
+ */
+typedef struct {
+    PhraseMatcher matcher;   /* Скомпилированная фраза для проверки кандидатов */
+    size_t        norm_len;  /* Длина нормализованной формы */
+    unsigned long hash;      /* Хэш нормализованной формы */
+    long          next_same; /* Следующая фраза с той же (длиной, хэшем), -1 - конец */
+} PhraseEntry;
+
+typedef struct {
+    size_t        length;    /* Длина окна группы */
+    unsigned long power;     /* HASH_BASE^(length - 1) для удаления старого символа */
+} PhraseGroup;
+
+typedef struct {
+    PhraseEntry* entries;
+    size_t       count;
+    size_t       capacity;
+    PhraseGroup* groups;
+    size_t       group_count;
+    long*        table;      /* Открытая адресация: первая фраза цепочки или -1 */
+    size_t       table_mask;
+    size_t       max_len;    /* Наибольшая нормализованная длина */
+} PhraseSet;
+
+/*
+ * Обработчик совпадения для набора фраз.
+ * phrase_index - порядковый номер фразы в порядке добавления.
+ * Ненулевой код возврата прекращает поиск.
+ */
+typedef int (*PhraseSetCallback)(size_t phrase_index, size_t position, void* context);
+
+/*
+ * Счетчик n-грамм слов для одного шарда корпуса.
+ * Частоты оцениваются эскизом Count-Min (оценка сверху, консервативное
+ * обновление), а самые частые n-граммы хранятся в ограниченном наборе
+ * кандидатов: min-куча по оценке плюс хэш-индекс для поиска.
+ * Эскизы шардов складываются поэлементно, поэтому шарды считаются
+ * независимо и объединяются в конце.
+ */
+typedef struct {
+    unsigned long hash;     /* Хэш n-граммы */
+    unsigned long count;    /* Оценка частоты */
+    char*         key;      /* Слова через один пробел */
+    size_t        key_len;
+    int           n;        /* Количество слов */
+    size_t        heap_pos; /* Позиция в куче */
+} NgramCandidate;
+
+typedef struct {
+    int             max_n;      /* Наибольшая длина n-граммы в словах */
+    unsigned long*  sketch;     /* NGRAM_SKETCH_DEPTH строк по NGRAM_SKETCH_WIDTH */
+    NgramCandidate* items;
+    size_t          capacity;
+    size_t          size;
+    size_t*         heap;       /* Индексы items, min-куча по count */
+    long*           index;      /* Открытая адресация: индекс items или -1 */
+    size_t          index_mask;
+} NgramCounter;
+
+/* Результат отбора: n-грамма и ее оценка частоты */
+typedef struct {
+    unsigned long count;
+    int           n;
+    char*         key;
+    size_t        key_len;
+} NgramResult;
+
+/* MinHash-сигнатура документа по шинглам из SHINGLE_WORDS слов */
+typedef struct {
+    unsigned long values[MINHASH_SIZE];
+    size_t        shingles;  /* Количество шинглов; 0 - документ без слов */
+} MinHashSignature;
+
+/* Пара почти одинаковых документов */
+typedef struct {
+    size_t first;
+    size_t second;
+    double similarity;       /* Оценка коэффициента Жаккара */
+} DuplicatePair;
+
+/* Кодировка входного текста */
+typedef enum {
+    TEXT_ENCODING_ASCII,  /* Только байты 0x00-0x7F: годится как есть */
+    TEXT_ENCODING_UTF8,   /* Корректный UTF-8 */
+    TEXT_ENCODING_CP1251  /* Некорректный UTF-8 считается Windows-1251 */
+} TextEncoding;
+
+/* Поля строки листинга IDA ".text:00401955 loc_401955: ; CODE XREF: ..." */
+typedef enum {
+    LISTING_FIELD_SEGMENT,   /* Имя сегмента (.text, .data, ...) */
+    LISTING_FIELD_LABEL,     /* Метка или имя в начале строки */
+    LISTING_FIELD_MNEMONIC,  /* Мнемоника или директива */
+    LISTING_FIELD_OPERANDS,  /* Операнды */
+    LISTING_FIELD_COMMENT,   /* Комментарий после ';' */
+    LISTING_FIELD_COUNT
+} ListingField;
+
+/* Разбор одной строки: поле f занимает line[start[f] .. start[f] + len[f]) */
+typedef struct {
+    unsigned long address;
+    size_t        start[LISTING_FIELD_COUNT];
+    size_t        len[LISTING_FIELD_COUNT];
+} ListingLine;
+
+/*
+ * Листинг в виде таблицы по столбцам: текст каждого поля всех строк
+ * записан подряд в свой буфер. Поиск по одному полю просматривает только
+ * его столбец, остальные байты листинга не читаются.
+ */
+typedef struct {
+    char*          column[LISTING_FIELD_COUNT];
+    size_t*        offset[LISTING_FIELD_COUNT];  /* line_count + 1 границ */
+    unsigned long* address;
+    size_t         line_count;
+} ListingTable;
+
+/*
+ * Открытый индекс листинга (файл "<листинг>.idx").
+ * В файле лежат отсортированные массивы записей фиксированного размера:
+ * (адрес, смещение строки) и (имя, смещение строки). Поиск идет прямо
+ * по файлу через fseek, в память индекс целиком не загружается.
+ */
+typedef struct {
+    FILE*         file;
+    unsigned long source_size;    /* Размер листинга при построении индекса */
+    unsigned long source_sample;  /* FNV-1a выборки блоков листинга */
+    unsigned long source_hash;    /* FNV-1a всего содержимого листинга (32 бита) */
+    unsigned long address_count;
+    unsigned long symbol_count;
+    long          address_base;   /* Смещения разделов в файле индекса */
+    long          symbol_base;
+    long          pool_base;
+} ListingIndex;
+
+/* Вид ссылки: буква, которой IDA помечает перекрестную ссылку */
+typedef enum {
+    XREF_CALL  = 'p',  /* Вызов процедуры */
+    XREF_JUMP  = 'j',  /* Переход */
+    XREF_READ  = 'r',  /* Чтение данных */
+    XREF_WRITE = 'w',  /* Запись данных */
+    XREF_OFFSET = 'o'  /* Взятие адреса (offset) */
+} XrefKind;
+
+/*
+ * Граф ссылок листинга в сжатом построчном виде (CSR).
+ * Узлы - имена процедур и данных; ребра "откуда -> куда" хранятся
+ * отсортированными по источнику (out_*) и по приемнику (in_*), так что
+ * списки вызываемых и вызывающих - непрерывные участки массивов.
+ */
+typedef struct {
+    char*          pool;        /* Имена узлов подряд */
+    size_t         pool_len;
+    size_t         pool_cap;
+    size_t*        name_start;
+    size_t*        name_len;
+    size_t         node_count;
+    size_t         node_cap;
+    long*          table;       /* Открытая адресация: имя -> узел */
+    size_t         table_mask;
+    size_t         edge_count;
+    size_t*        out_offset;  /* node_count + 1 границ */
+    size_t*        out_target;
+    unsigned char* out_kind;
+    size_t*        in_offset;
+    size_t*        in_source;
+    unsigned char* in_kind;
+} XrefGraph;
+
+/* Обработчик строки листинга, в поле которой найдена фраза */
+typedef int (*ListingMatchCallback)(const ListingTable* table, size_t line, void* context);
+
 /* --- Прототипы функций --- */
 
-/* Проверяет, является ли символ разделителем */
+/* Проверяет, является ли символ разделителем (по текущему набору) */
 int isSeparator(int c);
 
-/* Сравнивает фразу с текстом в данной позиции */
+/* Заполняет набор разделителями по умолчанию: пробел, tab, \n, \r. */
+void separatorSetDefault(SeparatorSet* set);
+
+/* Добавляет в набор байты chars[0..len). */
+void separatorSetAdd(SeparatorSet* set, const char* chars, size_t len);
+
+/*
+ * Делает набор текущим для isSeparator и всех режимов поиска.
+ * Вызывается до компиляции фраз: фраза, скомпилированная с одним набором,
+ * ищется корректно только с ним же.
+ */
+void separatorSetUse(const SeparatorSet* set);
+
+/*
+ * Сравнивает фразу с текстом в данной позиции.
+ * Эталонная реализация над строками с '\0'; PhraseMatcher дает тот же результат.
+ */
 int matchPhrase(const char* text_ptr, const char* phrase_ptr);
 
+/*
+ * Компилирует фразу длины phrase_len в matcher.
+ * Возвращает TRUE при успехе, FALSE при нехватке памяти.
+ * Пустая фраза (или фраза без символов) не совпадает ни с чем.
+ */
+int phraseCompile(PhraseMatcher* matcher, const char* phrase, size_t phrase_len);
+
+/* Освобождает память, выделенную phraseCompile. */
+void phraseFree(PhraseMatcher* matcher);
+
+/* Проверяет совпадение скомпилированной фразы с text[pos..text_len). */
+int phraseMatchAt(const PhraseMatcher* matcher, const char* text, size_t text_len, size_t pos);
+
+/*
+ * Ищет все вхождения в text[0..text_len) и вызывает callback для каждого.
+ * Возвращает количество переданных в callback совпадений.
+ */
+size_t phraseSearch(const PhraseMatcher* matcher, const char* text, size_t text_len,
+                    PhraseMatchCallback callback, void* context);
+
+/*
+ * Записывает позиции совпадений в массив positions (не более capacity штук).
+ * Возвращает общее количество совпадений, которое может превышать capacity.
+ */
+size_t phraseSearchPositions(const PhraseMatcher* matcher, const char* text, size_t text_len,
+                             size_t* positions, size_t capacity);
+
+/* Инициализирует пустой набор фраз. */
+void phraseSetInit(PhraseSet* set);
+
+/*
+ * Добавляет фразу в набор. Номера фраз идут подряд с нуля.
+ * Возвращает TRUE при успехе, FALSE при нехватке памяти.
+ */
+int phraseSetAdd(PhraseSet* set, const char* phrase, size_t phrase_len);
+
+/* Строит группы и хэш-таблицу. Вызывается один раз после всех phraseSetAdd. */
+int phraseSetBuild(PhraseSet* set);
+
+/* Освобождает память набора. */
+void phraseSetFree(PhraseSet* set);
+
+/*
+ * Ищет все фразы набора в text[0..text_len) за один проход.
+ * Совпадения сообщаются в порядке конца нормализованного окна.
+ * Возвращает количество переданных в callback совпадений.
+ */
+size_t phraseSetSearch(const PhraseSet* set, const char* text, size_t text_len,
+                       PhraseSetCallback callback, void* context);
+
+/*
+ * Выделяет следующее слово (максимальную группу не-разделителей),
+ * начиная с позиции *pos. Возвращает FALSE, если слов больше нет.
+ */
+int phraseNextToken(const char* text, size_t text_len, size_t* pos,
+                    size_t* token_start, size_t* token_len);
+
+/*
+ * Готовит счетчик n-грамм длины 1..max_n с набором из candidates кандидатов.
+ * Возвращает FALSE при нехватке памяти.
+ */
+int ngramCounterInit(NgramCounter* counter, int max_n, size_t candidates);
+
+/* Освобождает память счетчика. */
+void ngramCounterFree(NgramCounter* counter);
+
+/*
+ * Учитывает n-граммы, первое слово которых начинается в text[start..end).
+ * Последние n-граммы шарда могут заходить за end - так каждая n-грамма
+ * корпуса учитывается ровно в одном шарде.
+ */
+void ngramCountShard(NgramCounter* counter, const char* text, size_t text_len,
+                     size_t start, size_t end);
+
+/*
+ * Объединяет счетчики (эскиз первого счетчика становится общим) и
+ * возвращает до top_k самых частых n-грамм по убыванию оценки.
+ * Результат освобождается ngramResultsFree.
+ */
+int ngramMerge(NgramCounter* counters, size_t counter_count, size_t top_k,
+               NgramResult** results, size_t* result_count);
+
+/* Освобождает результат ngramMerge. */
+void ngramResultsFree(NgramResult* results, size_t result_count);
+
+/* Строит MinHash-сигнатуру текста (шинглы выделяются phraseNextToken). */
+void minhashSignature(const char* text, size_t text_len, MinHashSignature* sig);
+
+/* Оценивает коэффициент Жаккара по доле совпадающих значений сигнатур. */
+double minhashSimilarity(const MinHashSignature* a, const MinHashSignature* b);
+
+/*
+ * Находит пары документов со сходством не ниже threshold.
+ * Кандидаты отбираются по LSH-полосам (без сравнения всех пар),
+ * затем проверяются по полной сигнатуре. Пары упорядочены по номерам.
+ * Результат освобождается free(); FALSE - нехватка памяти.
+ */
+int minhashFindDuplicates(const MinHashSignature* sigs, size_t count, double threshold,
+                          DuplicatePair** pairs, size_t* pair_count);
+
+/* Возвращает длину начального участка text, состоящего из ASCII-байтов. */
+size_t textAsciiPrefix(const char* text, size_t text_len);
+
+/* Проверяет, что text - корректный UTF-8 (без overlong-форм и суррогатов). */
+int textIsValidUtf8(const char* text, size_t text_len);
+
+/* Определяет кодировку текста. */
+TextEncoding textDetectEncoding(const char* text, size_t text_len);
+
+/*
+ * Приводит текст к UTF-8: текст в Windows-1251 перекодируется,
+ * ASCII и UTF-8 копируются без изменений. Результат (с завершающим '\0')
+ * освобождается free(). Возвращает FALSE при нехватке памяти.
+ */
+int textToUtf8(const char* text, size_t text_len, char** out, size_t* out_len,
+               TextEncoding* detected);
+
+/*
+ * Разбирает строку листинга IDA (без перевода строки).
+ * Возвращает FALSE, если строка не начинается с "сегмент:адрес".
+ */
+int listingParseLine(const char* line, size_t line_len, ListingLine* out);
+
+/* Строит таблицу по тексту листинга. FALSE - нехватка памяти. */
+int listingBuild(ListingTable* table, const char* text, size_t text_len);
+
+/* Освобождает память таблицы. */
+void listingFree(ListingTable* table);
+
+/*
+ * Ищет фразу в поле field каждой строки; совпадение не выходит за поле.
+ * Для каждой подходящей строки callback вызывается один раз.
+ * Возвращает количество таких строк.
+ */
+size_t listingSearch(const ListingTable* table, ListingField field,
+                     const PhraseMatcher* matcher, ListingMatchCallback callback, void* context);
+
+/*
+ * Строит индекс адресов и имен листинга lst_path и записывает его
+ * в idx_path. Возвращает FALSE при ошибке ввода-вывода или памяти.
+ */
+int listingIndexBuild(const char* lst_path, const char* idx_path);
+
+/* Открывает индекс. FALSE - файла нет или он поврежден. */
+int listingIndexOpen(ListingIndex* index, const char* idx_path);
+
+/* Закрывает индекс. */
+void listingIndexClose(ListingIndex* index);
+
+/*
+ * TRUE, если индекс построен по текущему листингу. Сверяются размер и
+ * хэш INDEX_SAMPLE_BLOCKS блоков (начало, конец и равномерно между
+ * ними) - постоянное время на запрос. При full дополнительно сверяется
+ * хэш всего файла, и тогда находится любая правка, не изменившая размер.
+ */
+int listingIndexIsCurrent(const ListingIndex* index, FILE* listing, int full);
+
+/*
+ * Находит первую строку с адресом не меньше address (интерполяционный
+ * поиск с гарантированным делением пополам). FALSE - таких строк нет.
+ */
+int listingIndexFindAddress(const ListingIndex* index, unsigned long address,
+                            unsigned long* found_address, unsigned long* line_offset);
+
+/* Находит первую строку с меткой name. FALSE - имени нет в индексе. */
+int listingIndexFindSymbol(const ListingIndex* index, const char* name, size_t name_len,
+                           unsigned long* line_offset);
+
+/*
+ * Строит граф ссылок, читая листинг построчно из потока listing.
+ * Источники ребер: комментарии CODE/DATA XREF (ссылка на текущую
+ * процедуру или метку данных) и инструкции call внутри proc/endp.
+ * Возвращает FALSE при нехватке памяти.
+ */
+int xrefGraphBuild(XrefGraph* graph, FILE* listing);
+
+/* Освобождает память графа. */
+void xrefGraphFree(XrefGraph* graph);
+
+/* Возвращает номер узла с именем name или -1. */
+long xrefGraphFind(const XrefGraph* graph, const char* name, size_t name_len);
+
 /* --- Основная программа --- */
 
-int main(void)
+/*
+ * Читает файл целиком в память. Возвращает NULL при ошибке.
+ * Нужна и библиотеке (listingIndexBuild), поэтому лежит вне PHRASE_SEARCH_NO_MAIN.
+ */
+static char* readWholeFile(const char* path, size_t* out_len)
 {
-    FILE* fin;
-    FILE* fout;
-    
-    /* Буферы данных */
-    char phrase[MAX_PHRASE_LEN];
-    char text[MAX_TEXT_LEN];
-    
-    /* Массив флагов: 1, если в позиции i начинается совпадение */
-    char match_flags[MAX_TEXT_LEN];
-    
-    /* Переменные циклов и счетчики */
-    int i;
-    int text_len = 0;
-    int ch;
-    char* newline_pos;
+    FILE* f;
+    char* data = NULL;
+    char* grown;
+    size_t len = 0;
+    size_t cap = 0;
+    size_t got;
 
-    /* 1. Инициализация памяти */
-    for (i = 0; i < MAX_TEXT_LEN; i++) {
-        text[i] = '\0';
-        match_flags[i] = 0;
-    }
-    for (i = 0; i < MAX_PHRASE_LEN; i++) {
-        phrase[i] = '\0';
+    f = fopen(path, "rb");
+    if (f == NULL) {
+        return NULL;
     }
 
-    /* 2. Чтение входных данных */
-    fin = fopen(INPUT_FILE, "r");
-    if (fin == NULL) {
-        /* Ошибка открытия входного файла */
-        return 1;
+    do {
+        if (len == cap) {
+            cap = (cap == 0) ? 65536 : cap * 2;
+            grown = (char*)realloc(data, cap);
+            if (grown == NULL) {
+                free(data);
+                fclose(f);
+                return NULL;
+            }
+            data = grown;
+        }
+        got = fread(data + len, 1, cap - len, f);
+        len += got;
+    } while (got > 0);
+
+    fclose(f);
+    *out_len = len;
+    return data;
+}
+
+#ifndef PHRASE_SEARCH_NO_MAIN
+
+/* TRUE, если задан ключ --utf8: все входные файлы приводятся к UTF-8 */
+static int normalize_input = FALSE;
+
+/* TRUE, если задан ключ --verify: свежесть индекса листинга - по хэшу всего файла */
+static int verify_index = FALSE;
+
+/*
+ * Читает входной файл режима. С ключом --utf8 текст приводится к UTF-8,
+ * и все дальнейшие позиции относятся к перекодированному тексту.
+ */
+static char* readTextFile(const char* path, size_t* out_len)
+{
+    char* raw;
+    char* utf8;
+    size_t raw_len;
+    TextEncoding encoding;
+
+    raw = readWholeFile(path, &raw_len);
+    if (raw == NULL) {
+        return NULL;
+    }
+    if (!normalize_input) {
+        *out_len = raw_len;
+        return raw;
     }
 
-    /* Чтение искомой фразы (первая строка) */
-    if (fgets(phrase, sizeof(phrase), fin) == NULL) {
-        fclose(fin);
-        /* Пустой файл - создаем пустой выходной файл */
-        fout = fopen(OUTPUT_FILE, "w");
-        if (fout != NULL) fclose(fout);
-        return 0;
+    if (!textToUtf8(raw, raw_len, &utf8, out_len, &encoding)) {
+        utf8 = NULL;
     }
+    free(raw);
+    return utf8;
+}
 
-    /* Удаление символов перевода строки из фразы */
-    newline_pos = strchr(phrase, '\n');
-    if (newline_pos != NULL) *newline_pos = '\0';
-    newline_pos = strchr(phrase, '\r');
-    if (newline_pos != NULL) *newline_pos = '\0';
+/* Обработчик совпадения набора фраз: печатает "позиция<TAB>номер фразы" */
+static int printSetMatch(size_t phrase_index, size_t position, void* context)
+{
+    fprintf((FILE*)context, "%lu\t%lu\n", (unsigned long)position, (unsigned long)phrase_index);
+    return 0;
+}
 
-    /* Чтение остального текста посимвольно */
-    while ((ch = fgetc(fin)) != EOF && text_len < MAX_TEXT_LEN - 1) {
-        text[text_len++] = (char)ch;
+/*
+ * Режим --multi <файл фраз> <файл текста>:
+ * по одной фразе в строке, поиск всех фраз за один проход по тексту.
+ */
+static int runMultiSearch(const char* phrases_path, const char* text_path)
+{
+    PhraseSet set;
+    char* phrases;
+    char* text;
+    size_t phrases_len;
+    size_t text_len;
+    size_t start = 0;
+    size_t end;
+    size_t line_end;
+    int ok = TRUE;
+
+    phrases = readTextFile(phrases_path, &phrases_len);
+    if (phrases == NULL) {
+        return 1;
     }
-    text[text_len] = '\0';
-    fclose(fin);
 
-    /* 3. Поиск совпадений */
-    /* Если фраза пустая, совпадений нет */
-    if (phrase[0] != '\0') {
-        for (i = 0; i < text_len; i++) {
-            if (matchPhrase(&text[i], phrase)) {
-                match_flags[i] = 1;
-            }
-        }
+    phraseSetInit(&set);
+    while (ok && start < phrases_len) {
+        end = start;
+        while (end < phrases_len && phrases[end] != '\n') end++;
+        /* Удаление символов перевода строки, как в основном режиме */
+        line_end = end;
+        if (line_end > start && phrases[line_end - 1] == '\r') line_end--;
+        ok = phraseSetAdd(&set, phrases + start, line_end - start);
+        start = end + 1;
     }
+    free(phrases);
 
-    /* 4. Запись результата */
-    fout = fopen(OUTPUT_FILE, "w");
-    if (fout == NULL) {
+    if (!ok || !phraseSetBuild(&set)) {
+        phraseSetFree(&set);
         return 1;
     }
 
-    for (i = 0; i < text_len; i++) {
-        /* Если в этой позиции начинается совпадение, ставим '@' */
-        if (match_flags[i]) {
-            fputc('@', fout);
-        }
-        fputc(text[i], fout);
+    text = readTextFile(text_path, &text_len);
+    if (text == NULL) {
+        phraseSetFree(&set);
+        return 1;
     }
 
-    fclose(fout);
+    phraseSetSearch(&set, text, text_len, printSetMatch, stdout);
+
+    free(text);
+    phraseSetFree(&set);
     return 0;
 }
 
-/* --- Реализация функций --- */
+/* Задание одного потока подсчета n-грамм */
+typedef struct {
+    NgramCounter* counter;
+    const char*   text;
+    size_t        text_len;
+    size_t        start;
+    size_t        end;
+} NgramJob;
 
-int isSeparator(int c)
+#ifdef PHRASE_SEARCH_THREADS
+static void* ngramThread(void* arg)
 {
-    /* 
-     * Приводим к unsigned char для безопасности 
-     * (защита от отрицательных значений char в Win-1251)
-     */
-    unsigned char uc = (unsigned char)c;
-    return (uc == ' ' || uc == '\t' || uc == '\n' || uc == '\r');
+    NgramJob* job = (NgramJob*)arg;
+    ngramCountShard(job->counter, job->text, job->text_len, job->start, job->end);
+    return NULL;
 }
+#endif
 
 /*
- * matchPhrase:
- * Проверяет, совпадает ли phrase с началом text_ptr.
- * Учитывает гибкие разделители.
+ * Режим --ngrams <N> <K> <файл>...:
+ * каждый файл делится на NGRAM_SHARDS шардов, у каждого шарда свой счетчик;
+ * в конце счетчики объединяются и печатается "оценка<TAB>n<TAB>n-грамма".
  */
-int matchPhrase(const char* text_ptr, const char* phrase_ptr)
+static int runNgramMining(int max_n, size_t top_k, int file_count, char* files[])
 {
-    const char* t = text_ptr;
-    const char* p = phrase_ptr;
+    NgramCounter counters[NGRAM_SHARDS];
+    NgramJob jobs[NGRAM_SHARDS];
+#ifdef PHRASE_SEARCH_THREADS
+    pthread_t threads[NGRAM_SHARDS];
+#endif
+    NgramResult* results;
+    size_t result_count;
+    size_t candidates;
+    char* text;
+    size_t text_len;
+    size_t r;
+    int f;
+    int k;
+    int ready = 0;
+    int status = 0;
 
-    while (*p != '\0') {
-        /* Если достигли конца текста, но фраза не закончилась - не совпадение */
-        if (*t == '\0') {
-            return FALSE;
+    /* Запас кандидатов: n-грамма, частая в корпусе, частая хотя бы в одном шарде */
+    candidates = top_k * 4 < NGRAM_MIN_CANDIDATES ? NGRAM_MIN_CANDIDATES : top_k * 4;
+    for (k = 0; k < NGRAM_SHARDS; k++) {
+        if (!ngramCounterInit(&counters[k], max_n, candidates)) {
+            status = 1;
+            break;
         }
+        ready++;
+    }
 
-        if (isSeparator(*p)) {
-            /* 
-             * Если во фразе разделитель, в тексте ТОЖЕ должен быть разделитель.
-             * Иначе это не совпадение (например "AB" не совпадает с "A B").
-             */
-            if (!isSeparator(*t)) {
-                return FALSE;
-            }
+    for (f = 0; f < file_count && status == 0; f++) {
+        text = readTextFile(files[f], &text_len);
+        if (text == NULL) {
+            status = 1;
+            break;
+        }
 
-            /* 
-             * "Схлопывание" разделителей:
-             * Пропускаем все подряд идущие разделители и во фразе, и в тексте.
-             * Группа пробелов равна любой другой группе пробелов/табов.
-             */
-            while (isSeparator(*p)) p++;
-            while (isSeparator(*t)) t++;
-        } else {
-            /* Обычный символ: строгое сравнение */
-            if ((unsigned char)*p != (unsigned char)*t) {
-                return FALSE;
+        for (k = 0; k < NGRAM_SHARDS; k++) {
+            jobs[k].counter = &counters[k];
+            jobs[k].text = text;
+            jobs[k].text_len = text_len;
+            jobs[k].start = text_len / NGRAM_SHARDS * k;
+            jobs[k].end = (k == NGRAM_SHARDS - 1) ? text_len : text_len / NGRAM_SHARDS * (k + 1);
+        }
+
+#ifdef PHRASE_SEARCH_THREADS
+        for (k = 0; k < NGRAM_SHARDS; k++) {
+            if (pthread_create(&threads[k], NULL, ngramThread, &jobs[k]) != 0) {
+                /* Не удалось создать поток - считаем шард в текущем */
+                ngramThread(&jobs[k]);
+                threads[k] = pthread_self();
             }
-            p++;
-            t++;
         }
+        for (k = 0; k < NGRAM_SHARDS; k++) {
+            if (!pthread_equal(threads[k], pthread_self())) {
+                pthread_join(threads[k], NULL);
+            }
+        }
+#else
+        for (k = 0; k < NGRAM_SHARDS; k++) {
+            ngramCountShard(jobs[k].counter, text, text_len, jobs[k].start, jobs[k].end);
+        }
+#endif
+        free(text);
     }
 
-    /* 
-     * Если мы вышли из цикла, значит вся фраза совпала.
-     * Мы НЕ проверяем, что идет после фразы (согласно примеру 4).
-     */
-    return TRUE;
+    if (status == 0 && ngramMerge(counters, NGRAM_SHARDS, top_k, &results, &result_count)) {
+        for (r = 0; r < result_count; r++) {
+            printf("%lu\t%d\t", results[r].count, results[r].n);
+            fwrite(results[r].key, 1, results[r].key_len, stdout);
+            putchar('\n');
+        }
+        ngramResultsFree(results, result_count);
+    } else {
+        status = 1;
+    }
+
+    for (k = 0; k < ready; k++) {
+        ngramCounterFree(&counters[k]);
+    }
+    return status;
+}
+
+/*
+ * Режим --dups <порог> <файл>...:
+ * печатает "сходство<TAB>файл<TAB>файл" для почти одинаковых файлов.
+ */
+static int runDuplicateSearch(double threshold, int file_count, char* files[])
+{
+    MinHashSignature* sigs;
+    DuplicatePair* pairs;
+    size_t pair_count;
+    size_t p;
+    char* text;
+    size_t text_len;
+    int f;
+
+    sigs = (MinHashSignature*)malloc((size_t)file_count * sizeof(MinHashSignature));
+    if (sigs == NULL) {
+        return 1;
+    }
+
+    /* Сигнатуры считаются по одному файлу: в памяти только текущий текст */
+    for (f = 0; f < file_count; f++) {
+        text = readTextFile(files[f], &text_len);
+        if (text == NULL) {
+            free(sigs);
+            return 1;
+        }
+        minhashSignature(text, text_len, &sigs[f]);
+        free(text);
+    }
+
+    if (!minhashFindDuplicates(sigs, (size_t)file_count, threshold, &pairs, &pair_count)) {
+        free(sigs);
+        return 1;
+    }
+
+    for (p = 0; p < pair_count; p++) {
+        printf("%.3f\t%s\t%s\n", pairs[p].similarity,
+               files[pairs[p].first], files[pairs[p].second]);
+    }
+
+    free(pairs);
+    free(sigs);
+    return 0;
+}
+
+/* Режим --encoding <файл>...: печатает определенную кодировку каждого файла */
+static int runEncodingReport(int file_count, char* files[])
+{
+    static const char* names[] = { "ascii", "utf-8", "cp1251" };
+    char* text;
+    size_t text_len;
+    int f;
+
+    for (f = 0; f < file_count; f++) {
+        text = readWholeFile(files[f], &text_len);
+        if (text == NULL) {
+            return 1;
+        }
+        printf("%s\t%s\n", names[textDetectEncoding(text, text_len)], files[f]);
+        free(text);
+    }
+    return 0;
+}
+
+/* Печатает "сегмент:адрес<TAB>поле" для найденной строки листинга */
+static int printListingMatch(const ListingTable* table, size_t line, void* context)
+{
+    ListingField field = *(ListingField*)context;
+    const size_t* seg = table->offset[LISTING_FIELD_SEGMENT];
+    const size_t* off = table->offset[field];
+
+    fwrite(table->column[LISTING_FIELD_SEGMENT] + seg[line], 1, seg[line + 1] - seg[line], stdout);
+    printf(":%08lX\t", table->address[line]);
+    fwrite(table->column[field] + off[line], 1, off[line + 1] - off[line], stdout);
+    putchar('\n');
+    return 0;
+}
+
+/*
+ * Режим --listing <поле> <фраза> <файл .lst>:
+ * поиск фразы только в заданном поле строк листинга IDA.
+ */
+static int runListingSearch(const char* field_name, const char* phrase, const char* path)
+{
+    static const char* names[LISTING_FIELD_COUNT] = {
+        "segment", "label", "mnemonic", "operands", "comment"
+    };
+    ListingTable table;
+    PhraseMatcher matcher;
+    ListingField field;
+    char* text;
+    size_t text_len;
+    int f;
+
+    for (f = 0; f < LISTING_FIELD_COUNT; f++) {
+        if (strcmp(field_name, names[f]) == 0) break;
+    }
+    if (f == LISTING_FIELD_COUNT) {
+        fprintf(stderr, "unknown field: %s\n", field_name);
+        return 2;
+    }
+    field = (ListingField)f;
+
+    text = readTextFile(path, &text_len);
+    if (text == NULL) {
+        return 1;
+    }
+    if (!listingBuild(&table, text, text_len)) {
+        free(text);
+        return 1;
+    }
+    /* После разбора исходный текст не нужен: поиск идет по столбцам */
+    free(text);
+
+    if (!phraseCompile(&matcher, phrase, strlen(phrase))) {
+        listingFree(&table);
+        return 1;
+    }
+    listingSearch(&table, field, &matcher, printListingMatch, &field);
+
+    phraseFree(&matcher);
+    listingFree(&table);
+    return 0;
+}
+
+/*
+ * Печатает строки листинга вокруг строки, начинающейся с offset:
+ * context строк до нее, ее саму и context строк после.
+ */
+static int printListingContext(FILE* lst, unsigned long offset, int context)
+{
+    char chunk[4096];
+    long start = (long)offset;
+    long pos;
+    size_t got;
+    size_t j;
+    int newlines = 0;
+    int lines = 0;
+    int c;
+
+    /*
+     * Идем назад порциями: начало строки номер context выше - это позиция
+     * после (context + 1)-го перевода строки перед offset.
+     */
+    pos = (long)offset;
+    while (newlines <= context && pos > 0) {
+        got = (pos < (long)sizeof(chunk)) ? (size_t)pos : sizeof(chunk);
+        pos -= (long)got;
+        if (fseek(lst, pos, SEEK_SET) != 0 || fread(chunk, 1, got, lst) != got) return FALSE;
+        for (j = got; j-- > 0; ) {
+            if (chunk[j] == '\n' && ++newlines > context) {
+                start = pos + (long)j + 1;
+                break;
+            }
+        }
+        if (newlines <= context) start = pos;
+    }
+
+    if (fseek(lst, start, SEEK_SET) != 0) return FALSE;
+    while (lines <= context * 2 && (c = fgetc(lst)) != EOF) {
+        putchar(c);
+        if (c == '\n') lines++;
+    }
+    if (lines <= context * 2) putchar('\n');
+    return TRUE;
+}
+
+/* Шестнадцатеричная цифра ASCII (без учета локали) */
+static int isxdigitAscii(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'F') || (c >= 'a' && c <= 'f');
+}
+
+/* Разбирает адрес вида 0x00401719, .text:00401719 или 00401719 (8 цифр) */
+static int parseListingAddress(const char* arg, unsigned long* address)
+{
+    const char* colon = strchr(arg, ':');
+    char* end;
+    int prefixed = FALSE;
+
+    if (colon != NULL) {
+        arg = colon + 1;
+    } else if (arg[0] == '0' && (arg[1] == 'x' || arg[1] == 'X')) {
+        arg += 2;
+        prefixed = TRUE;
+    }
+
+    /* strtoul пропускает пробелы и знак - такие строки адресом не считаются */
+    if (!isxdigitAscii(arg[0])) return FALSE;
+    *address = strtoul(arg, &end, 16);
+    if (*end != '\0') return FALSE;
+
+    /* Без префикса адресом считаются только 8 цифр: иначе это может быть имя */
+    return colon != NULL || prefixed || (end - arg) == 8;
+}
+
+/*
+ * Режим --index <файл .lst> <адрес|имя> [строк контекста]:
+ * индекс строится при первом обращении и перестраивается, если листинг
+ * изменился (сверяются размер и выборка блоков, с ключом --verify - хэш
+ * всего файла). Без адреса/имени только строит индекс.
+ */
+static int runListingIndex(const char* lst_path, const char* key, int context)
+{
+    ListingIndex index;
+    FILE* lst;
+    char* idx_path;
+    unsigned long address;
+    unsigned long found_address;
+    unsigned long offset;
+    int found;
+    int status = 0;
+
+    idx_path = (char*)malloc(strlen(lst_path) + sizeof(LISTING_INDEX_SUFFIX));
+    if (idx_path == NULL) {
+        return 1;
+    }
+    strcpy(idx_path, lst_path);
+    strcat(idx_path, LISTING_INDEX_SUFFIX);
+
+    lst = fopen(lst_path, "rb");
+    if (lst == NULL) {
+        free(idx_path);
+        return 1;
+    }
+
+    if (!listingIndexOpen(&index, idx_path) || !listingIndexIsCurrent(&index, lst, verify_index)) {
+        if (index.file != NULL) listingIndexClose(&index);
+        if (!listingIndexBuild(lst_path, idx_path) || !listingIndexOpen(&index, idx_path)) {
+            fclose(lst);
+            free(idx_path);
+            return 1;
+        }
+    }
+
+    if (key != NULL) {
+        if (parseListingAddress(key, &address)) {
+            found = listingIndexFindAddress(&index, address, &found_address, &offset);
+        } else {
+            found = listingIndexFindSymbol(&index, key, strlen(key), &offset);
+        }
+        if (!found) {
+            fprintf(stderr, "not found: %s\n", key);
+            status = 1;
+        } else if (!printListingContext(lst, offset, context)) {
+            status = 1;
+        }
+    }
+
+    listingIndexClose(&index);
+    fclose(lst);
+    free(idx_path);
+    return status;
+}
+
+/* Печатает имя узла графа ссылок */
+static void printXrefNode(const XrefGraph* graph, size_t node)
+{
+    fwrite(graph->pool + graph->name_start[node], 1, graph->name_len[node], stdout);
+}
+
+/*
+ * Режим --xref <файл .lst> <edges|callees|callers|reach> [имя]:
+ * edges - все ребра "источник<TAB>вид<TAB>приемник";
+ * callees/callers - соседи узла; reach - все узлы, достижимые из имени,
+ * с глубиной (обход в ширину по исходящим ребрам).
+ */
+static int runXrefQuery(const char* path, const char* query, const char* name)
+{
+    XrefGraph graph;
+    FILE* listing;
+    size_t* queue;
+    long* depth;
+    size_t head = 0;
+    size_t tail = 0;
+    size_t node;
+    size_t e;
+    long start = -1;
+    int status = 0;
+
+    listing = fopen(path, "rb");
+    if (listing == NULL) {
+        return 1;
+    }
+    if (!xrefGraphBuild(&graph, listing)) {
+        fclose(listing);
+        return 1;
+    }
+    fclose(listing);
+
+    if (strcmp(query, "edges") != 0) {
+        if (name == NULL || (start = xrefGraphFind(&graph, name, strlen(name))) < 0) {
+            fprintf(stderr, "not found: %s\n", name != NULL ? name : "");
+            xrefGraphFree(&graph);
+            return 1;
+        }
+    }
+
+    if (strcmp(query, "edges") == 0) {
+        for (node = 0; node < graph.node_count; node++) {
+            for (e = graph.out_offset[node]; e < graph.out_offset[node + 1]; e++) {
+                printXrefNode(&graph, node);
+                printf("\t%c\t", graph.out_kind[e]);
+                printXrefNode(&graph, graph.out_target[e]);
+                putchar('\n');
+            }
+        }
+    } else if (strcmp(query, "callees") == 0) {
+        for (e = graph.out_offset[start]; e < graph.out_offset[start + 1]; e++) {
+            printf("%c\t", graph.out_kind[e]);
+            printXrefNode(&graph, graph.out_target[e]);
+            putchar('\n');
+        }
+    } else if (strcmp(query, "callers") == 0) {
+        for (e = graph.in_offset[start]; e < graph.in_offset[start + 1]; e++) {
+            printf("%c\t", graph.in_kind[e]);
+            printXrefNode(&graph, graph.in_source[e]);
+            putchar('\n');
+        }
+    } else if (strcmp(query, "reach") == 0) {
+        queue = (size_t*)malloc((graph.node_count + 1) * sizeof(size_t));
+        depth = (long*)malloc((graph.node_count + 1) * sizeof(long));
+        if (queue == NULL || depth == NULL) {
+            status = 1;
+        } else {
+            for (node = 0; node < graph.node_count; node++) depth[node] = -1;
+            depth[start] = 0;
+            queue[tail++] = (size_t)start;
+            while (head < tail) {
+                node = queue[head++];
+                printf("%ld\t", depth[node]);
+                printXrefNode(&graph, node);
+                putchar('\n');
+                for (e = graph.out_offset[node]; e < graph.out_offset[node + 1]; e++) {
+                    if (depth[graph.out_target[e]] < 0) {
+                        depth[graph.out_target[e]] = depth[node] + 1;
+                        queue[tail++] = graph.out_target[e];
+                    }
+                }
+            }
+        }
+        free(queue);
+        free(depth);
+    } else {
+        fprintf(stderr, "unknown query: %s\n", query);
+        status = 2;
+    }
+
+    xrefGraphFree(&graph);
+    return status;
+}
+
+/*
+ * Добавляет к разделителям символы из аргумента --separators.
+ * Понимает экранирование \t, \n, \r, \\ и \xHH (например \xA0 - NBSP в Win-1251).
+ */
+static void addSeparatorArgument(SeparatorSet* set, const char* arg)
+{
+    char c;
+    char digits[3];
+
+    while (*arg != '\0') {
+        c = *arg++;
+        if (c == '\\' && *arg != '\0') {
+            c = *arg++;
+            if (c == 't') c = '\t';
+            else if (c == 'n') c = '\n';
+            else if (c == 'r') c = '\r';
+            else if (c == 'x' && arg[0] != '\0' && arg[1] != '\0') {
+                digits[0] = arg[0];
+                digits[1] = arg[1];
+                digits[2] = '\0';
+                c = (char)strtol(digits, NULL, 16);
+                arg += 2;
+            }
+        }
+        separatorSetAdd(set, &c, 1);
+    }
+}
+
+/* Разбор командной строки. Без аргументов работает классический режим. */
+static int runCommand(int argc, char* argv[])
+{
+    SeparatorSet separators;
+    int max_n;
+    long top_k;
+
+    /* Общие ключи ставятся перед режимом */
+    if (strcmp(argv[1], "--utf8") == 0 && argc > 2) {
+        normalize_input = TRUE;
+        argv[1] = argv[0];
+        return runCommand(argc - 1, argv + 1);
+    }
+    if (strcmp(argv[1], "--verify") == 0 && argc > 2) {
+        verify_index = TRUE;
+        argv[1] = argv[0];
+        return runCommand(argc - 1, argv + 1);
+    }
+    if (strcmp(argv[1], "--separators") == 0 && argc > 3) {
+        separatorSetDefault(&separators);
+        addSeparatorArgument(&separators, argv[2]);
+        separatorSetUse(&separators);
+        argv[2] = argv[0];
+        return runCommand(argc - 2, argv + 2);
+    }
+
+    if (strcmp(argv[1], "--multi") == 0 && argc == 4) {
+        return runMultiSearch(argv[2], argv[3]);
+    }
+    if (strcmp(argv[1], "--ngrams") == 0 && argc >= 5) {
+        max_n = atoi(argv[2]);
+        top_k = atol(argv[3]);
+        if (max_n >= 1 && max_n <= NGRAM_MAX_N && top_k >= 1) {
+            return runNgramMining(max_n, (size_t)top_k, argc - 4, argv + 4);
+        }
+    }
+
+    if (strcmp(argv[1], "--dups") == 0 && argc >= 4) {
+        return runDuplicateSearch(atof(argv[2]), argc - 3, argv + 3);
+    }
+    if (strcmp(argv[1], "--encoding") == 0 && argc >= 3) {
+        return runEncodingReport(argc - 2, argv + 2);
+    }
+    if (strcmp(argv[1], "--listing") == 0 && argc == 5) {
+        return runListingSearch(argv[2], argv[3], argv[4]);
+    }
+    if (strcmp(argv[1], "--xref") == 0 && (argc == 4 || argc == 5)) {
+        return runXrefQuery(argv[2], argv[3], argc == 5 ? argv[4] : NULL);
+    }
+    if (strcmp(argv[1], "--index") == 0 && argc >= 3 && argc <= 5) {
+        return runListingIndex(argv[2], argc >= 4 ? argv[3] : NULL,
+                               argc == 5 ? atoi(argv[4]) : LISTING_CONTEXT_LINES);
+    }
+
+    fprintf(stderr, "usage: %s [options] --multi <phrases> <text>\n"
+                    "       %s [options] --ngrams <N> <K> <files>...\n"
+                    "       %s [options] --dups <threshold> <files>...\n"
+                    "       %s --encoding <files>...\n"
+                    "       %s [options] --listing <segment|label|mnemonic|operands|comment> <phrase> <file.lst>\n"
+                    "       %s [--verify] --index <file.lst> [<address>|<name> [context]]\n"
+                    "       %s --xref <file.lst> <edges|callees|callers|reach> [name]\n"
+                    "options: --utf8, --separators <chars>\n",
+            argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+    return 2;
+}
+
+/* Обработчик совпадения для main: отмечает позицию в массиве флагов */
+static int markMatch(size_t position, void* context)
+{
+    ((char*)context)[position] = 1;
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    FILE* fin;
+    FILE* fout;
+    
+    /* Буферы данных */
+    char phrase[MAX_PHRASE_LEN];
+    char text[MAX_TEXT_LEN];
+    
+    /* Массив флагов: 1, если в позиции i начинается совпадение */
+    char match_flags[MAX_TEXT_LEN];
+    
+    /* Скомпилированная фраза */
+    PhraseMatcher matcher;
+
+    /* Переменные циклов и счетчики */
+    int i;
+    int text_len = 0;
+    int ch;
+    char* newline_pos;
+
+    /* Дополнительные режимы работы задаются аргументами командной строки */
+    if (argc > 1) {
+        return runCommand(argc, argv);
+    }
+
+    /* 1. Инициализация памяти */
+    for (i = 0; i < MAX_TEXT_LEN; i++) {
+        text[i] = '\0';
+        match_flags[i] = 0;
+    }
+    for (i = 0; i < MAX_PHRASE_LEN; i++) {
+        phrase[i] = '\0';
+    }
+
+    /* 2. Чтение входных данных */
+    fin = fopen(INPUT_FILE, "r");
+    if (fin == NULL) {
+        /* Ошибка открытия входного файла */
+        return 1;
+    }
+
+    /* Чтение искомой фразы (первая строка) */
+    if (fgets(phrase, sizeof(phrase), fin) == NULL) {
+        fclose(fin);
+        /* Пустой файл - создаем пустой выходной файл */
+        fout = fopen(OUTPUT_FILE, "w");
+        if (fout != NULL) fclose(fout);
+        return 0;
+    }
+
+    /* Удаление символов перевода строки из фразы */
+    newline_pos = strchr(phrase, '\n');
+    if (newline_pos != NULL) *newline_pos = '\0';
+    newline_pos = strchr(phrase, '\r');
+    if (newline_pos != NULL) *newline_pos = '\0';
+
+    /* Чтение остального текста посимвольно */
+    while ((ch = fgetc(fin)) != EOF && text_len < MAX_TEXT_LEN - 1) {
+        text[text_len++] = (char)ch;
+    }
+    text[text_len] = '\0';
+    fclose(fin);
+
+    /* 3. Поиск совпадений */
+    /* Если фраза пустая, совпадений нет (это обеспечивает phraseCompile) */
+    if (!phraseCompile(&matcher, phrase, strlen(phrase))) {
+        return 1;
+    }
+    phraseSearch(&matcher, text, (size_t)text_len, markMatch, match_flags);
+    phraseFree(&matcher);
+
+    /* 4. Запись результата */
+    fout = fopen(OUTPUT_FILE, "w");
+    if (fout == NULL) {
+        return 1;
+    }
+
+    for (i = 0; i < text_len; i++) {
+        /* Если в этой позиции начинается совпадение, ставим '@' */
+        if (match_flags[i]) {
+            fputc('@', fout);
+        }
+        fputc(text[i], fout);
+    }
+
+    fclose(fout);
+    return 0;
+}
+
+#endif /* PHRASE_SEARCH_NO_MAIN */
+
+/* --- Реализация функций --- */
+
+/*
+ * Текущий набор разделителей. По умолчанию: '\t' и '\n' (биты 1 и 2
+ * байта 1), '\r' (бит 5 байта 1) и ' ' (бит 0 байта 4).
+ */
+static SeparatorSet active_separators = { { 0x00, 0x26, 0x00, 0x00, 0x01 } };
+
+int isSeparator(int c)
+{
+    /* 
+     * Приводим к unsigned char для безопасности 
+     * (защита от отрицательных значений char в Win-1251)
+     */
+    unsigned char uc = (unsigned char)c;
+    return (active_separators.bits[uc >> 3] >> (uc & 7)) & 1;
+}
+
+void separatorSetDefault(SeparatorSet* set)
+{
+    memset(set->bits, 0, sizeof(set->bits));
+    separatorSetAdd(set, " \t\n\r", 4);
+}
+
+void separatorSetAdd(SeparatorSet* set, const char* chars, size_t len)
+{
+    size_t i;
+    unsigned char uc;
+
+    for (i = 0; i < len; i++) {
+        uc = (unsigned char)chars[i];
+        set->bits[uc >> 3] |= (unsigned char)(1 << (uc & 7));
+    }
+}
+
+void separatorSetUse(const SeparatorSet* set)
+{
+    active_separators = *set;
+}
+
+/*
+ * matchPhrase:
+ * Проверяет, совпадает ли phrase с началом text_ptr.
+ * Учитывает гибкие разделители.
+ */
+int matchPhrase(const char* text_ptr, const char* phrase_ptr)
+{
+    const char* t = text_ptr;
+    const char* p = phrase_ptr;
+
+    while (*p != '\0') {
+        /* Если достигли конца текста, но фраза не закончилась - не совпадение */
+        if (*t == '\0') {
+            return FALSE;
+        }
+
+        if (isSeparator(*p)) {
+            /* 
+             * Если во фразе разделитель, в тексте ТОЖЕ должен быть разделитель.
+             * Иначе это не совпадение (например "AB" не совпадает с "A B").
+             */
+            if (!isSeparator(*t)) {
+                return FALSE;
+            }
+
+            /* 
+             * "Схлопывание" разделителей:
+             * Пропускаем все подряд идущие разделители и во фразе, и в тексте.
+             * Группа пробелов равна любой другой группе пробелов/табов.
+             */
+            while (isSeparator(*p)) p++;
+            while (isSeparator(*t)) t++;
+        } else {
+            /* Обычный символ: строгое сравнение */
+            if ((unsigned char)*p != (unsigned char)*t) {
+                return FALSE;
+            }
+            p++;
+            t++;
+        }
+    }
+
+    /* 
+     * Если мы вышли из цикла, значит вся фраза совпала.
+     * Мы НЕ проверяем, что идет после фразы (согласно примеру 4).
+     */
+    return TRUE;
+}
+
+/* --- Библиотечный интерфейс: реализация --- */
+
+int phraseCompile(PhraseMatcher* matcher, const char* phrase, size_t phrase_len)
+{
+    size_t i;
+    size_t lit_len = 0;
+    size_t count = 0;
+    int in_segment = FALSE;
+
+    matcher->literals = NULL;
+    matcher->segment_len = NULL;
+    matcher->segment_count = 0;
+    matcher->leading_sep = (phrase_len > 0 && isSeparator(phrase[0]));
+    matcher->trailing_sep = (phrase_len > 0 && isSeparator(phrase[phrase_len - 1]));
+
+    /* Первый проход: считаем сегменты и их суммарную длину */
+    for (i = 0; i < phrase_len; i++) {
+        if (isSeparator(phrase[i])) {
+            in_segment = FALSE;
+        } else {
+            if (!in_segment) count++;
+            in_segment = TRUE;
+            lit_len++;
+        }
+    }
+
+    /*
+     * Выделяем хотя бы один байт/элемент, чтобы успешный результат
+     * никогда не путался с ошибкой malloc(0) == NULL.
+     */
+    matcher->literals = (char*)malloc(lit_len + 1);
+    matcher->segment_len = (size_t*)malloc((count + 1) * sizeof(size_t));
+    if (matcher->literals == NULL || matcher->segment_len == NULL) {
+        phraseFree(matcher);
+        return FALSE;
+    }
+
+    /* Второй проход: копируем сегменты */
+    lit_len = 0;
+    in_segment = FALSE;
+    for (i = 0; i < phrase_len; i++) {
+        if (isSeparator(phrase[i])) {
+            in_segment = FALSE;
+        } else {
+            if (!in_segment) {
+                matcher->segment_len[matcher->segment_count++] = 0;
+            }
+            in_segment = TRUE;
+            matcher->literals[lit_len++] = phrase[i];
+            matcher->segment_len[matcher->segment_count - 1]++;
+        }
+    }
+
+    return TRUE;
+}
+
+void phraseFree(PhraseMatcher* matcher)
+{
+    free(matcher->literals);
+    free(matcher->segment_len);
+    matcher->literals = NULL;
+    matcher->segment_len = NULL;
+    matcher->segment_count = 0;
+}
+
+int phraseMatchAt(const PhraseMatcher* matcher, const char* text, size_t text_len, size_t pos)
+{
+    const char* lit = matcher->literals;
+    size_t s;
+    size_t t = pos;
+
+    /* Группа разделителей в начале фразы: в тексте нужен хотя бы один */
+    if (matcher->leading_sep) {
+        if (t >= text_len || !isSeparator(text[t])) return FALSE;
+        while (t < text_len && isSeparator(text[t])) t++;
+    }
+
+    for (s = 0; s < matcher->segment_count; s++) {
+        /* Между сегментами всегда стоит группа разделителей */
+        if (s > 0) {
+            if (t >= text_len || !isSeparator(text[t])) return FALSE;
+            while (t < text_len && isSeparator(text[t])) t++;
+        }
+
+        /* Сегмент сравнивается строго, как обычные символы в matchPhrase */
+        if (text_len - t < matcher->segment_len[s]) return FALSE;
+        if (memcmp(text + t, lit, matcher->segment_len[s]) != 0) return FALSE;
+
+        t += matcher->segment_len[s];
+        lit += matcher->segment_len[s];
+    }
+
+    /* Завершающая группа: после последнего сегмента нужен разделитель */
+    if (matcher->trailing_sep && matcher->segment_count > 0) {
+        if (t >= text_len || !isSeparator(text[t])) return FALSE;
+    }
+
+    return TRUE;
+}
+
+size_t phraseSearch(const PhraseMatcher* matcher, const char* text, size_t text_len,
+                    PhraseMatchCallback callback, void* context)
+{
+    size_t i = 0;
+    size_t found = 0;
+    const char* candidate;
+
+    /* Пустая фраза не совпадает ни с чем */
+    if (matcher->segment_count == 0 && !matcher->leading_sep) {
+        return 0;
+    }
+
+    while (i < text_len) {
+        /*
+         * Если фраза начинается с обычного символа, совпадение возможно
+         * только там, где стоит этот символ: переходим к нему через memchr.
+         */
+        if (!matcher->leading_sep) {
+            candidate = (const char*)memchr(text + i, matcher->literals[0], text_len - i);
+            if (candidate == NULL) break;
+            i = (size_t)(candidate - text);
+        }
+
+        if (phraseMatchAt(matcher, text, text_len, i)) {
+            found++;
+            if (callback != NULL && callback(i, context) != 0) break;
+        }
+        i++;
+    }
+
+    return found;
+}
+
+/* Контекст для phraseSearchPositions */
+typedef struct {
+    size_t* positions;
+    size_t  capacity;
+    size_t  stored;
+} PositionSink;
+
+static int storePosition(size_t position, void* context)
+{
+    PositionSink* sink = (PositionSink*)context;
+    if (sink->stored < sink->capacity) {
+        sink->positions[sink->stored++] = position;
+    }
+    return 0;
+}
+
+size_t phraseSearchPositions(const PhraseMatcher* matcher, const char* text, size_t text_len,
+                             size_t* positions, size_t capacity)
+{
+    PositionSink sink;
+
+    sink.positions = positions;
+    sink.capacity = capacity;
+    sink.stored = 0;
+
+    return phraseSearch(matcher, text, text_len, storePosition, &sink);
+}
+
+/* --- Набор фраз: поиск Рабина-Карпа --- */
+
+/* Основание полиномиального хэша; арифметика по модулю 2^(бит в unsigned long) */
+#define HASH_BASE 1000003UL
+
+/* Условный код группы разделителей в нормализованном потоке */
+#define NORM_SEPARATOR 257UL
+
+/* Начальная емкость массива фраз */
+#define PHRASE_SET_INITIAL 16
+
+/* Код обычного байта в нормализованном потоке (0 не используется) */
+#define NORM_BYTE(c) ((unsigned long)(unsigned char)(c) + 1UL)
+
+/* Перемешивание (длина, хэш) для выбора ячейки таблицы */
+static size_t phraseSetSlot(size_t length, unsigned long hash, size_t mask)
+{
+    unsigned long h = hash ^ ((unsigned long)length * 0x9E3779B1UL);
+    h ^= h >> 15;
+    h *= 0x2C1B3C6DUL;
+    h ^= h >> 12;
+    return (size_t)h & mask;
+}
+
+/* Вычисляет хэш и длину нормализованной формы скомпилированной фразы */
+static unsigned long phraseNormalizedHash(const PhraseMatcher* matcher, size_t* out_len)
+{
+    unsigned long h = 0;
+    size_t len = 0;
+    size_t s;
+    size_t k;
+    const char* lit = matcher->literals;
+
+    if (matcher->leading_sep) {
+        h = h * HASH_BASE + NORM_SEPARATOR;
+        len++;
+    }
+    for (s = 0; s < matcher->segment_count; s++) {
+        if (s > 0) {
+            h = h * HASH_BASE + NORM_SEPARATOR;
+            len++;
+        }
+        for (k = 0; k < matcher->segment_len[s]; k++) {
+            h = h * HASH_BASE + NORM_BYTE(lit[k]);
+        }
+        len += matcher->segment_len[s];
+        lit += matcher->segment_len[s];
+    }
+    if (matcher->trailing_sep && matcher->segment_count > 0) {
+        h = h * HASH_BASE + NORM_SEPARATOR;
+        len++;
+    }
+
+    *out_len = len;
+    return h;
+}
+
+void phraseSetInit(PhraseSet* set)
+{
+    set->entries = NULL;
+    set->count = 0;
+    set->capacity = 0;
+    set->groups = NULL;
+    set->group_count = 0;
+    set->table = NULL;
+    set->table_mask = 0;
+    set->max_len = 0;
+}
+
+int phraseSetAdd(PhraseSet* set, const char* phrase, size_t phrase_len)
+{
+    PhraseEntry* grown;
+    PhraseEntry* entry;
+    size_t new_cap;
+
+    if (set->count == set->capacity) {
+        new_cap = (set->capacity == 0) ? PHRASE_SET_INITIAL : set->capacity * 2;
+        grown = (PhraseEntry*)realloc(set->entries, new_cap * sizeof(PhraseEntry));
+        if (grown == NULL) {
+            return FALSE;
+        }
+        set->entries = grown;
+        set->capacity = new_cap;
+    }
+
+    entry = &set->entries[set->count];
+    if (!phraseCompile(&entry->matcher, phrase, phrase_len)) {
+        return FALSE;
+    }
+    entry->hash = phraseNormalizedHash(&entry->matcher, &entry->norm_len);
+    entry->next_same = -1;
+    set->count++;
+
+    if (entry->norm_len > set->max_len) {
+        set->max_len = entry->norm_len;
+    }
+    return TRUE;
+}
+
+int phraseSetBuild(PhraseSet* set)
+{
+    size_t i;
+    size_t g;
+    size_t k;
+    size_t slot;
+    size_t table_size = 1;
+    char* seen_len;
+    PhraseEntry* entry;
+    long head;
+
+    /* Отмечаем встречающиеся длины (пустые фразы длины 0 не ищутся) */
+    seen_len = (char*)calloc(set->max_len + 1, 1);
+    if (seen_len == NULL) {
+        return FALSE;
+    }
+    for (i = 0; i < set->count; i++) {
+        seen_len[set->entries[i].norm_len] = 1;
+    }
+    seen_len[0] = 0;
+
+    set->group_count = 0;
+    for (k = 1; k <= set->max_len; k++) {
+        if (seen_len[k]) set->group_count++;
+    }
+    set->groups = (PhraseGroup*)malloc((set->group_count + 1) * sizeof(PhraseGroup));
+    if (set->groups == NULL) {
+        free(seen_len);
+        return FALSE;
+    }
+
+    g = 0;
+    for (k = 1; k <= set->max_len; k++) {
+        if (!seen_len[k]) continue;
+        set->groups[g].length = k;
+        set->groups[g].power = 1;
+        for (i = 1; i < k; i++) {
+            set->groups[g].power *= HASH_BASE;
+        }
+        g++;
+    }
+    free(seen_len);
+
+    /* Таблица заполнена не более чем наполовину */
+    while (table_size < set->count * 2) table_size <<= 1;
+    set->table = (long*)malloc(table_size * sizeof(long));
+    if (set->table == NULL) {
+        return FALSE;
+    }
+    set->table_mask = table_size - 1;
+    for (i = 0; i < table_size; i++) {
+        set->table[i] = -1;
+    }
+
+    /*
+     * Вставка в обратном порядке: цепочка одинаковых (длина, хэш)
+     * перечисляется в порядке добавления фраз.
+     */
+    for (i = set->count; i-- > 0; ) {
+        entry = &set->entries[i];
+        if (entry->norm_len == 0) continue;
+
+        slot = phraseSetSlot(entry->norm_len, entry->hash, set->table_mask);
+        while ((head = set->table[slot]) != -1) {
+            if (set->entries[head].norm_len == entry->norm_len &&
+                set->entries[head].hash == entry->hash) {
+                break;
+            }
+            slot = (slot + 1) & set->table_mask;
+        }
+        entry->next_same = head;
+        set->table[slot] = (long)i;
+    }
+
+    return TRUE;
+}
+
+void phraseSetFree(PhraseSet* set)
+{
+    size_t i;
+
+    for (i = 0; i < set->count; i++) {
+        phraseFree(&set->entries[i].matcher);
+    }
+    free(set->entries);
+    free(set->groups);
+    free(set->table);
+    phraseSetInit(set);
+}
+
+/* Символ нормализованного потока и его место в исходном тексте */
+typedef struct {
+    unsigned long code;   /* NORM_BYTE(c) или NORM_SEPARATOR */
+    size_t        offset; /* Начало в исходном тексте */
+    size_t        run;    /* Длина группы разделителей (1 для обычного байта) */
+} NormSymbol;
+
+/* Состояние одного прохода phraseSetSearch */
+typedef struct {
+    const PhraseSet*  set;
+    const char*       text;
+    size_t            text_len;
+    NormSymbol*       ring;      /* Последние max_len + 1 символов */
+    size_t            ring_size;
+    unsigned long*    hashes;    /* Скользящий хэш каждой группы */
+    size_t            pushed;    /* Всего символов в потоке */
+    size_t            found;
+    PhraseSetCallback callback;
+    void*             context;
+    int               stopped;
+} PhraseSetScan;
+
+/*
+ * Проверяет кандидатов для окна длины length, оканчивающегося символом
+ * номер end - 1. Возвращает FALSE, если обработчик прекратил поиск.
+ */
+static int phraseSetReport(PhraseSetScan* scan, size_t length, unsigned long hash, size_t end)
+{
+    const PhraseSet* set = scan->set;
+    const NormSymbol* first;
+    size_t slot;
+    size_t pos;
+    long e;
+
+    slot = phraseSetSlot(length, hash, set->table_mask);
+    while ((e = set->table[slot]) != -1) {
+        if (set->entries[e].norm_len == length && set->entries[e].hash == hash) break;
+        slot = (slot + 1) & set->table_mask;
+    }
+    if (e == -1) return TRUE;
+
+    first = &scan->ring[(end - length) % scan->ring_size];
+    for (; e != -1; e = set->entries[e].next_same) {
+        /* Проверка отсекает коллизии хэша */
+        if (!phraseMatchAt(&set->entries[e].matcher, scan->text, scan->text_len, first->offset)) {
+            continue;
+        }
+        /*
+         * Фраза, начинающаяся с разделителя, совпадает в каждой позиции
+         * группы разделителей - так же, как matchPhrase.
+         */
+        for (pos = first->offset; pos < first->offset + first->run; pos++) {
+            scan->found++;
+            if (scan->callback != NULL &&
+                scan->callback((size_t)e, pos, scan->context) != 0) {
+                return FALSE;
+            }
+        }
+    }
+    return TRUE;
+}
+
+/* Добавляет символ в нормализованный поток и проверяет все группы */
+static void phraseSetPush(PhraseSetScan* scan, unsigned long code, size_t offset, size_t run)
+{
+    const PhraseSet* set = scan->set;
+    NormSymbol* slot;
+    unsigned long out;
+    size_t g;
+    size_t len;
+
+    slot = &scan->ring[scan->pushed % scan->ring_size];
+    slot->code = code;
+    slot->offset = offset;
+    slot->run = run;
+
+    for (g = 0; g < set->group_count && !scan->stopped; g++) {
+        len = set->groups[g].length;
+        /* Удаляем символ, выпавший из окна, и добавляем новый */
+        if (scan->pushed >= len) {
+            out = scan->ring[(scan->pushed - len) % scan->ring_size].code;
+            scan->hashes[g] -= out * set->groups[g].power;
+        }
+        scan->hashes[g] = scan->hashes[g] * HASH_BASE + code;
+
+        if (scan->pushed + 1 >= len &&
+            !phraseSetReport(scan, len, scan->hashes[g], scan->pushed + 1)) {
+            scan->stopped = TRUE;
+        }
+    }
+    scan->pushed++;
+}
+
+size_t phraseSetSearch(const PhraseSet* set, const char* text, size_t text_len,
+                       PhraseSetCallback callback, void* context)
+{
+    PhraseSetScan scan;
+    size_t i;
+    size_t run_start = 0;
+    int in_run = FALSE;
+
+    if (set->group_count == 0 || set->table == NULL) {
+        return 0;
+    }
+
+    scan.set = set;
+    scan.text = text;
+    scan.text_len = text_len;
+    scan.ring_size = set->max_len + 1;
+    scan.ring = (NormSymbol*)malloc(scan.ring_size * sizeof(NormSymbol));
+    scan.hashes = (unsigned long*)calloc(set->group_count, sizeof(unsigned long));
+    scan.pushed = 0;
+    scan.found = 0;
+    scan.callback = callback;
+    scan.context = context;
+    scan.stopped = FALSE;
+
+    if (scan.ring == NULL || scan.hashes == NULL) {
+        free(scan.ring);
+        free(scan.hashes);
+        return 0;
+    }
+
+    /*
+     * Группа разделителей попадает в поток, когда она закончилась:
+     * к этому моменту известна ее длина в исходном тексте.
+     */
+    for (i = 0; i < text_len && !scan.stopped; i++) {
+        if (isSeparator(text[i])) {
+            if (!in_run) run_start = i;
+            in_run = TRUE;
+            continue;
+        }
+        if (in_run) {
+            phraseSetPush(&scan, NORM_SEPARATOR, run_start, i - run_start);
+            in_run = FALSE;
+            if (scan.stopped) break;
+        }
+        phraseSetPush(&scan, NORM_BYTE(text[i]), i, 1);
+    }
+    if (in_run && !scan.stopped) {
+        phraseSetPush(&scan, NORM_SEPARATOR, run_start, text_len - run_start);
+    }
+
+    free(scan.ring);
+    free(scan.hashes);
+    return scan.found;
+}
+
+/* --- Слова и n-граммы --- */
+
+int phraseNextToken(const char* text, size_t text_len, size_t* pos,
+                    size_t* token_start, size_t* token_len)
+{
+    size_t i = *pos;
+
+    while (i < text_len && isSeparator(text[i])) i++;
+    if (i >= text_len) {
+        *pos = i;
+        return FALSE;
+    }
+
+    *token_start = i;
+    while (i < text_len && !isSeparator(text[i])) i++;
+    *token_len = i - *token_start;
+    *pos = i;
+    return TRUE;
+}
+
+/* Хэш одного слова (FNV-1a) */
+static unsigned long tokenHash(const char* token, size_t len)
+{
+    unsigned long h = 2166136261UL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)token[i];
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+/* Перемешивание битов хэша (финализатор MurmurHash3) */
+static unsigned long mixHash(unsigned long h)
+{
+    h ^= h >> 16;
+    h *= 0x85EBCA6BUL;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35UL;
+    h ^= h >> 16;
+    return h;
+}
+
+/* Ячейка строки row эскиза для хэша h */
+static size_t sketchCell(unsigned long h, int row)
+{
+    h = mixHash(h + (unsigned long)row * 0x9E3779B9UL);
+    return (size_t)row * NGRAM_SKETCH_WIDTH + ((size_t)h & (NGRAM_SKETCH_WIDTH - 1));
+}
+
+/* Консервативное обновление: увеличиваются только минимальные счетчики */
+static unsigned long sketchAdd(unsigned long* sketch, unsigned long h)
+{
+    size_t cells[NGRAM_SKETCH_DEPTH];
+    unsigned long est;
+    int r;
+
+    cells[0] = sketchCell(h, 0);
+    est = sketch[cells[0]];
+    for (r = 1; r < NGRAM_SKETCH_DEPTH; r++) {
+        cells[r] = sketchCell(h, r);
+        if (sketch[cells[r]] < est) est = sketch[cells[r]];
+    }
+    est++;
+    for (r = 0; r < NGRAM_SKETCH_DEPTH; r++) {
+        if (sketch[cells[r]] < est) sketch[cells[r]] = est;
+    }
+    return est;
+}
+
+/* Оценка частоты по эскизу */
+static unsigned long sketchQuery(const unsigned long* sketch, unsigned long h)
+{
+    unsigned long est = sketch[sketchCell(h, 0)];
+    unsigned long v;
+    int r;
+
+    for (r = 1; r < NGRAM_SKETCH_DEPTH; r++) {
+        v = sketch[sketchCell(h, r)];
+        if (v < est) est = v;
+    }
+    return est;
+}
+
+int ngramCounterInit(NgramCounter* counter, int max_n, size_t candidates)
+{
+    size_t index_size = 1;
+    size_t i;
+
+    while (index_size < candidates * 2) index_size <<= 1;
+
+    counter->max_n = max_n;
+    counter->capacity = candidates;
+    counter->size = 0;
+    counter->index_mask = index_size - 1;
+    counter->sketch = (unsigned long*)calloc((size_t)NGRAM_SKETCH_DEPTH * NGRAM_SKETCH_WIDTH,
+                                             sizeof(unsigned long));
+    counter->items = (NgramCandidate*)malloc(candidates * sizeof(NgramCandidate));
+    counter->heap = (size_t*)malloc(candidates * sizeof(size_t));
+    counter->index = (long*)malloc(index_size * sizeof(long));
+
+    if (counter->sketch == NULL || counter->items == NULL ||
+        counter->heap == NULL || counter->index == NULL) {
+        ngramCounterFree(counter);
+        return FALSE;
+    }
+    for (i = 0; i < index_size; i++) {
+        counter->index[i] = -1;
+    }
+    return TRUE;
+}
+
+void ngramCounterFree(NgramCounter* counter)
+{
+    size_t i;
+
+    if (counter->items != NULL) {
+        for (i = 0; i < counter->size; i++) {
+            free(counter->items[i].key);
+        }
+    }
+    free(counter->sketch);
+    free(counter->items);
+    free(counter->heap);
+    free(counter->index);
+    counter->sketch = NULL;
+    counter->items = NULL;
+    counter->heap = NULL;
+    counter->index = NULL;
+    counter->size = 0;
+}
+
+/* Последние слова шарда: начало, длина и хэш */
+typedef struct {
+    size_t        start;
+    size_t        len;
+    unsigned long hash;
+} TokenRef;
+
+/* Сравнивает ключ кандидата со словами ring[first..first+n) */
+static int ngramKeyEquals(const NgramCandidate* item, const char* text,
+                          const TokenRef* ring, size_t first, int n, int ring_size)
+{
+    size_t offset = 0;
+    const TokenRef* tok;
+    int k;
+
+    if (item->n != n) return FALSE;
+    for (k = 0; k < n; k++) {
+        tok = &ring[(first + (size_t)k) % (size_t)ring_size];
+        if (k > 0) {
+            if (offset >= item->key_len || item->key[offset] != ' ') return FALSE;
+            offset++;
+        }
+        if (item->key_len - offset < tok->len) return FALSE;
+        if (memcmp(item->key + offset, text + tok->start, tok->len) != 0) return FALSE;
+        offset += tok->len;
+    }
+    return offset == item->key_len;
+}
+
+static void heapSwap(NgramCounter* c, size_t a, size_t b)
+{
+    size_t t = c->heap[a];
+    c->heap[a] = c->heap[b];
+    c->heap[b] = t;
+    c->items[c->heap[a]].heap_pos = a;
+    c->items[c->heap[b]].heap_pos = b;
+}
+
+static void heapSiftUp(NgramCounter* c, size_t pos)
+{
+    size_t parent;
+
+    while (pos > 0) {
+        parent = (pos - 1) / 2;
+        if (c->items[c->heap[parent]].count <= c->items[c->heap[pos]].count) break;
+        heapSwap(c, pos, parent);
+        pos = parent;
+    }
+}
+
+static void heapSiftDown(NgramCounter* c, size_t pos)
+{
+    size_t child;
+
+    for (;;) {
+        child = pos * 2 + 1;
+        if (child >= c->size) break;
+        if (child + 1 < c->size &&
+            c->items[c->heap[child + 1]].count < c->items[c->heap[child]].count) {
+            child++;
+        }
+        if (c->items[c->heap[pos]].count <= c->items[c->heap[child]].count) break;
+        heapSwap(c, pos, child);
+        pos = child;
+    }
+}
+
+/* Удаляет элемент item из хэш-индекса (удаление со сдвигом назад) */
+static void indexRemove(NgramCounter* c, size_t item)
+{
+    size_t slot = (size_t)c->items[item].hash & c->index_mask;
+    size_t next;
+    size_t home;
+
+    while ((size_t)c->index[slot] != item) {
+        slot = (slot + 1) & c->index_mask;
+    }
+
+    next = (slot + 1) & c->index_mask;
+    while (c->index[next] != -1) {
+        home = (size_t)c->items[c->index[next]].hash & c->index_mask;
+        /* Элемент можно сдвинуть, если slot лежит на пути от home до next */
+        if (((next - home) & c->index_mask) >= ((next - slot) & c->index_mask)) {
+            c->index[slot] = c->index[next];
+            slot = next;
+        }
+        next = (next + 1) & c->index_mask;
+    }
+    c->index[slot] = -1;
+}
+
+/* Записывает слова ring[first..first+n) в ключ кандидата */
+static int ngramStoreKey(NgramCandidate* item, const char* text,
+                         const TokenRef* ring, size_t first, int n, int ring_size)
+{
+    size_t len = (size_t)(n - 1);
+    size_t offset = 0;
+    const TokenRef* tok;
+    int k;
+
+    for (k = 0; k < n; k++) {
+        len += ring[(first + (size_t)k) % (size_t)ring_size].len;
+    }
+    item->key = (char*)malloc(len);
+    if (item->key == NULL) return FALSE;
+
+    for (k = 0; k < n; k++) {
+        tok = &ring[(first + (size_t)k) % (size_t)ring_size];
+        if (k > 0) item->key[offset++] = ' ';
+        memcpy(item->key + offset, text + tok->start, tok->len);
+        offset += tok->len;
+    }
+    item->key_len = len;
+    item->n = n;
+    return TRUE;
+}
+
+/* Учитывает одно вхождение n-граммы ring[first..first+n) */
+static void ngramObserve(NgramCounter* c, unsigned long h, const char* text,
+                         const TokenRef* ring, size_t first, int n)
+{
+    NgramCandidate fresh;
+    unsigned long est;
+    size_t slot;
+    size_t item;
+    long e;
+
+    est = sketchAdd(c->sketch, h);
+
+    slot = (size_t)h & c->index_mask;
+    while ((e = c->index[slot]) != -1) {
+        if (c->items[e].hash == h &&
+            ngramKeyEquals(&c->items[e], text, ring, first, n, c->max_n)) {
+            c->items[e].count = est;
+            heapSiftDown(c, c->items[e].heap_pos);
+            return;
+        }
+        slot = (slot + 1) & c->index_mask;
+    }
+
+    /* Ключ готовится заранее: при нехватке памяти набор не меняется */
+    if (!ngramStoreKey(&fresh, text, ring, first, n, c->max_n)) return;
+
+    if (c->size < c->capacity) {
+        item = c->size++;
+        c->heap[item] = item;
+        fresh.heap_pos = item;
+    } else {
+        /* Вытесняем наименее частого кандидата, если новая n-грамма чаще */
+        item = c->heap[0];
+        if (est <= c->items[item].count) {
+            free(fresh.key);
+            return;
+        }
+        indexRemove(c, item);
+        free(c->items[item].key);
+        fresh.heap_pos = 0;
+    }
+
+    fresh.hash = h;
+    fresh.count = est;
+    c->items[item] = fresh;
+
+    slot = (size_t)h & c->index_mask;
+    while (c->index[slot] != -1) slot = (slot + 1) & c->index_mask;
+    c->index[slot] = (long)item;
+
+    heapSiftUp(c, c->items[item].heap_pos);
+    heapSiftDown(c, c->items[item].heap_pos);
+}
+
+void ngramCountShard(NgramCounter* counter, const char* text, size_t text_len,
+                     size_t start, size_t end)
+{
+    TokenRef ring[NGRAM_MAX_N];
+    unsigned long powers[NGRAM_MAX_N];
+    unsigned long h;
+    size_t pos = start;
+    size_t tok_start;
+    size_t tok_len;
+    size_t count = 0;      /* Слов прочитано в шарде */
+    size_t first;
+    int beyond = 0;        /* Слов, начавшихся после конца шарда */
+    int n;
+
+    powers[0] = 1;
+    for (n = 1; n < counter->max_n; n++) {
+        powers[n] = powers[n - 1] * HASH_BASE;
+    }
+
+    /* Слово, начавшееся до start, принадлежит предыдущему шарду */
+    if (pos > 0 && pos < text_len && !isSeparator(text[pos - 1])) {
+        while (pos < text_len && !isSeparator(text[pos])) pos++;
+    }
+
+    while (phraseNextToken(text, text_len, &pos, &tok_start, &tok_len)) {
+        if (tok_start >= end) {
+            /* n-граммы, начинающиеся после end, учитывает следующий шард */
+            if (++beyond >= counter->max_n) break;
+        }
+
+        ring[count % (size_t)counter->max_n].start = tok_start;
+        ring[count % (size_t)counter->max_n].len = tok_len;
+        ring[count % (size_t)counter->max_n].hash = tokenHash(text + tok_start, tok_len);
+        count++;
+
+        /* n-граммы, оканчивающиеся этим словом: от коротких к длинным */
+        h = 0;
+        for (n = 1; n <= counter->max_n && (size_t)n <= count; n++) {
+            first = count - (size_t)n;
+            h += (ring[first % (size_t)counter->max_n].hash + 1UL) * powers[n - 1];
+            if (ring[first % (size_t)counter->max_n].start >= end) continue;
+            ngramObserve(counter, h * HASH_BASE + (unsigned long)n, text,
+                         ring, first, n);
+        }
+    }
+}
+
+/* Сортировка кандидатов: по хэшу и ключу (для удаления дублей) */
+static int compareCandidateKeys(const void* a, const void* b)
+{
+    const NgramCandidate* x = *(const NgramCandidate* const*)a;
+    const NgramCandidate* y = *(const NgramCandidate* const*)b;
+    size_t common;
+    int diff;
+
+    if (x->hash != y->hash) return (x->hash < y->hash) ? -1 : 1;
+    if (x->n != y->n) return x->n - y->n;
+    common = (x->key_len < y->key_len) ? x->key_len : y->key_len;
+    diff = memcmp(x->key, y->key, common);
+    if (diff != 0) return diff;
+    if (x->key_len != y->key_len) return (x->key_len < y->key_len) ? -1 : 1;
+    return 0;
+}
+
+/* Сортировка результата: по убыванию оценки, затем по ключу */
+static int compareResults(const void* a, const void* b)
+{
+    const NgramResult* x = (const NgramResult*)a;
+    const NgramResult* y = (const NgramResult*)b;
+    size_t common;
+    int diff;
+
+    if (x->count != y->count) return (x->count > y->count) ? -1 : 1;
+    common = (x->key_len < y->key_len) ? x->key_len : y->key_len;
+    diff = memcmp(x->key, y->key, common);
+    if (diff != 0) return diff;
+    if (x->key_len != y->key_len) return (x->key_len < y->key_len) ? -1 : 1;
+    return 0;
+}
+
+int ngramMerge(NgramCounter* counters, size_t counter_count, size_t top_k,
+               NgramResult** results, size_t* result_count)
+{
+    unsigned long* merged = counters[0].sketch;
+    NgramCandidate** all;
+    NgramResult* out;
+    size_t total = 0;
+    size_t unique = 0;
+    size_t c;
+    size_t i;
+    size_t cells = (size_t)NGRAM_SKETCH_DEPTH * NGRAM_SKETCH_WIDTH;
+
+    /* Эскизы складываются поэлементно */
+    for (c = 1; c < counter_count; c++) {
+        for (i = 0; i < cells; i++) {
+            merged[i] += counters[c].sketch[i];
+        }
+        total += counters[c].size;
+    }
+    total += counters[0].size;
+
+    all = (NgramCandidate**)malloc((total + 1) * sizeof(NgramCandidate*));
+    out = (NgramResult*)malloc((total + 1) * sizeof(NgramResult));
+    if (all == NULL || out == NULL) {
+        free(all);
+        free(out);
+        return FALSE;
+    }
+
+    total = 0;
+    for (c = 0; c < counter_count; c++) {
+        for (i = 0; i < counters[c].size; i++) {
+            all[total++] = &counters[c].items[i];
+        }
+    }
+
+    /* Объединение кандидатов всех шардов с переоценкой по общему эскизу */
+    qsort(all, total, sizeof(NgramCandidate*), compareCandidateKeys);
+    for (i = 0; i < total; i++) {
+        if (unique > 0 && compareCandidateKeys(&all[i], &all[i - 1]) == 0) continue;
+        out[unique].count = sketchQuery(merged, all[i]->hash);
+        out[unique].n = all[i]->n;
+        out[unique].key_len = all[i]->key_len;
+        /* Ключ временно указывает на кандидата; копия делается после отбора */
+        out[unique].key = all[i]->key;
+        unique++;
+    }
+    free(all);
+
+    qsort(out, unique, sizeof(NgramResult), compareResults);
+    if (unique > top_k) unique = top_k;
+
+    for (i = 0; i < unique; i++) {
+        char* copy = (char*)malloc(out[i].key_len + 1);
+        if (copy == NULL) {
+            ngramResultsFree(out, i);
+            return FALSE;
+        }
+        memcpy(copy, out[i].key, out[i].key_len);
+        copy[out[i].key_len] = '\0';
+        out[i].key = copy;
+    }
+
+    *results = out;
+    *result_count = unique;
+    return TRUE;
+}
+
+void ngramResultsFree(NgramResult* results, size_t result_count)
+{
+    size_t i;
+
+    for (i = 0; i < result_count; i++) {
+        free(results[i].key);
+    }
+    free(results);
+}
+
+/* --- Почти одинаковые документы: MinHash и LSH --- */
+
+/* Хэш шингла из последних n слов окна (слов прочитано всего words) */
+static unsigned long shingleHash(const unsigned long* window, size_t words, size_t n)
+{
+    unsigned long h = 0;
+    size_t k;
+
+    for (k = words - n; k < words; k++) {
+        h = h * HASH_BASE + window[k % SHINGLE_WORDS] + 1UL;
+    }
+    return h;
+}
+
+/* Учитывает шингл: k-я хэш-функция - перемешивание со своей затравкой */
+static void minhashAdd(MinHashSignature* sig, unsigned long shingle)
+{
+    unsigned long v;
+    int k;
+
+    for (k = 0; k < MINHASH_SIZE; k++) {
+        v = mixHash(shingle ^ ((unsigned long)(k + 1) * 0x9E3779B9UL));
+        if (v < sig->values[k]) sig->values[k] = v;
+    }
+    sig->shingles++;
+}
+
+void minhashSignature(const char* text, size_t text_len, MinHashSignature* sig)
+{
+    unsigned long window[SHINGLE_WORDS];
+    size_t pos = 0;
+    size_t tok_start;
+    size_t tok_len;
+    size_t words = 0;
+    int k;
+
+    for (k = 0; k < MINHASH_SIZE; k++) {
+        sig->values[k] = ~0UL;
+    }
+    sig->shingles = 0;
+
+    while (phraseNextToken(text, text_len, &pos, &tok_start, &tok_len)) {
+        window[words % SHINGLE_WORDS] = tokenHash(text + tok_start, tok_len);
+        words++;
+        if (words >= SHINGLE_WORDS) {
+            minhashAdd(sig, shingleHash(window, words, SHINGLE_WORDS));
+        }
+    }
+
+    /* Документ короче шингла целиком становится одним шинглом */
+    if (words > 0 && words < SHINGLE_WORDS) {
+        minhashAdd(sig, shingleHash(window, words, words));
+    }
+}
+
+double minhashSimilarity(const MinHashSignature* a, const MinHashSignature* b)
+{
+    int k;
+    int equal = 0;
+
+    for (k = 0; k < MINHASH_SIZE; k++) {
+        if (a->values[k] == b->values[k]) equal++;
+    }
+    return (double)equal / MINHASH_SIZE;
+}
+
+/* Элемент полосы LSH: хэш полосы и номер документа */
+typedef struct {
+    unsigned long hash;
+    size_t        doc;
+} BandEntry;
+
+static int compareBandEntries(const void* a, const void* b)
+{
+    const BandEntry* x = (const BandEntry*)a;
+    const BandEntry* y = (const BandEntry*)b;
+
+    if (x->hash != y->hash) return (x->hash < y->hash) ? -1 : 1;
+    if (x->doc != y->doc) return (x->doc < y->doc) ? -1 : 1;
+    return 0;
+}
+
+static int comparePairs(const void* a, const void* b)
+{
+    const DuplicatePair* x = (const DuplicatePair*)a;
+    const DuplicatePair* y = (const DuplicatePair*)b;
+
+    if (x->first != y->first) return (x->first < y->first) ? -1 : 1;
+    if (x->second != y->second) return (x->second < y->second) ? -1 : 1;
+    return 0;
+}
+
+int minhashFindDuplicates(const MinHashSignature* sigs, size_t count, double threshold,
+                          DuplicatePair** pairs, size_t* pair_count)
+{
+    BandEntry* band;
+    DuplicatePair* found = NULL;
+    DuplicatePair* grown;
+    size_t found_count = 0;
+    size_t found_cap = 0;
+    size_t used = 0;
+    size_t i;
+    size_t j;
+    size_t group_end;
+    size_t kept;
+    unsigned long h;
+    int b;
+    int r;
+
+    band = (BandEntry*)malloc((count + 1) * sizeof(BandEntry));
+    if (band == NULL) {
+        return FALSE;
+    }
+
+    /*
+     * Кандидаты: документы, у которых совпала хотя бы одна полоса.
+     * Сортировка полосы собирает одинаковые хэши рядом.
+     */
+    for (b = 0; b < MINHASH_BANDS; b++) {
+        used = 0;
+        for (i = 0; i < count; i++) {
+            if (sigs[i].shingles == 0) continue;
+            h = 0;
+            for (r = 0; r < MINHASH_ROWS; r++) {
+                h = h * HASH_BASE + sigs[i].values[b * MINHASH_ROWS + r];
+            }
+            band[used].hash = h;
+            band[used].doc = i;
+            used++;
+        }
+        qsort(band, used, sizeof(BandEntry), compareBandEntries);
+
+        for (i = 0; i < used; i = group_end) {
+            group_end = i + 1;
+            while (group_end < used && band[group_end].hash == band[i].hash) group_end++;
+
+            for (j = i; j < group_end; j++) {
+                size_t m;
+                for (m = j + 1; m < group_end; m++) {
+                    if (found_count == found_cap) {
+                        found_cap = (found_cap == 0) ? 64 : found_cap * 2;
+                        grown = (DuplicatePair*)realloc(found, found_cap * sizeof(DuplicatePair));
+                        if (grown == NULL) {
+                            free(found);
+                            free(band);
+                            return FALSE;
+                        }
+                        found = grown;
+                    }
+                    found[found_count].first = band[j].doc;
+                    found[found_count].second = band[m].doc;
+                    found_count++;
+                }
+            }
+        }
+    }
+    free(band);
+
+    /* Пара могла совпасть в нескольких полосах: оставляем одну и проверяем */
+    qsort(found, found_count, sizeof(DuplicatePair), comparePairs);
+    kept = 0;
+    for (i = 0; i < found_count; i++) {
+        if (kept > 0 && comparePairs(&found[i], &found[kept - 1]) == 0) continue;
+        found[kept] = found[i];
+        found[kept].similarity = minhashSimilarity(&sigs[found[i].first], &sigs[found[i].second]);
+        kept++;
+    }
+
+    /* Отбор по порогу на месте */
+    j = 0;
+    for (i = 0; i < kept; i++) {
+        if (found[i].similarity >= threshold) found[j++] = found[i];
+    }
+
+    *pairs = found;
+    *pair_count = j;
+    return TRUE;
+}
+
+/* --- Кодировка входного текста --- */
+
+/* Символы Unicode для байтов 0x80-0xBF Windows-1251 (0xC0-0xFF - это А..я) */
+static const unsigned short cp1251_high[64] = {
+    0x0402, 0x0403, 0x201A, 0x0453, 0x201E, 0x2026, 0x2020, 0x2021,
+    0x20AC, 0x2030, 0x0409, 0x2039, 0x040A, 0x040C, 0x040B, 0x040F,
+    0x0452, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0x0098, 0x2122, 0x0459, 0x203A, 0x045A, 0x045C, 0x045B, 0x045F,
+    0x00A0, 0x040E, 0x045E, 0x0408, 0x00A4, 0x0490, 0x00A6, 0x00A7,
+    0x0401, 0x00A9, 0x0404, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x0407,
+    0x00B0, 0x00B1, 0x0406, 0x0456, 0x0491, 0x00B5, 0x00B6, 0x00B7,
+    0x0451, 0x2116, 0x0454, 0x00BB, 0x0458, 0x0405, 0x0455, 0x0457
+};
+
+size_t textAsciiPrefix(const char* text, size_t text_len)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i block;
+    int mask;
+
+    /* 16 байт за раз: movemask собирает старшие биты */
+    while (i + 16 <= text_len) {
+        block = _mm_loadu_si128((const __m128i*)(text + i));
+        mask = _mm_movemask_epi8(block);
+        if (mask != 0) {
+            while (!(mask & 1)) {
+                mask >>= 1;
+                i++;
+            }
+            return i;
+        }
+        i += 16;
+    }
+#else
+    unsigned long word;
+    unsigned long high = (~0UL / 255) * 0x80;  /* 0x8080...80 */
+
+    /* Слово за раз: проверка старших битов всех байтов слова */
+    while (i + sizeof(word) <= text_len) {
+        memcpy(&word, text + i, sizeof(word));
+        if (word & high) break;
+        i += sizeof(word);
+    }
+#endif
+
+    while (i < text_len && !((unsigned char)text[i] & 0x80)) i++;
+    return i;
+}
+
+int textIsValidUtf8(const char* text, size_t text_len)
+{
+    const unsigned char* s = (const unsigned char*)text;
+    size_t i = 0;
+    size_t need;
+    unsigned char lo;
+    unsigned char hi;
+
+    for (;;) {
+        /* ASCII-участки пропускаются блоками */
+        i += textAsciiPrefix(text + i, text_len - i);
+        if (i >= text_len) return TRUE;
+
+        /*
+         * Допустимые последовательности по таблице 3-7 стандарта Unicode:
+         * для первого байта задаются длина и диапазон второго байта.
+         */
+        lo = 0x80;
+        hi = 0xBF;
+        if (s[i] >= 0xC2 && s[i] <= 0xDF) {
+            need = 1;
+        } else if (s[i] == 0xE0) {
+            need = 2; lo = 0xA0;
+        } else if (s[i] == 0xED) {
+            need = 2; hi = 0x9F;             /* Исключаем суррогаты */
+        } else if (s[i] >= 0xE1 && s[i] <= 0xEF) {
+            need = 2;
+        } else if (s[i] == 0xF0) {
+            need = 3; lo = 0x90;
+        } else if (s[i] >= 0xF1 && s[i] <= 0xF3) {
+            need = 3;
+        } else if (s[i] == 0xF4) {
+            need = 3; hi = 0x8F;             /* Не выше U+10FFFF */
+        } else {
+            return FALSE;
+        }
+
+        if (text_len - i <= need) return FALSE;
+        if (s[i + 1] < lo || s[i + 1] > hi) return FALSE;
+        if (need >= 2 && (s[i + 2] & 0xC0) != 0x80) return FALSE;
+        if (need >= 3 && (s[i + 3] & 0xC0) != 0x80) return FALSE;
+        i += need + 1;
+    }
+}
+
+TextEncoding textDetectEncoding(const char* text, size_t text_len)
+{
+    if (textAsciiPrefix(text, text_len) == text_len) return TEXT_ENCODING_ASCII;
+    if (textIsValidUtf8(text, text_len)) return TEXT_ENCODING_UTF8;
+    return TEXT_ENCODING_CP1251;
+}
+
+int textToUtf8(const char* text, size_t text_len, char** out, size_t* out_len,
+               TextEncoding* detected)
+{
+    unsigned char table[128][4];  /* UTF-8 байтов 0x80-0xFF; [3] - длина */
+    unsigned long cp;
+    unsigned char c;
+    char* dst;
+    size_t i = 0;
+    size_t o = 0;
+    size_t run;
+    int k;
+
+    *detected = textDetectEncoding(text, text_len);
+
+    if (*detected != TEXT_ENCODING_CP1251) {
+        dst = (char*)malloc(text_len + 1);
+        if (dst == NULL) return FALSE;
+        memcpy(dst, text, text_len);
+        dst[text_len] = '\0';
+        *out = dst;
+        *out_len = text_len;
+        return TRUE;
+    }
+
+    /* Каждый байт Windows-1251 дает не более 3 байтов UTF-8 */
+    dst = (char*)malloc(text_len * 3 + 1);
+    if (dst == NULL) return FALSE;
+
+    for (k = 0; k < 128; k++) {
+        cp = (k < 64) ? cp1251_high[k] : 0x0410UL + (unsigned long)(k - 64);
+        if (cp < 0x800) {
+            table[k][0] = (unsigned char)(0xC0 | (cp >> 6));
+            table[k][1] = (unsigned char)(0x80 | (cp & 0x3F));
+            table[k][2] = 0;
+            table[k][3] = 2;
+        } else {
+            table[k][0] = (unsigned char)(0xE0 | (cp >> 12));
+            table[k][1] = (unsigned char)(0x80 | ((cp >> 6) & 0x3F));
+            table[k][2] = (unsigned char)(0x80 | (cp & 0x3F));
+            table[k][3] = 3;
+        }
+    }
+
+    while (i < text_len) {
+        /* ASCII копируется блоком, остальное - по таблице */
+        run = textAsciiPrefix(text + i, text_len - i);
+        memcpy(dst + o, text + i, run);
+        i += run;
+        o += run;
+
+        while (i < text_len && ((unsigned char)text[i] & 0x80)) {
+            c = (unsigned char)(text[i++] - 0x80);
+            dst[o] = (char)table[c][0];
+            dst[o + 1] = (char)table[c][1];
+            dst[o + 2] = (char)table[c][2];
+            o += table[c][3];
+        }
+    }
+
+    dst[o] = '\0';
+    *out = dst;
+    *out_len = o;
+    return TRUE;
+}
+
+/* --- Листинги IDA: разбор строк на поля --- */
+
+/* Ширина табуляции в листингах IDA */
+#define LISTING_TAB_WIDTH 8
+
+/* Пробел или табуляция: разметка листинга не зависит от набора разделителей */
+static int isBlank(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+/* Значение шестнадцатеричной цифры или -1 */
+static int hexDigit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+int listingParseLine(const char* line, size_t line_len, ListingLine* out)
+{
+    size_t i = 0;
+    size_t column;
+    size_t prefix_len;
+    size_t code_end;
+    size_t end;
+    char quote = 0;
+    int f;
+    int d;
+
+    for (f = 0; f < LISTING_FIELD_COUNT; f++) {
+        out->start[f] = 0;
+        out->len[f] = 0;
+    }
+    out->address = 0;
+
+    /* Префикс "сегмент:адрес" */
+    while (i < line_len && line[i] != ':' && !isBlank(line[i])) i++;
+    if (i == 0 || i >= line_len || line[i] != ':') return FALSE;
+    out->len[LISTING_FIELD_SEGMENT] = i;
+    i++;
+
+    if (i >= line_len || hexDigit(line[i]) < 0) return FALSE;
+    while (i < line_len && (d = hexDigit(line[i])) >= 0) {
+        out->address = out->address * 16 + (unsigned long)d;
+        i++;
+    }
+    if (i < line_len && !isBlank(line[i])) return FALSE;
+
+    /*
+     * Метка стоит сразу за префиксом (через одну позицию), а инструкции
+     * сдвинуты вправо. Табуляции в файле считаются по LISTING_TAB_WIDTH.
+     */
+    prefix_len = i;
+    column = i;
+    while (i < line_len && isBlank(line[i])) {
+        column = (line[i] == '\t') ? (column / LISTING_TAB_WIDTH + 1) * LISTING_TAB_WIDTH
+                                   : column + 1;
+        i++;
+    }
+
+    /* Комментарий - от первого ';' вне кавычек */
+    code_end = i;
+    while (code_end < line_len) {
+        if (quote != 0) {
+            if (line[code_end] == quote) quote = 0;
+        } else if (line[code_end] == '\'' || line[code_end] == '"') {
+            quote = line[code_end];
+        } else if (line[code_end] == ';') {
+            break;
+        }
+        code_end++;
+    }
+    if (code_end < line_len) {
+        end = code_end + 1;
+        while (end < line_len && isBlank(line[end])) end++;
+        out->start[LISTING_FIELD_COMMENT] = end;
+        out->len[LISTING_FIELD_COMMENT] = line_len - end;
+    }
+    while (code_end > i && isBlank(line[code_end - 1])) code_end--;
+
+    /* Метка */
+    if (i < code_end && column == prefix_len + 1) {
+        end = i;
+        while (end < code_end && !isBlank(line[end])) end++;
+        out->start[LISTING_FIELD_LABEL] = i;
+        out->len[LISTING_FIELD_LABEL] = end - i;
+        if (end > i && line[end - 1] == ':') out->len[LISTING_FIELD_LABEL]--;
+        i = end;
+        while (i < code_end && isBlank(line[i])) i++;
+    }
+
+    /* Мнемоника и операнды */
+    if (i < code_end) {
+        end = i;
+        while (end < code_end && !isBlank(line[end])) end++;
+        out->start[LISTING_FIELD_MNEMONIC] = i;
+        out->len[LISTING_FIELD_MNEMONIC] = end - i;
+        i = end;
+        while (i < code_end && isBlank(line[i])) i++;
+        out->start[LISTING_FIELD_OPERANDS] = i;
+        out->len[LISTING_FIELD_OPERANDS] = code_end - i;
+    }
+
+    return TRUE;
+}
+
+/* Вызывает разбор для каждой строки с адресом; pass 0 - подсчет, 1 - копирование */
+static void listingScan(ListingTable* table, const char* text, size_t text_len,
+                        size_t* sizes, int pass)
+{
+    ListingLine parsed;
+    size_t pos = 0;
+    size_t end;
+    size_t line_len;
+    size_t n = 0;
+    size_t* off;
+    int f;
+
+    while (pos < text_len) {
+        end = pos;
+        while (end < text_len && text[end] != '\n') end++;
+        line_len = end - pos;
+        if (line_len > 0 && text[end - 1] == '\r') line_len--;
+
+        if (listingParseLine(text + pos, line_len, &parsed)) {
+            for (f = 0; f < LISTING_FIELD_COUNT; f++) {
+                if (pass == 0) {
+                    sizes[f] += parsed.len[f];
+                } else {
+                    off = table->offset[f];
+                    memcpy(table->column[f] + off[n], text + pos + parsed.start[f], parsed.len[f]);
+                    off[n + 1] = off[n] + parsed.len[f];
+                }
+            }
+            if (pass == 1) table->address[n] = parsed.address;
+            n++;
+        }
+        pos = end + 1;
+    }
+
+    table->line_count = n;
+}
+
+int listingBuild(ListingTable* table, const char* text, size_t text_len)
+{
+    size_t sizes[LISTING_FIELD_COUNT];
+    int ok = TRUE;
+    int f;
+
+    for (f = 0; f < LISTING_FIELD_COUNT; f++) {
+        sizes[f] = 0;
+        table->column[f] = NULL;
+        table->offset[f] = NULL;
+    }
+    table->address = NULL;
+
+    /* Два прохода: сначала размеры столбцов, затем заполнение */
+    listingScan(table, text, text_len, sizes, 0);
+
+    for (f = 0; f < LISTING_FIELD_COUNT; f++) {
+        table->column[f] = (char*)malloc(sizes[f] + 1);
+        table->offset[f] = (size_t*)malloc((table->line_count + 1) * sizeof(size_t));
+        if (table->column[f] == NULL || table->offset[f] == NULL) ok = FALSE;
+        else table->offset[f][0] = 0;
+    }
+    table->address = (unsigned long*)malloc((table->line_count + 1) * sizeof(unsigned long));
+    if (!ok || table->address == NULL) {
+        listingFree(table);
+        return FALSE;
+    }
+
+    listingScan(table, text, text_len, sizes, 1);
+    return TRUE;
+}
+
+void listingFree(ListingTable* table)
+{
+    int f;
+
+    for (f = 0; f < LISTING_FIELD_COUNT; f++) {
+        free(table->column[f]);
+        free(table->offset[f]);
+        table->column[f] = NULL;
+        table->offset[f] = NULL;
+    }
+    free(table->address);
+    table->address = NULL;
+    table->line_count = 0;
+}
+
+/* Достаточно одного совпадения в поле строки */
+static int stopAtFirst(size_t position, void* context)
+{
+    (void)position;
+    (void)context;
+    return 1;
+}
+
+size_t listingSearch(const ListingTable* table, ListingField field,
+                     const PhraseMatcher* matcher, ListingMatchCallback callback, void* context)
+{
+    const char* column = table->column[field];
+    const size_t* off = table->offset[field];
+    size_t line;
+    size_t found = 0;
+
+    for (line = 0; line < table->line_count; line++) {
+        if (off[line + 1] == off[line]) continue;
+        if (phraseSearch(matcher, column + off[line], off[line + 1] - off[line],
+                         stopAtFirst, NULL) == 0) {
+            continue;
+        }
+        found++;
+        if (callback != NULL && callback(table, line, context) != 0) break;
+    }
+    return found;
+}
+
+/* --- Индекс листинга: адреса и имена --- */
+
+/* Сигнатура файла индекса */
+#define LISTING_INDEX_MAGIC "LSTIDX03"
+
+/* Размеры заголовка и записей: все числа - 8 байт little-endian */
+#define INDEX_HEADER_SIZE  56
+#define INDEX_ADDRESS_SIZE 16
+#define INDEX_SYMBOL_SIZE  24
+
+/* Выборка листинга для быстрой проверки свежести индекса */
+#define INDEX_SAMPLE_BLOCKS 16
+#define INDEX_SAMPLE_SIZE   4096
+
+/* Запись адреса при построении индекса */
+typedef struct {
+    unsigned long address;
+    unsigned long offset;
+} AddressEntry;
+
+/* Запись имени при построении индекса (имя указывает в текст листинга) */
+typedef struct {
+    const char*   name;
+    size_t        len;
+    unsigned long offset;
+} SymbolEntry;
+
+/* Пишет число как 8 байт little-endian (независимо от размера unsigned long) */
+static int writeIndexNumber(FILE* f, unsigned long value)
+{
+    unsigned char bytes[8];
+    int k;
+
+    for (k = 0; k < 8; k++) {
+        bytes[k] = (unsigned char)(value & 0xFF);
+        value >>= 8;
+    }
+    return fwrite(bytes, 1, 8, f) == 8;
+}
+
+/* Разбирает 8 байт little-endian */
+static unsigned long decodeIndexNumber(const unsigned char* bytes)
+{
+    unsigned long value = 0;
+    int k;
+
+    for (k = 7; k >= 0; k--) {
+        value = (value << 8) | bytes[k];
+    }
+    return value;
+}
+
+/* Продолжает хэш FNV-1a (32 бита) байтами data - одинаково на любой платформе */
+static unsigned long listingContentHash(unsigned long hash, const char* data, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash = ((hash ^ (unsigned char)data[i]) * 16777619UL) & 0xFFFFFFFFUL;
+    }
+    return hash;
+}
+
+/* Смещение блока выборки k файла размером size: первый - в начале, последний - в конце */
+static unsigned long sampleOffset(unsigned long size, int k)
+{
+    if (size <= INDEX_SAMPLE_SIZE) {
+        return 0;
+    }
+    if (k == INDEX_SAMPLE_BLOCKS - 1) {
+        return size - INDEX_SAMPLE_SIZE;
+    }
+    return (size - INDEX_SAMPLE_SIZE) / (INDEX_SAMPLE_BLOCKS - 1) * (unsigned long)k;
+}
+
+/* Длина блока выборки (файл может быть короче блока) */
+static size_t sampleLength(unsigned long size)
+{
+    return size < INDEX_SAMPLE_SIZE ? (size_t)size : INDEX_SAMPLE_SIZE;
+}
+
+static int compareAddressEntries(const void* a, const void* b)
+{
+    const AddressEntry* x = (const AddressEntry*)a;
+    const AddressEntry* y = (const AddressEntry*)b;
+
+    if (x->address != y->address) return (x->address < y->address) ? -1 : 1;
+    if (x->offset != y->offset) return (x->offset < y->offset) ? -1 : 1;
+    return 0;
+}
+
+/* Сравнение имен как последовательностей байтов; более короткий префикс меньше */
+static int compareNames(const char* a, size_t a_len, const char* b, size_t b_len)
+{
+    int diff = memcmp(a, b, a_len < b_len ? a_len : b_len);
+
+    if (diff != 0) return diff;
+    if (a_len != b_len) return (a_len < b_len) ? -1 : 1;
+    return 0;
+}
+
+static int compareSymbolEntries(const void* a, const void* b)
+{
+    const SymbolEntry* x = (const SymbolEntry*)a;
+    const SymbolEntry* y = (const SymbolEntry*)b;
+    int diff = compareNames(x->name, x->len, y->name, y->len);
+
+    if (diff != 0) return diff;
+    if (x->offset != y->offset) return (x->offset < y->offset) ? -1 : 1;
+    return 0;
+}
+
+int listingIndexBuild(const char* lst_path, const char* idx_path)
+{
+    ListingLine parsed;
+    AddressEntry* addresses = NULL;
+    SymbolEntry* symbols = NULL;
+    FILE* out;
+    char* text;
+    size_t text_len;
+    size_t lines = 0;
+    size_t address_count = 0;
+    size_t symbol_count = 0;
+    size_t pool_size = 0;
+    size_t pos;
+    size_t end;
+    size_t line_len;
+    size_t i;
+    unsigned long sample = 2166136261UL;
+    int k;
+    int ok;
+
+    /* Смещения относятся к байтам файла, поэтому --utf8 здесь не применяется */
+    text = readWholeFile(lst_path, &text_len);
+    if (text == NULL) {
+        return FALSE;
+    }
+
+    for (i = 0; i < text_len; i++) {
+        if (text[i] == '\n') lines++;
+    }
+    addresses = (AddressEntry*)malloc((lines + 1) * sizeof(AddressEntry));
+    symbols = (SymbolEntry*)malloc((lines + 1) * sizeof(SymbolEntry));
+    if (addresses == NULL || symbols == NULL) {
+        free(addresses);
+        free(symbols);
+        free(text);
+        return FALSE;
+    }
+
+    for (pos = 0; pos < text_len; pos = end + 1) {
+        end = pos;
+        while (end < text_len && text[end] != '\n') end++;
+        line_len = end - pos;
+        if (line_len > 0 && text[end - 1] == '\r') line_len--;
+
+        if (!listingParseLine(text + pos, line_len, &parsed)) continue;
+
+        addresses[address_count].address = parsed.address;
+        addresses[address_count].offset = (unsigned long)pos;
+        address_count++;
+
+        if (parsed.len[LISTING_FIELD_LABEL] > 0 &&
+            parsed.len[LISTING_FIELD_LABEL] <= LISTING_NAME_MAX) {
+            symbols[symbol_count].name = text + pos + parsed.start[LISTING_FIELD_LABEL];
+            symbols[symbol_count].len = parsed.len[LISTING_FIELD_LABEL];
+            symbols[symbol_count].offset = (unsigned long)pos;
+            pool_size += symbols[symbol_count].len;
+            symbol_count++;
+        }
+    }
+
+    for (k = 0; k < INDEX_SAMPLE_BLOCKS; k++) {
+        sample = listingContentHash(sample, text + sampleOffset((unsigned long)text_len, k),
+                                    sampleLength((unsigned long)text_len));
+    }
+
+    qsort(addresses, address_count, sizeof(AddressEntry), compareAddressEntries);
+    qsort(symbols, symbol_count, sizeof(SymbolEntry), compareSymbolEntries);
+
+    out = fopen(idx_path, "wb");
+    ok = (out != NULL);
+    if (ok) {
+        ok = fwrite(LISTING_INDEX_MAGIC, 1, 8, out) == 8 &&
+             writeIndexNumber(out, (unsigned long)text_len) &&
+             writeIndexNumber(out, sample) &&
+             writeIndexNumber(out, listingContentHash(2166136261UL, text, text_len)) &&
+             writeIndexNumber(out, (unsigned long)address_count) &&
+             writeIndexNumber(out, (unsigned long)symbol_count) &&
+             writeIndexNumber(out, (unsigned long)pool_size);
+
+        for (i = 0; ok && i < address_count; i++) {
+            ok = writeIndexNumber(out, addresses[i].address) &&
+                 writeIndexNumber(out, addresses[i].offset);
+        }
+
+        /* Имена лежат в пуле в том же порядке, что и записи */
+        pool_size = 0;
+        for (i = 0; ok && i < symbol_count; i++) {
+            ok = writeIndexNumber(out, (unsigned long)pool_size) &&
+                 writeIndexNumber(out, (unsigned long)symbols[i].len) &&
+                 writeIndexNumber(out, symbols[i].offset);
+            pool_size += symbols[i].len;
+        }
+        for (i = 0; ok && i < symbol_count; i++) {
+            ok = fwrite(symbols[i].name, 1, symbols[i].len, out) == symbols[i].len;
+        }
+
+        if (fclose(out) != 0) ok = FALSE;
+    }
+
+    free(addresses);
+    free(symbols);
+    free(text);
+    return ok;
+}
+
+int listingIndexOpen(ListingIndex* index, const char* idx_path)
+{
+    unsigned char header[INDEX_HEADER_SIZE];
+    unsigned long pool_size;
+
+    index->file = fopen(idx_path, "rb");
+    if (index->file == NULL) {
+        return FALSE;
+    }
+
+    if (fread(header, 1, INDEX_HEADER_SIZE, index->file) != INDEX_HEADER_SIZE ||
+        memcmp(header, LISTING_INDEX_MAGIC, 8) != 0) {
+        listingIndexClose(index);
+        return FALSE;
+    }
+
+    index->source_size = decodeIndexNumber(header + 8);
+    index->source_sample = decodeIndexNumber(header + 16);
+    index->source_hash = decodeIndexNumber(header + 24);
+    index->address_count = decodeIndexNumber(header + 32);
+    index->symbol_count = decodeIndexNumber(header + 40);
+    pool_size = decodeIndexNumber(header + 48);
+
+    index->address_base = INDEX_HEADER_SIZE;
+    index->symbol_base = index->address_base + (long)(index->address_count * INDEX_ADDRESS_SIZE);
+    index->pool_base = index->symbol_base + (long)(index->symbol_count * INDEX_SYMBOL_SIZE);
+
+    /* Обрезанный файл индекса считается поврежденным */
+    if (fseek(index->file, 0, SEEK_END) != 0 ||
+        ftell(index->file) != index->pool_base + (long)pool_size) {
+        listingIndexClose(index);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void listingIndexClose(ListingIndex* index)
+{
+    if (index->file != NULL) {
+        fclose(index->file);
+    }
+    index->file = NULL;
+}
+
+int listingIndexIsCurrent(const ListingIndex* index, FILE* listing, int full)
+{
+    char block[INDEX_SAMPLE_SIZE];
+    unsigned long hash = 2166136261UL;
+    unsigned long size = 0;
+    long end;
+    size_t got;
+    int k;
+
+    if (fseek(listing, 0, SEEK_END) != 0 || (end = ftell(listing)) < 0 ||
+        (unsigned long)end != index->source_size) {
+        return FALSE;
+    }
+
+    for (k = 0; k < INDEX_SAMPLE_BLOCKS; k++) {
+        got = sampleLength(index->source_size);
+        if (fseek(listing, (long)sampleOffset(index->source_size, k), SEEK_SET) != 0 ||
+            fread(block, 1, got, listing) != got) {
+            return FALSE;
+        }
+        hash = listingContentHash(hash, block, got);
+    }
+    if (hash != index->source_sample) {
+        return FALSE;
+    }
+    if (!full) {
+        return TRUE;
+    }
+
+    hash = 2166136261UL;
+    if (fseek(listing, 0, SEEK_SET) != 0) {
+        return FALSE;
+    }
+    while ((got = fread(block, 1, sizeof(block), listing)) > 0) {
+        hash = listingContentHash(hash, block, got);
+        size += (unsigned long)got;
+    }
+    return !ferror(listing) && size == index->source_size && hash == index->source_hash;
+}
+
+/* Читает запись адреса номер i */
+static int readAddressRecord(const ListingIndex* index, unsigned long i,
+                             unsigned long* address, unsigned long* offset)
+{
+    unsigned char record[INDEX_ADDRESS_SIZE];
+
+    if (fseek(index->file, index->address_base + (long)(i * INDEX_ADDRESS_SIZE), SEEK_SET) != 0 ||
+        fread(record, 1, INDEX_ADDRESS_SIZE, index->file) != INDEX_ADDRESS_SIZE) {
+        return FALSE;
+    }
+    *address = decodeIndexNumber(record);
+    *offset = decodeIndexNumber(record + 8);
+    return TRUE;
+}
+
+int listingIndexFindAddress(const ListingIndex* index, unsigned long address,
+                            unsigned long* found_address, unsigned long* line_offset)
+{
+    unsigned long lo = 0;
+    unsigned long hi = index->address_count;  /* Ответ в [lo, hi] */
+    unsigned long lo_value = 0;
+    unsigned long hi_value = 0;
+    unsigned long probe;
+    unsigned long value;
+    unsigned long offset;
+    int interpolate = TRUE;
+
+    if (hi == 0) return FALSE;
+    if (!readAddressRecord(index, 0, &lo_value, &offset) ||
+        !readAddressRecord(index, hi - 1, &hi_value, &offset)) {
+        return FALSE;
+    }
+    if (address > hi_value) return FALSE;
+
+    /*
+     * Поиск первой записи с адресом >= address. Адреса внутри сегмента
+     * растут почти равномерно, поэтому шаг интерполяции обычно сразу
+     * попадает рядом с ответом; чередование с делением пополам
+     * сохраняет O(log n) обращений к файлу в худшем случае.
+     */
+    while (lo < hi) {
+        probe = lo + (hi - lo) / 2;
+        if (interpolate && address > lo_value && hi_value > lo_value) {
+            probe = lo + (unsigned long)((double)(address - lo_value) /
+                                         (double)(hi_value - lo_value) * (double)(hi - lo));
+            if (probe >= hi) probe = hi - 1;
+        }
+        interpolate = !interpolate;
+
+        if (!readAddressRecord(index, probe, &value, &offset)) return FALSE;
+        if (value < address) {
+            lo = probe + 1;
+            lo_value = value;
+        } else {
+            hi = probe;
+            hi_value = value;
+        }
+    }
+
+    return readAddressRecord(index, lo, found_address, line_offset);
+}
+
+int listingIndexFindSymbol(const ListingIndex* index, const char* name, size_t name_len,
+                           unsigned long* line_offset)
+{
+    unsigned char record[INDEX_SYMBOL_SIZE];
+    char stored[LISTING_NAME_MAX];
+    unsigned long lo = 0;
+    unsigned long hi = index->symbol_count;
+    unsigned long mid;
+    unsigned long stored_len;
+    int diff;
+
+    if (name_len > LISTING_NAME_MAX) return FALSE;
+
+    /* Бинарный поиск первой записи с именем >= name */
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (fseek(index->file, index->symbol_base + (long)(mid * INDEX_SYMBOL_SIZE), SEEK_SET) != 0 ||
+            fread(record, 1, INDEX_SYMBOL_SIZE, index->file) != INDEX_SYMBOL_SIZE) {
+            return FALSE;
+        }
+        stored_len = decodeIndexNumber(record + 8);
+        if (stored_len > LISTING_NAME_MAX ||
+            fseek(index->file, index->pool_base + (long)decodeIndexNumber(record), SEEK_SET) != 0 ||
+            fread(stored, 1, stored_len, index->file) != stored_len) {
+            return FALSE;
+        }
+
+        diff = compareNames(stored, stored_len, name, name_len);
+        if (diff < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    /* Записи одного имени упорядочены по смещению: берем первую */
+    if (lo >= index->symbol_count) return FALSE;
+    if (fseek(index->file, index->symbol_base + (long)(lo * INDEX_SYMBOL_SIZE), SEEK_SET) != 0 ||
+        fread(record, 1, INDEX_SYMBOL_SIZE, index->file) != INDEX_SYMBOL_SIZE) {
+        return FALSE;
+    }
+    stored_len = decodeIndexNumber(record + 8);
+    if (stored_len != name_len ||
+        fseek(index->file, index->pool_base + (long)decodeIndexNumber(record), SEEK_SET) != 0 ||
+        fread(stored, 1, stored_len, index->file) != stored_len ||
+        memcmp(stored, name, name_len) != 0) {
+        return FALSE;
+    }
+    *line_offset = decodeIndexNumber(record + 16);
+    return TRUE;
+}
+
+/* --- Граф перекрестных ссылок листинга --- */
+
+/* Стрелки IDA перед видом ссылки: вверх (0x18) и вниз (0x19) */
+#define XREF_ARROW_UP   0x18
+#define XREF_ARROW_DOWN 0x19
+
+/* Ребро при построении графа */
+typedef struct {
+    size_t        source;
+    size_t        target;
+    unsigned char kind;
+} XrefEdge;
+
+/* Состояние построения: ребра до упаковки в CSR */
+typedef struct {
+    XrefEdge* edges;
+    size_t    count;
+    size_t    capacity;
+} XrefEdgeList;
+
+static size_t xrefNameSlot(const char* name, size_t len, size_t mask)
+{
+    return (size_t)mixHash(tokenHash(name, len)) & mask;
+}
+
+long xrefGraphFind(const XrefGraph* graph, const char* name, size_t name_len)
+{
+    size_t slot;
+    long node;
+
+    if (graph->table == NULL) return -1;
+    slot = xrefNameSlot(name, name_len, graph->table_mask);
+    while ((node = graph->table[slot]) != -1) {
+        if (graph->name_len[node] == name_len &&
+            memcmp(graph->pool + graph->name_start[node], name, name_len) == 0) {
+            return node;
+        }
+        slot = (slot + 1) & graph->table_mask;
+    }
+    return -1;
+}
+
+/* Удваивает хэш-таблицу имен */
+static int xrefGrowTable(XrefGraph* graph)
+{
+    size_t size = (graph->table_mask + 1) * 2;
+    long* table;
+    size_t slot;
+    size_t node;
+
+    table = (long*)malloc(size * sizeof(long));
+    if (table == NULL) return FALSE;
+    for (slot = 0; slot < size; slot++) table[slot] = -1;
+
+    for (node = 0; node < graph->node_count; node++) {
+        slot = xrefNameSlot(graph->pool + graph->name_start[node], graph->name_len[node], size - 1);
+        while (table[slot] != -1) slot = (slot + 1) & (size - 1);
+        table[slot] = (long)node;
+    }
+
+    free(graph->table);
+    graph->table = table;
+    graph->table_mask = size - 1;
+    return TRUE;
+}
+
+/* Возвращает номер узла, при необходимости добавляя его; -1 - нет памяти */
+static long xrefIntern(XrefGraph* graph, const char* name, size_t len)
+{
+    long node = xrefGraphFind(graph, name, len);
+    size_t slot;
+    char* pool;
+    size_t* starts;
+    size_t* lens;
+
+    if (node >= 0) return node;
+
+    /* Таблица заполняется не более чем наполовину */
+    if ((graph->node_count + 1) * 2 > graph->table_mask + 1 && !xrefGrowTable(graph)) {
+        return -1;
+    }
+    if (graph->pool_len + len > graph->pool_cap) {
+        graph->pool_cap = (graph->pool_cap + len) * 2;
+        pool = (char*)realloc(graph->pool, graph->pool_cap);
+        if (pool == NULL) return -1;
+        graph->pool = pool;
+    }
+    if (graph->node_count == graph->node_cap) {
+        graph->node_cap = graph->node_cap * 2 + 64;
+        starts = (size_t*)realloc(graph->name_start, graph->node_cap * sizeof(size_t));
+        if (starts == NULL) return -1;
+        graph->name_start = starts;
+        lens = (size_t*)realloc(graph->name_len, graph->node_cap * sizeof(size_t));
+        if (lens == NULL) return -1;
+        graph->name_len = lens;
+    }
+
+    memcpy(graph->pool + graph->pool_len, name, len);
+    graph->name_start[graph->node_count] = graph->pool_len;
+    graph->name_len[graph->node_count] = len;
+    graph->pool_len += len;
+
+    slot = xrefNameSlot(name, len, graph->table_mask);
+    while (graph->table[slot] != -1) slot = (slot + 1) & graph->table_mask;
+    graph->table[slot] = (long)graph->node_count;
+
+    return (long)graph->node_count++;
+}
+
+static int xrefAddEdge(XrefEdgeList* list, long source, long target, int kind)
+{
+    XrefEdge* grown;
+
+    if (source < 0 || target < 0) return FALSE;
+    if (source == target) return TRUE;  /* Переходы внутри процедуры не нужны */
+
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity * 2 + 256;
+        grown = (XrefEdge*)realloc(list->edges, list->capacity * sizeof(XrefEdge));
+        if (grown == NULL) return FALSE;
+        list->edges = grown;
+    }
+    list->edges[list->count].source = (size_t)source;
+    list->edges[list->count].target = (size_t)target;
+    list->edges[list->count].kind = (unsigned char)kind;
+    list->count++;
+    return TRUE;
+}
+
+/* Сравнивает span с ASCII-строкой word */
+static int spanEquals(const char* span, size_t len, const char* word)
+{
+    return strlen(word) == len && memcmp(span, word, len) == 0;
+}
+
+/* TRUE, если операнд call - имя (а не регистр или адрес в памяти) */
+static int isCallTargetName(const char* op, size_t len)
+{
+    static const char* registers[] = { "eax", "ebx", "ecx", "edx", "esi", "edi", "ebp", "esp" };
+    size_t k;
+
+    if (len == 0 || memchr(op, '[', len) != NULL) return FALSE;
+    if (!((op[0] >= 'A' && op[0] <= 'Z') || (op[0] >= 'a' && op[0] <= 'z') ||
+          op[0] == '_' || op[0] == '@' || op[0] == '?' || op[0] == '$')) {
+        return FALSE;
+    }
+    for (k = 0; k < sizeof(registers) / sizeof(registers[0]); k++) {
+        if (spanEquals(op, len, registers[k])) return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Разбирает ссылки из комментария: слова вида "имя+смещение<стрелка><вид>"
+ * или "имя:метка<стрелка><вид>". Ссылки из кода вне процедур
+ * (".text:00402310") пропускаются: у них нет имени-источника.
+ */
+static int xrefParseComment(XrefGraph* graph, XrefEdgeList* list, long owner,
+                            const char* comment, size_t len)
+{
+    size_t pos = 0;
+    size_t tok;
+    size_t tok_len;
+    size_t name_len;
+    unsigned char arrow;
+    int kind;
+
+    while (phraseNextToken(comment, len, &pos, &tok, &tok_len)) {
+        if (tok_len < 3) continue;
+        arrow = (unsigned char)comment[tok + tok_len - 2];
+        kind = comment[tok + tok_len - 1];
+        if (arrow != XREF_ARROW_UP && arrow != XREF_ARROW_DOWN) continue;
+        if (kind != XREF_CALL && kind != XREF_JUMP && kind != XREF_READ &&
+            kind != XREF_WRITE && kind != XREF_OFFSET) {
+            continue;
+        }
+        if (comment[tok] == '.' || owner < 0) continue;
+
+        name_len = 0;
+        while (name_len < tok_len - 2 && comment[tok + name_len] != '+' &&
+               comment[tok + name_len] != ':') {
+            name_len++;
+        }
+        if (name_len == 0) continue;
+
+        if (!xrefAddEdge(list, xrefIntern(graph, comment + tok, name_len), owner, kind)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* Читает строку потока в растущий буфер; FALSE - конец файла */
+static int readLine(FILE* f, char** buffer, size_t* capacity, size_t* len)
+{
+    char* grown;
+    int c;
+
+    *len = 0;
+    while ((c = fgetc(f)) != EOF && c != '\n') {
+        if (*len + 1 >= *capacity) {
+            *capacity = *capacity * 2 + 256;
+            grown = (char*)realloc(*buffer, *capacity);
+            if (grown == NULL) return FALSE;
+            *buffer = grown;
+        }
+        (*buffer)[(*len)++] = (char)c;
+    }
+    if (*len > 0 && (*buffer)[*len - 1] == '\r') (*len)--;
+    return c != EOF || *len > 0;
+}
+
+static int compareXrefEdges(const void* a, const void* b)
+{
+    const XrefEdge* x = (const XrefEdge*)a;
+    const XrefEdge* y = (const XrefEdge*)b;
+
+    if (x->source != y->source) return (x->source < y->source) ? -1 : 1;
+    if (x->target != y->target) return (x->target < y->target) ? -1 : 1;
+    return (int)x->kind - (int)y->kind;
+}
+
+/* Упаковывает отсортированные ребра в CSR по полю source (forward) или target */
+static int xrefPack(const XrefGraph* graph, const XrefEdge* edges, size_t count, int forward,
+                    size_t** offset, size_t** other, unsigned char** kind)
+{
+    size_t i;
+    size_t node;
+    size_t* cursor;
+
+    *offset = (size_t*)calloc(graph->node_count + 1, sizeof(size_t));
+    *other = (size_t*)malloc((count + 1) * sizeof(size_t));
+    *kind = (unsigned char*)malloc(count + 1);
+    cursor = (size_t*)malloc((graph->node_count + 1) * sizeof(size_t));
+    if (*offset == NULL || *other == NULL || *kind == NULL || cursor == NULL) {
+        free(cursor);
+        return FALSE;
+    }
+
+    /* Подсчет степеней, префиксные суммы, раскладка (устойчиво) */
+    for (i = 0; i < count; i++) {
+        (*offset)[(forward ? edges[i].source : edges[i].target) + 1]++;
+    }
+    for (node = 0; node < graph->node_count; node++) {
+        (*offset)[node + 1] += (*offset)[node];
+        cursor[node] = (*offset)[node];
+    }
+    for (i = 0; i < count; i++) {
+        node = forward ? edges[i].source : edges[i].target;
+        (*other)[cursor[node]] = forward ? edges[i].target : edges[i].source;
+        (*kind)[cursor[node]] = edges[i].kind;
+        cursor[node]++;
+    }
+
+    free(cursor);
+    return TRUE;
+}
+
+int xrefGraphBuild(XrefGraph* graph, FILE* listing)
+{
+    XrefEdgeList list;
+    ListingLine parsed;
+    char* line = NULL;
+    size_t line_cap = 0;
+    size_t line_len;
+    size_t i;
+    size_t kept;
+    const char* label;
+    const char* mnemonic;
+    const char* operands;
+    size_t op_len;
+    long proc = -1;    /* Текущая процедура (между proc и endp) */
+    long owner = -1;   /* Куда ведут ссылки из комментария текущей строки */
+    int ok = TRUE;
+
+    memset(graph, 0, sizeof(*graph));
+    list.edges = NULL;
+    list.count = 0;
+    list.capacity = 0;
+
+    graph->table = (long*)malloc(64 * sizeof(long));
+    if (graph->table == NULL) return FALSE;
+    graph->table_mask = 63;
+    for (i = 0; i < 64; i++) graph->table[i] = -1;
+
+    while (ok && readLine(listing, &line, &line_cap, &line_len)) {
+        if (!listingParseLine(line, line_len, &parsed)) continue;
+
+        label = line + parsed.start[LISTING_FIELD_LABEL];
+        mnemonic = line + parsed.start[LISTING_FIELD_MNEMONIC];
+        operands = line + parsed.start[LISTING_FIELD_OPERANDS];
+        op_len = parsed.len[LISTING_FIELD_OPERANDS];
+
+        if (parsed.len[LISTING_FIELD_LABEL] > 0) {
+            if (spanEquals(mnemonic, parsed.len[LISTING_FIELD_MNEMONIC], "proc")) {
+                proc = xrefIntern(graph, label, parsed.len[LISTING_FIELD_LABEL]);
+                owner = proc;
+                ok = (proc >= 0);
+            } else if (spanEquals(mnemonic, parsed.len[LISTING_FIELD_MNEMONIC], "endp")) {
+                proc = -1;
+            } else if (proc < 0) {
+                /* Метка данных вне процедуры */
+                owner = xrefIntern(graph, label, parsed.len[LISTING_FIELD_LABEL]);
+                ok = (owner >= 0);
+            }
+        } else if (spanEquals(mnemonic, parsed.len[LISTING_FIELD_MNEMONIC], "extrn")) {
+            /* Импорт: "extrn RegOpenKeyExW:dword" */
+            i = 0;
+            while (i < op_len && operands[i] != ':') i++;
+            owner = xrefIntern(graph, operands, i);
+            ok = (owner >= 0);
+        }
+
+        /* Вызов по имени внутри процедуры */
+        if (ok && proc >= 0 && spanEquals(mnemonic, parsed.len[LISTING_FIELD_MNEMONIC], "call")) {
+            if (op_len > 3 && operands[2] == ':') {  /* ds:GetModuleHandleW */
+                operands += 3;
+                op_len -= 3;
+            }
+            i = 0;
+            while (i < op_len && !isBlank(operands[i])) i++;
+            if (isCallTargetName(operands, i)) {
+                ok = xrefAddEdge(&list, proc, xrefIntern(graph, operands, i), XREF_CALL);
+            }
+        }
+
+        if (ok && parsed.len[LISTING_FIELD_COMMENT] > 0) {
+            ok = xrefParseComment(graph, &list, proc >= 0 ? proc : owner,
+                                  line + parsed.start[LISTING_FIELD_COMMENT],
+                                  parsed.len[LISTING_FIELD_COMMENT]);
+        }
+    }
+    free(line);
+
+    if (ok) {
+        /* Одно ребро на (источник, приемник, вид): call и XREF дублируют друг друга */
+        qsort(list.edges, list.count, sizeof(XrefEdge), compareXrefEdges);
+        kept = 0;
+        for (i = 0; i < list.count; i++) {
+            if (kept > 0 && compareXrefEdges(&list.edges[i], &list.edges[kept - 1]) == 0) continue;
+            list.edges[kept++] = list.edges[i];
+        }
+        graph->edge_count = kept;
+
+        ok = xrefPack(graph, list.edges, kept, TRUE,
+                      &graph->out_offset, &graph->out_target, &graph->out_kind) &&
+             xrefPack(graph, list.edges, kept, FALSE,
+                      &graph->in_offset, &graph->in_source, &graph->in_kind);
+    }
+    free(list.edges);
+
+    if (!ok) {
+        xrefGraphFree(graph);
+    }
+    return ok;
+}
+
+void xrefGraphFree(XrefGraph* graph)
+{
+    free(graph->pool);
+    free(graph->name_start);
+    free(graph->name_len);
+    free(graph->table);
+    free(graph->out_offset);
+    free(graph->out_target);
+    free(graph->out_kind);
+    free(graph->in_offset);
+    free(graph->in_source);
+    free(graph->in_kind);
+    memset(graph, 0, sizeof(*graph));
 }
\ No newline at end of file
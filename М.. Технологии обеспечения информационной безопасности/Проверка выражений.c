@@ -8,17 +8,142 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
 
-/* --- Константы и определения --- */
+#ifdef VALIDATOR_THREADS
+#include <pthread.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#define MAX_EXPR_LEN 1024
-#define BUFFER_SIZE (MAX_EXPR_LEN + 2) /* +1 для \n и +1 для \0 */
+/* --- Константы и определения --- */
 
 #define TRUE 1
 #define FALSE 0
 
+/*
+ * Классы байтов для табличного автомата. Принадлежность классам
+ * совпадает с isspace/isdigit/islower в локали "C".
+ */
+#define CLASS_SPACE    0  /* Пробельный символ */
+#define CLASS_DIGIT    1  /* Цифра */
+#define CLASS_LETTER   2  /* Переменная (строчная латинская буква) */
+#define CLASS_OPEN     3  /* '(' */
+#define CLASS_CLOSE    4  /* ')' */
+#define CLASS_SIGN     5  /* '+' или '-': бинарный или унарный */
+#define CLASS_MULOP    6  /* '*', '/', '%' */
+#define CLASS_OTHER    7  /* Недопустимый символ */
+#define CLASS_COUNT    8
+
+/*
+ * Состояния автомата. К двум состояниям исходного анализатора добавлены
+ * "внутри числа" (цифра продолжает число, а не начинает второй операнд)
+ * и поглощающее состояние ошибки.
+ */
+#define DFA_OPERAND    0  /* STATE_EXPECT_OPERAND */
+#define DFA_OPERATOR   1  /* STATE_EXPECT_OPERATOR */
+#define DFA_NUMBER     2  /* STATE_EXPECT_OPERATOR сразу после цифры */
+#define DFA_ERROR      3
+#define DFA_STATES     4
+
+/*
+ * Элемент таблицы переходов: новое состояние в битах 0-1 и изменение
+ * баланса скобок + 1 в битах 2-3 (0 - ')', 1 - нет скобки, 2 - '(').
+ */
+#define DFA_STEP(state, delta) ((unsigned char)((state) | (((delta) + 1) << 2)))
+
+/*
+ * Расширенная грамматика (--extended). Классы байтов: буква или '_'
+ * (EXT_ALPHA) начинает имя, '.' - дробную часть, ',' - следующий
+ * аргумент вызова.
+ */
+#define EXT_SPACE      0
+#define EXT_DIGIT      1
+#define EXT_ALPHA      2
+#define EXT_DOT        3
+#define EXT_OPEN       4
+#define EXT_CLOSE      5
+#define EXT_SIGN       6
+#define EXT_MULOP      7
+#define EXT_COMMA      8
+#define EXT_OTHER      9
+#define EXT_CLASS_COUNT 10
+#define EXT_ROW        16  /* Шаг строки таблицы переходов (степень двойки) */
+
+/* Состояния расширенного автомата */
+#define EXT_OPERAND    0  /* Ожидается операнд */
+#define EXT_CALL       1  /* Сразу после "имя(": операнд или ')' пустого вызова */
+#define EXT_OPERATOR   2  /* Ожидается оператор, ')' или ',' */
+#define EXT_NUMBER     3  /* Внутри целой части числа */
+#define EXT_POINT      4  /* После '.': нужна цифра */
+#define EXT_FRACTION   5  /* Внутри дробной части */
+#define EXT_NAME       6  /* Внутри имени: '(' открывает вызов */
+#define EXT_ERROR      7
+#define EXT_STATES     8
+
+/*
+ * Действия со скобками, которыми помечены переходы. Элемент таблицы:
+ * флаги действия в битах 0-3 и смещение строки нового состояния
+ * (state * EXT_ROW) в битах 4-6 - следующий индекс получается одной
+ * маской, без умножения.
+ */
+#define ACT_NONE       0
+#define ACT_PUSH       1  /* '(': глубина + 1 */
+#define ACT_POP        2  /* ')': глубина - 1 */
+#define ACT_KIND_CALL  4  /* '(' открывает вызов */
+#define ACT_COMMA      8  /* ',': ближайшая скобка должна быть вызовом */
+#define ACT_GROUP      ACT_PUSH
+#define ACT_CALL       (ACT_PUSH | ACT_KIND_CALL)
+#define ACT_CLOSE      ACT_POP
+#define EXT_STEP(state, action) ((unsigned char)((state) * EXT_ROW | (action)))
+
+/* Размеры буферов */
+#define INPUT_BLOCK_SIZE  (64 * 1024)  /* Блок чтения входного потока */
+#define VECTOR_BLOCK      32           /* Байт на шаг векторной проверки */
+
+/* Предел вложенности для рекурсивного разбора (скобки и приоритеты) */
+#define PARSE_MAX_DEPTH   2000
+#define NO_NODE           (-1L)
+#define VARIABLE_COUNT    26           /* Переменные 'a'..'z' */
+#define COLUMN_BLOCK      256          /* Строк в блоке столбцового вычисления */
+
+/* Кэш вердиктов */
+#define CACHE_ENTRIES     4096         /* Записей в кэше */
+#define CACHE_KEY_MAX     64           /* Более длинные выражения не кэшируются */
+#define CACHE_WINDOW      4096         /* Обращений в окне подсчета попаданий */
+#define CACHE_MIN_HITS    (CACHE_WINDOW - CACHE_WINDOW / 16) /* Порог окупаемости */
+#define CACHE_BYPASS      (64UL * CACHE_WINDOW) /* Строк без кэша после плохого окна */
+#define NO_ENTRY          (-1L)
+
+/* Унарные знаки в стеке операторов --rpn (бинарные хранятся своим символом) */
+#define RPN_PLUS          'p'
+#define RPN_MINUS         'm'
+
+/* Инкрементальная проверка: размеры листьев текста */
+#define LEAF_CAPACITY     1024         /* Наибольшая длина листа */
+#define LEAF_TARGET       512          /* Длина листа после разрезания */
+#define LEAF_MERGE        64           /* Лист короче - сливается с соседом */
+#define LEAF_SPARES       (2 * LEAF_CAPACITY / LEAF_TARGET) /* Запас листьев под вставку */
+
+/* Параллельная проверка одного выражения */
+#define PARALLEL_WORKERS  4            /* Участков (и потоков) по умолчанию */
+#define PARALLEL_MAX      64
+#define OUTPUT_BLOCK_SIZE (64 * 1024)  /* Буфер вывода вердиктов */
+#define BATCH_BLOCK_SIZE  (1024 * 1024) /* Блок строк для потока в --threads */
+
+/* Случайные выражения для --fuzz и --bench */
+#define FUZZ_MAX_LENGTH   256          /* Наибольшая длина выражения в --fuzz */
+#define FUZZ_MAX_DEPTH    40           /* Наибольшая вложенность скобок */
+#define FUZZ_SLACK        (2 * FUZZ_MAX_DEPTH + 16) /* Запас сверх длины */
+#define BENCH_MAX_LENGTH  (100UL * 1000 * 1000)
+#define BENCH_BUDGET      (32UL * 1000 * 1000)     /* Байт на движок и длину */
+#define BENCH_ENGINES     5
+
 /*
  * Состояния конечного автомата для синтаксического анализа.
  * ENUM - стандартный и безопасный способ представления состояний.
@@ -28,6 +153,243 @@ typedef enum {
     STATE_EXPECT_OPERATOR /* Ожидается бинарный оператор или закрывающая скобка */
 } State;
 
+/*
+ * Состояние потоковой проверки: выражение можно подавать частями любой
+ * длины, память не зависит от длины выражения.
+ */
+typedef struct {
+    unsigned int state;   /* DFA_OPERAND, DFA_OPERATOR, DFA_NUMBER или DFA_ERROR */
+    long balance;         /* Текущий баланс скобок */
+    long lowest;          /* Наименьший баланс с начала выражения (<= 0) */
+} ValidatorState;
+
+/*
+ * Сводка участка выражения, не зависящая от текста до него:
+ * в какое состояние переходит автомат из каждого начального состояния,
+ * суммарное изменение баланса скобок и наименьший баланс относительно
+ * начала участка. Сводки соседних участков объединяются ассоциативно.
+ */
+typedef struct {
+    unsigned char end_state[DFA_STATES];
+    long delta;
+    long lowest;
+} ChunkSummary;
+
+/* Лист текста для инкрементальной проверки */
+typedef struct {
+    size_t length;
+    ChunkSummary summary;        /* Сводка text[0..length-1] */
+    char text[LEAF_CAPACITY];
+} TextLeaf;
+
+/* Узел дерева отрезков над листьями */
+typedef struct {
+    ChunkSummary summary;        /* Сводка текста поддерева */
+    size_t length;               /* Байт в поддереве */
+} SummaryNode;
+
+/*
+ * Текст, проверяемый заново после каждой правки. Листья идут по
+ * порядку текста; tree - дерево отрезков в массиве: корень - узел 1,
+ * лист i - узел width + i, лишние листья пусты (нейтральная сводка).
+ */
+typedef struct {
+    TextLeaf **leaves;
+    size_t count;
+    size_t capacity;
+    SummaryNode *tree;
+    size_t width;                /* Степень двойки >= count; 0 - дерева нет */
+    size_t length;               /* Длина текста */
+    TextLeaf *spare[LEAF_SPARES]; /* Запас для вставок до LEAF_CAPACITY байт */
+} IncrementalText;
+
+/* Запись кэша: строка выражения и ее вердикт */
+typedef struct {
+    unsigned long hash;          /* cacheHash ключа (32 бита) */
+    unsigned char length;        /* Длина ключа */
+    unsigned char valid;         /* Вердикт */
+    unsigned char referenced;    /* Бит CLOCK: было попадание */
+    char key[CACHE_KEY_MAX];
+} CacheEntry;
+
+/*
+ * Кэш вердиктов. Записи лежат в массиве фиксированного размера и
+ * вытесняются по кругу алгоритмом CLOCK; index - таблица с открытой
+ * адресацией (линейные пробы) из номеров записей, вдвое больше массива.
+ * При вытеснении номер удаляется из index обратным сдвигом, без
+ * надгробий, так что цепочки проб не растут.
+ */
+typedef struct {
+    CacheEntry *entries;
+    size_t count;                /* Занято записей */
+    size_t hand;                 /* Стрелка CLOCK */
+    long *index;                 /* Номер записи или NO_ENTRY */
+    size_t mask;                 /* Размер index - 1 (степень двойки) */
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long window;        /* Обращений в текущем окне */
+    unsigned long window_hits;   /* Попаданий в текущем окне */
+    unsigned long bypass;        /* Сколько строк еще проверять мимо кэша */
+} VerdictCache;
+
+/*
+ * Потоковый перевод в обратную польскую запись (сортировочная станция).
+ * Корректность проверяется тем же автоматом состояний DFA_*, что и в
+ * validatorFeed, поэтому отдельный проход не нужен. В стеке лежат
+ * только не выведенные операторы и открытые скобки: на уровень
+ * вложенности - не больше двух бинарных операторов и цепочки унарных
+ * знаков перед операндом.
+ */
+typedef struct {
+    int state;                   /* DFA_OPERAND, DFA_OPERATOR, DFA_NUMBER или DFA_ERROR */
+    char *stack;                 /* '(', символы бинарных операторов, RPN_PLUS, RPN_MINUS */
+    size_t depth;
+    size_t stack_capacity;
+    char *output;                /* Лексемы через пробел */
+    size_t length;
+    size_t capacity;
+    int failed;                  /* Не хватило памяти */
+} RpnConverter;
+
+/*
+ * Состояние проверки по расширенной грамматике. В отличие от
+ * ValidatorState, одного баланса мало: запятая допустима, только если
+ * ближайшая открытая скобка - скобка вызова. Поэтому кроме глубины
+ * хранится глубина внутри самого вложенного открытого вызова и стек
+ * таких глубин для объемлющих вызовов. Память - по числу вложенных
+ * вызовов, а не скобок.
+ */
+typedef struct {
+    unsigned int state;      /* EXT_OPERAND ... EXT_ERROR */
+    size_t depth;            /* Число открытых скобок */
+    size_t call_depth;       /* Глубина внутри текущего вызова; 0 - вне вызовов */
+    size_t *calls;           /* call_depth объемлющих вызовов */
+    size_t count;            /* Элементов в calls */
+    size_t capacity;
+    int failed;              /* Не хватило памяти для стека */
+} ExtendedValidator;
+
+/* Причины, по которым выражение отвергнуто */
+typedef enum {
+    ERROR_NONE,                /* Выражение корректно */
+    ERROR_EMPTY,               /* Нет ни одной лексемы */
+    ERROR_INVALID_CHAR,        /* Символ вне грамматики */
+    ERROR_UNEXPECTED_OPERATOR, /* '*', '/' или '%' на месте операнда */
+    ERROR_UNEXPECTED_CLOSE,    /* ')' на месте операнда: "()", "a+)" */
+    ERROR_TWO_OPERANDS,        /* Операнд или '(' на месте оператора: "7a", "(a)(b)" */
+    ERROR_UNBALANCED_CLOSE,    /* ')' без парной '(' */
+    ERROR_TRAILING_OPERATOR,   /* Выражение оборвалось после оператора или '(' */
+    ERROR_UNCLOSED_OPEN        /* '(' без парной ')' */
+} ErrorReason;
+
+/* Диагностика: причина и смещение байта (от 0), к которому она относится */
+typedef struct {
+    ErrorReason reason;
+    size_t offset;
+} ValidationError;
+
+/*
+ * Значение выражения - 32-битное целое с переполнением по модулю 2^32
+ * (как int32 в дополнительном коде). Проверка ниже не дает собрать
+ * программу там, где int другой ширины.
+ */
+typedef int ExprValue;
+typedef char ExprValueIs32Bit[(sizeof(ExprValue) == 4) ? 1 : -1];
+
+/* Виды узлов синтаксического дерева */
+typedef enum {
+    NODE_NUMBER,    /* Число: value */
+    NODE_VARIABLE,  /* Переменная: value = 0..25 для 'a'..'z' */
+    NODE_NEGATE,    /* Унарный минус: left */
+    NODE_PLUS,      /* Унарный плюс: left */
+    NODE_ADD,       /* Бинарные операторы: left, right */
+    NODE_SUB,
+    NODE_MUL,
+    NODE_DIV,
+    NODE_MOD
+} NodeKind;
+
+/* Результат разбора выражения в дерево */
+typedef enum {
+    PARSE_OK,
+    PARSE_INVALID,       /* Выражение некорректно */
+    PARSE_TOO_DEEP,      /* Вложенность больше PARSE_MAX_DEPTH */
+    PARSE_NO_MEMORY      /* Не хватило памяти арены */
+} ParseStatus;
+
+/* Узел дерева: потомки - индексы в арене, NO_NODE - нет потомка */
+typedef struct {
+    NodeKind kind;
+    ExprValue value;
+    long left;
+    long right;
+} AstNode;
+
+/*
+ * Арена узлов: один растущий массив. Сброс обнуляет счетчик, но
+ * сохраняет память, так что разбор потока выражений после разогрева
+ * не обращается к куче.
+ */
+typedef struct {
+    AstNode *nodes;
+    size_t count;
+    size_t capacity;
+} ExprArena;
+
+/*
+ * Команды стековой машины. У каждой бинарной операции три формы:
+ * правый операнд со стека, число argument или переменная argument.
+ * Две последние сокращают число команд почти вдвое: "a*b+7" - это
+ * OP_VARIABLE a, OP_MUL_VARIABLE b, OP_ADD_CONST 7.
+ */
+typedef enum {
+    OP_CONST,           /* Положить argument */
+    OP_VARIABLE,        /* Положить значение переменной с номером argument */
+    OP_NEGATE,          /* Сменить знак вершины */
+    OP_ADD,             /* Снять правый и левый операнды, положить результат */
+    OP_ADD_CONST,       /* Заменить вершину на (вершина op argument) */
+    OP_ADD_VARIABLE,    /* Заменить вершину на (вершина op переменная argument) */
+    OP_SUB,
+    OP_SUB_CONST,
+    OP_SUB_VARIABLE,
+    OP_MUL,
+    OP_MUL_CONST,
+    OP_MUL_VARIABLE,
+    OP_DIV,
+    OP_DIV_CONST,
+    OP_DIV_VARIABLE,
+    OP_MOD,
+    OP_MOD_CONST,
+    OP_MOD_VARIABLE
+} OpCode;
+
+/* Основная (стековая) форма бинарной команды op (только для op >= OP_ADD) */
+#define OP_BASE(op) ((OpCode)(OP_ADD + ((op) - OP_ADD) / 3 * 3))
+
+typedef struct {
+    OpCode op;
+    ExprValue argument;
+} Instruction;
+
+/* Скомпилированное выражение */
+typedef struct {
+    Instruction *code;
+    size_t length;
+    size_t capacity;
+    size_t max_stack;   /* Наибольшая глубина стека при вычислении */
+} Bytecode;
+
+/*
+ * Буферизованный вывод: вердикты копятся в памяти и записываются
+ * блоками, а не отдельным вызовом printf на каждую строку.
+ */
+typedef struct {
+    FILE *stream;
+    size_t length;
+    int failed;                      /* TRUE после ошибки записи */
+    char data[OUTPUT_BLOCK_SIZE];
+} OutputBuffer;
+
 
 /* --- Прототипы функций --- */
 
@@ -38,131 +400,4047 @@ typedef enum {
  */
 int isValidExpression(const char *expr);
 
+/* Начинает проверку нового выражения. */
+void validatorInit(ValidatorState *validator);
+
+/*
+ * Продолжает проверку очередной частью выражения из length байт.
+ * Нулевой байт внутри части - недопустимый символ (класс CLASS_OTHER).
+ */
+void validatorFeed(ValidatorState *validator, const char *data, size_t length);
+
+/* То же, что validatorFeed, но всегда побайтовым табличным автоматом. */
+void validatorFeedScalar(ValidatorState *validator, const char *data, size_t length);
+
+/* Возвращает TRUE, если поданный к этому моменту текст - корректное выражение. */
+int validatorAccepts(const ValidatorState *validator);
+
+/* Подготавливает проверку по расширенной грамматике (без памяти). */
+void extendedInit(ExtendedValidator *validator);
+
+/* Начинает проверку нового выражения, сохраняя память стека. */
+void extendedReset(ExtendedValidator *validator);
+
+/* Продолжает проверку очередной частью выражения из length байт. */
+void extendedFeed(ExtendedValidator *validator, const char *data, size_t length);
+
+/* Возвращает TRUE, если поданный текст - корректное расширенное выражение. */
+int extendedAccepts(const ExtendedValidator *validator);
+
+/* Освобождает память стека вызовов. */
+void extendedFree(ExtendedValidator *validator);
+
+/* Сводка пустого участка - нейтральный элемент объединения. */
+void chunkSummaryEmpty(ChunkSummary *summary);
+
+/* Строит сводку участка из length байт. */
+void chunkSummarize(const char *data, size_t length, ChunkSummary *summary);
+
+/* Объединяет сводки соседних участков: left, затем right. out может совпадать с left или right. */
+void chunkCompose(const ChunkSummary *left, const ChunkSummary *right, ChunkSummary *out);
+
+/* Возвращает TRUE, если сводка всего текста описывает корректное выражение. */
+int chunkSummaryAccepts(const ChunkSummary *summary);
+
+/* Подготавливает пустой текст. */
+void incrementalInit(IncrementalText *text);
+
+/* Освобождает память текста. */
+void incrementalFree(IncrementalText *text);
+
+/*
+ * Заменяет removed байт с позиции position на length байт inserted.
+ * Стоимость обычной правки - O(log n) объединений сводок плюс
+ * перестроение затронутого листа. Возвращает FALSE, если отрезок вне
+ * текста или не хватило памяти; тогда текст не изменен.
+ */
+int incrementalEdit(IncrementalText *text, size_t position, size_t removed,
+                    const char *inserted, size_t length);
+
+/* Возвращает TRUE, если текст - корректное выражение (как isValidExpression). */
+int incrementalAccepts(const IncrementalText *text);
+
+/* Подготавливает пустой кэш на CACHE_ENTRIES записей; FALSE - нет памяти. */
+int cacheInit(VerdictCache *cache);
+
+/* Освобождает память кэша. */
+void cacheFree(VerdictCache *cache);
+
+/*
+ * Проверяет выражение из length байт, как isValidExpression, но
+ * берет вердикт из кэша, если такая же строка уже встречалась.
+ */
+int cacheValidate(VerdictCache *cache, const char *expr, size_t length);
+
+/* Подготавливает перевод в RPN (без памяти). */
+void rpnInit(RpnConverter *converter);
+
+/* Начинает новое выражение, сохраняя память стека и вывода. */
+void rpnReset(RpnConverter *converter);
+
+/* Продолжает выражение очередной частью из length байт. */
+void rpnFeed(RpnConverter *converter, const char *data, size_t length);
+
+/*
+ * Завершает выражение. Возвращает TRUE, если оно корректно (как
+ * isValidExpression) и память не кончилась; тогда запись лежит в
+ * converter->output[0..length-1].
+ */
+int rpnFinish(RpnConverter *converter);
+
+/* Освобождает память. */
+void rpnFree(RpnConverter *converter);
+
+/*
+ * Медленный диагностический проход по тому же автомату: находит первую
+ * ошибку в выражении из length байт. Возвращает TRUE, если выражение
+ * корректно (error->reason == ERROR_NONE), иначе FALSE.
+ */
+int diagnoseExpression(const char *expr, size_t length, ValidationError *error);
+
+/* Текст причины ошибки для вывода пользователю. */
+const char *errorReasonText(ErrorReason reason);
+
+/* Подготавливает пустую арену. */
+void arenaInit(ExprArena *arena);
+
+/* Очищает арену для следующего выражения, сохраняя память. */
+void arenaReset(ExprArena *arena);
+
+/* Освобождает память арены. */
+void arenaFree(ExprArena *arena);
+
+/*
+ * Разбирает выражение из length байт методом подъема по приоритетам
+ * и кладет дерево в арену; индекс корня - в *root (при PARSE_OK).
+ * PARSE_TOO_DEEP и PARSE_NO_MEMORY возвращаются только для корректных
+ * выражений: грамматика та же, что у isValidExpression, дерево просто
+ * не построено.
+ */
+ParseStatus parseExpression(const char *expr, size_t length, ExprArena *arena, long *root);
+
+/* Подготавливает пустой байт-код. */
+void bytecodeInit(Bytecode *program);
+
+/* Освобождает память байт-кода. */
+void bytecodeFree(Bytecode *program);
+
+/*
+ * Компилирует дерево с корнем root в байт-код (прежнее содержимое
+ * program заменяется). Унарный плюс выбрасывается, двойной минус
+ * сокращается, минус перед числом и операции над числами вычисляются
+ * при компиляции. Возвращает FALSE при нехватке памяти.
+ */
+int compileExpression(const ExprArena *arena, long root, Bytecode *program);
+
+/*
+ * Вычисляет байт-код при значениях переменных variables['x' - 'a'].
+ * stack - рабочая память не меньше program->max_stack элементов.
+ */
+ExprValue bytecodeEval(const Bytecode *program, const ExprValue *variables, ExprValue *stack);
+
+/*
+ * Вычисляет бинарную операцию (op - любая форма) с принятой семантикой
+ * переполнения и деления на 0.
+ */
+ExprValue evalBinary(OpCode op, ExprValue left, ExprValue right);
+
+/*
+ * Вычисляет байт-код для rows строк: значения переменной v берутся из
+ * columns[v][0..rows-1] (NULL - столбец нулей), результаты пишутся в
+ * result. Возвращает FALSE при нехватке памяти.
+ */
+int evalColumns(const Bytecode *program, const ExprValue *const *columns,
+                size_t rows, ExprValue *result);
+
+/*
+ * Исходная посимвольная реализация на isspace/isdigit/islower/strchr.
+ * Сохранена как эталон для сверки табличного автомата.
+ */
+int isValidExpressionReference(const char *expr);
+
+/*
+ * Проверяет каждую строку потока input и пишет в out "correct" или
+ * "incorrect" на строку; при extended - по расширенной грамматике.
+ * Длина строки не ограничена, строки не копируются. Последняя строка
+ * без '\n' тоже проверяется. Если cache не NULL, строки исходной
+ * грамматики, целиком лежащие в блоке чтения, проверяются через кэш.
+ * Возвращает FALSE при ошибке чтения, записи или нехватке памяти.
+ */
+int validateLines(FILE *input, OutputBuffer *out, int extended, VerdictCache *cache);
+
+/* Подготавливает буфер вывода в поток stream. */
+void outputInit(OutputBuffer *out, FILE *stream);
+
+/* Добавляет length байт в буфер, при заполнении сбрасывая его. */
+void outputWrite(OutputBuffer *out, const char *data, size_t length);
+
+/* Записывает накопленное; возвращает FALSE, если была ошибка записи. */
+int outputFlush(OutputBuffer *out);
+
 
 /* --- Основная логика --- */
 
-int main(void)
+/*
+ * Проверяет первую строку потока, читая ее блоками: строка любой длины
+ * проверяется целиком, а не обрезается по размеру буфера.
+ */
+static int validateFirstLine(FILE *input)
 {
-    /*
-     * ANSI C (C89/C90) требует объявления всех переменных в начале блока.
-     */
-    char buffer[BUFFER_SIZE];
-    char *newline_pos;
+    static char block[INPUT_BLOCK_SIZE];
+    ValidatorState validator;
+    const char *newline;
+    size_t filled;
 
-    /*
-     * Безопасное чтение ввода.
-     * fgets читает не более BUFFER_SIZE - 1 символов, предотвращая переполнение буфера.
-     * Всегда проверяем результат вызова системных функций.
-     */
-    if (fgets(buffer, sizeof(buffer), stdin) == NULL) {
-        /* Ошибка чтения или достигнут конец файла при пустом вводе */
-        printf("incorrect\n");
-        return 0;
+    validatorInit(&validator);
+    while ((filled = fread(block, 1, sizeof(block), input)) > 0) {
+        newline = (const char *)memchr(block, '\n', filled);
+        if (newline != NULL) {
+            validatorFeed(&validator, block, (size_t)(newline - block));
+            break;
+        }
+        validatorFeed(&validator, block, filled);
     }
+    return validatorAccepts(&validator);
+}
 
-    /*
-     * fgets сохраняет символ новой строки '\n', если он помещается в буфер.
-     * Его необходимо удалить для корректной обработки выражения.
-     */
-    newline_pos = strchr(buffer, '\n');
-    if (newline_pos != NULL) {
-        *newline_pos = '\0';
+/* Печатает вердикт проверенной строки */
+static void writeVerdict(OutputBuffer *out, int valid)
+{
+    if (valid) {
+        outputWrite(out, "correct\n", 8);
+    } else {
+        outputWrite(out, "incorrect\n", 10);
     }
+}
 
-    /*
-     * Вызов основной функции-валидатора и печать результата.
-     */
-    if (isValidExpression(buffer)) {
-        printf("correct\n");
-    } else {
-        printf("incorrect\n");
+/*
+ * Режимы --batch [файл], --extended [файл] и --cache [файл]: вердикт
+ * на каждую строку. Без имени файла строки читаются из stdin.
+ * --extended проверяет по расширенной грамматике (ExtendedValidator),
+ * --cache - через кэш вердиктов (VerdictCache).
+ */
+static int runBatch(const char *path, int extended, int cached)
+{
+    /* Буфер вывода велик для стека, поэтому он статический */
+    static OutputBuffer out;
+    VerdictCache cache;
+    FILE *input = stdin;
+    int ok;
+
+    if (path != NULL) {
+        input = fopen(path, "rb");
+        if (input == NULL) {
+            fprintf(stderr, "cannot open %s\n", path);
+            return 1;
+        }
+    }
+    if (cached && !cacheInit(&cache)) {
+        fprintf(stderr, "out of memory\n");
+        if (path != NULL) {
+            fclose(input);
+        }
+        return 1;
     }
 
-    return 0;
-}
+    outputInit(&out, stdout);
+    ok = validateLines(input, &out, extended, cached ? &cache : NULL);
+    ok = outputFlush(&out) && ok;
 
-/* --- Реализация функций --- */
+    if (cached) {
+        cacheFree(&cache);
+    }
+    if (path != NULL) {
+        fclose(input);
+    }
+    return ok ? 0 : 1;
+}
 
-int isValidExpression(const char *expr)
+/*
+ * Читает строку потока в растущий буфер без '\n' и завершает ее нулем
+ * (если буфер уже выделен); FALSE - конец файла.
+ */
+static int readLine(FILE *input, char **buffer, size_t *capacity, size_t *length)
 {
-    /* Объявление всех переменных в начале функции, как того требует ANSI C. */
-    int i;
-    int len;
-    char current_char;
-    int parenthesis_balance = 0; /* Счетчик для проверки баланса скобок */
-    State current_state = STATE_EXPECT_OPERAND;
+    char *grown;
+    size_t size;
+    int c;
 
-    len = strlen(expr);
+    *length = 0;
+    while ((c = getc(input)) != EOF && c != '\n') {
+        if (*length + 1 >= *capacity) {
+            /* Емкость меняется только вместе с буфером */
+            size = *capacity * 2 + 256;
+            grown = (char *)realloc(*buffer, size);
+            if (grown == NULL) {
+                return FALSE;
+            }
+            *buffer = grown;
+            *capacity = size;
+        }
+        (*buffer)[(*length)++] = (char)c;
+    }
+    if (*buffer != NULL) {
+        (*buffer)[*length] = '\0';
+    }
+    return c != EOF || *length > 0;
+}
 
-    /* Пустая строка или строка, состоящая только из пробелов, не является корректным выражением. */
-    /* Этот случай будет корректно обработан проверкой конечного состояния в конце функции. */
+/*
+ * Режим --explain [файл]: "correct" или "incorrect: <смещение>: <причина>".
+ * Сначала строка проверяется обычным быстрым путем, диагностический
+ * проход запускается только для отвергнутых строк.
+ */
+static int runExplain(const char *path)
+{
+    static OutputBuffer out;
+    ValidatorState validator;
+    ValidationError error;
+    FILE *input = stdin;
+    char *line = NULL;
+    char number[32];
+    const char *reason;
+    size_t capacity = 0;
+    size_t length;
+    int ok;
 
-    for (i = 0; i < len; ++i) {
-        current_char = expr[i];
+    if (path != NULL) {
+        input = fopen(path, "rb");
+        if (input == NULL) {
+            fprintf(stderr, "cannot open %s\n", path);
+            return 1;
+        }
+    }
 
-        if (isspace(current_char)) {
-            /* Пробельные символы игнорируются */
+    outputInit(&out, stdout);
+    while (readLine(input, &line, &capacity, &length)) {
+        validatorInit(&validator);
+        validatorFeed(&validator, line, length);
+        if (validatorAccepts(&validator)) {
+            outputWrite(&out, "correct\n", 8);
             continue;
         }
 
-        if (current_state == STATE_EXPECT_OPERAND) {
-            if (isdigit(current_char)) {
-                /* Нашли начало числа. Пропускаем все последующие цифры. */
-                while (i + 1 < len && isdigit(expr[i + 1])) {
-                    i++;
-                }
-                current_state = STATE_EXPECT_OPERATOR;
-            } else if (islower(current_char)) {
-                /* Нашли переменную */
-                current_state = STATE_EXPECT_OPERATOR;
-            } else if (current_char == '(') {
-                parenthesis_balance++;
-                /* После открывающей скобки мы снова ожидаем операнд */
-                current_state = STATE_EXPECT_OPERAND;
-            } else if (current_char == '+' || current_char == '-') {
-                /* Это унарный плюс или минус. После него все еще ожидается операнд. */
-                current_state = STATE_EXPECT_OPERAND;
-            } else {
-                /* В состоянии ожидания операнда встречен недопустимый символ */
-                return FALSE;
-            }
-        } else { /* current_state == STATE_EXPECT_OPERATOR */
-            if (strchr("+-*/%", current_char) != NULL) {
-                /* Нашли бинарный оператор. Далее ожидаем операнд. */
-                current_state = STATE_EXPECT_OPERAND;
-            } else if (current_char == ')') {
-                parenthesis_balance--;
-                /* После закрывающей скобки мы все еще ожидаем оператор, e.g. "(a+b)*c" */
-                current_state = STATE_EXPECT_OPERATOR;
-            } else {
-                /*
-                 * Ошибка: два операнда подряд без оператора.
-                 * Примеры: "7a", "(a+b)(c-d)"
-                 */
+        diagnoseExpression(line, length, &error);
+        reason = errorReasonText(error.reason);
+        sprintf(number, ": %lu: ", (unsigned long)error.offset);
+        outputWrite(&out, "incorrect", 9);
+        outputWrite(&out, number, strlen(number));
+        outputWrite(&out, reason, strlen(reason));
+        outputWrite(&out, "\n", 1);
+    }
+    ok = !ferror(input);
+    ok = outputFlush(&out) && ok;
+
+    free(line);
+    if (path != NULL) {
+        fclose(input);
+    }
+    return ok ? 0 : 1;
+}
+
+/* Шаги обхода дерева при печати */
+#define VISIT_ENTER  0   /* Узел еще не напечатан */
+#define VISIT_LEFT   1   /* Левый потомок напечатан */
+#define VISIT_RIGHT  2   /* Оба потомка напечатаны */
+
+/*
+ * Печатает дерево в префиксной записи: "(+ a (* 2 (neg b)))".
+ * Обход идет по явному стеку (*stack, растет по мере нужды и
+ * переиспользуется между строками): цепочки вида "a+a+...+a" дают
+ * деревья глубиной в длину выражения, и рекурсия переполнила бы стек.
+ */
+static int writeAst(OutputBuffer *out, const ExprArena *arena, long root,
+                    long **stack, size_t *capacity)
+{
+    static const char *names[] = { "", "", "neg", "pos", "+", "-", "*", "/", "%" };
+    const AstNode *node;
+    char text[16];
+    long *grown;
+    long index;
+    int visit;
+    size_t depth = 0;
+
+    if (*capacity < 2) {
+        *capacity = 64;
+        *stack = (long *)malloc(*capacity * sizeof(long));
+        if (*stack == NULL) {
+            return FALSE;
+        }
+    }
+    (*stack)[depth++] = root * 3 + VISIT_ENTER;
+
+    while (depth > 0) {
+        index = (*stack)[--depth];
+        visit = (int)(index % 3);
+        node = &arena->nodes[index / 3];
+
+        /* В стек кладется не более двух записей за шаг */
+        if (depth + 2 > *capacity) {
+            grown = (long *)realloc(*stack, *capacity * 2 * sizeof(long));
+            if (grown == NULL) {
                 return FALSE;
             }
+            *stack = grown;
+            *capacity *= 2;
         }
 
-        /*
-         * Анализ безопасности: Немедленная проверка дисбаланса скобок.
-         * Если счетчик стал отрицательным, значит закрывающая скобка встретилась раньше открывающей.
-         * Это предотвращает дальнейшую обработку заведомо некорректной строки.
-         */
-        if (parenthesis_balance < 0) {
-            return FALSE;
+        if (visit == VISIT_ENTER) {
+            if (node->kind == NODE_NUMBER) {
+                sprintf(text, "%d", node->value);
+                outputWrite(out, text, strlen(text));
+            } else if (node->kind == NODE_VARIABLE) {
+                text[0] = (char)('a' + node->value);
+                outputWrite(out, text, 1);
+            } else {
+                outputWrite(out, "(", 1);
+                outputWrite(out, names[node->kind], strlen(names[node->kind]));
+                outputWrite(out, " ", 1);
+                (*stack)[depth++] = index + VISIT_LEFT;
+                (*stack)[depth++] = node->left * 3 + VISIT_ENTER;
+            }
+        } else if (visit == VISIT_LEFT && node->right != NO_NODE) {
+            outputWrite(out, " ", 1);
+            (*stack)[depth++] = index - VISIT_LEFT + VISIT_RIGHT;
+            (*stack)[depth++] = node->right * 3 + VISIT_ENTER;
+        } else {
+            outputWrite(out, ")", 1);
         }
     }
+    return TRUE;
+}
+
+/* Сообщение о выражении, для которого не построено дерево */
+static const char *parseFailureText(ParseStatus status)
+{
+    switch (status) {
+    case PARSE_TOO_DEEP:
+        return "too deep";
+    case PARSE_NO_MEMORY:
+        return "out of memory";
+    default:
+        return "incorrect";
+    }
+}
+
+/* Сообщает, почему выражение --eval или --columns не скомпилировано */
+static void reportParseFailure(ParseStatus status)
+{
+    if (status == PARSE_INVALID) {
+        fprintf(stderr, "incorrect expression\n");
+    } else {
+        fprintf(stderr, "expression not compiled: %s\n", parseFailureText(status));
+    }
+}
+
+/*
+ * Режим --ast [файл]: дерево каждой строки, "incorrect" или "too deep"
+ * (корректная строка вложена глубже PARSE_MAX_DEPTH). Нехватка памяти
+ * прерывает режим.
+ */
+static int runAst(const char *path)
+{
+    static OutputBuffer out;
+    ExprArena arena;
+    FILE *input = stdin;
+    char *line = NULL;
+    long *stack = NULL;
+    size_t capacity = 0;
+    size_t stack_capacity = 0;
+    size_t length;
+    long root;
+    ParseStatus status;
+    int ok = TRUE;
+
+    if (path != NULL) {
+        input = fopen(path, "rb");
+        if (input == NULL) {
+            fprintf(stderr, "cannot open %s\n", path);
+            return 1;
+        }
+    }
+
+    arenaInit(&arena);
+    outputInit(&out, stdout);
+    while (ok && readLine(input, &line, &capacity, &length)) {
+        arenaReset(&arena);
+        status = parseExpression(line, length, &arena, &root);
+        if (status == PARSE_OK) {
+            ok = writeAst(&out, &arena, root, &stack, &stack_capacity);
+        } else {
+            ok = (status != PARSE_NO_MEMORY);
+            outputWrite(&out, parseFailureText(status), strlen(parseFailureText(status)));
+        }
+        outputWrite(&out, "\n", 1);
+    }
+    ok = ok && !ferror(input);
+    ok = outputFlush(&out) && ok;
+
+    arenaFree(&arena);
+    free(stack);
+    free(line);
+    if (path != NULL) {
+        fclose(input);
+    }
+    return ok ? 0 : 1;
+}
+
+/* Печатает запись строки в RPN или "incorrect" */
+static void writeRpn(OutputBuffer *out, RpnConverter *converter)
+{
+    if (rpnFinish(converter)) {
+        outputWrite(out, converter->output, converter->length);
+        outputWrite(out, "\n", 1);
+    } else {
+        outputWrite(out, "incorrect\n", 10);
+    }
+}
+
+/*
+ * Режим --rpn [файл]: обратная польская запись каждой строки (лексемы
+ * через пробел, унарные знаки - "u-" и "u+") или "incorrect".
+ * Строки подаются из блока чтения, как в
+ * validateLines; запись строки копится в converter->output и выводится
+ * только после того, как строка целиком признана корректной.
+ */
+static int runRpn(const char *path)
+{
+    static OutputBuffer out;
+    RpnConverter converter;
+    FILE *input = stdin;
+    char *block;
+    const char *line;
+    const char *newline;
+    size_t filled;
+    size_t rest;
+    int pending = FALSE;   /* Есть начатая и не завершенная строка */
+    int ok;
+
+    if (path != NULL) {
+        input = fopen(path, "rb");
+        if (input == NULL) {
+            fprintf(stderr, "cannot open %s\n", path);
+            return 1;
+        }
+    }
+
+    block = (char *)malloc(INPUT_BLOCK_SIZE);
+    ok = (block != NULL);
+    rpnInit(&converter);
+    outputInit(&out, stdout);
+    while (ok && (filled = fread(block, 1, INPUT_BLOCK_SIZE, input)) > 0) {
+        line = block;
+        rest = filled;
+
+        while (rest > 0 && (newline = (const char *)memchr(line, '\n', rest)) != NULL) {
+            rpnFeed(&converter, line, (size_t)(newline - line));
+            writeRpn(&out, &converter);
+            rpnReset(&converter);
+            rest -= (size_t)(newline - line) + 1;
+            line = newline + 1;
+        }
+
+        pending = (rest > 0);
+        rpnFeed(&converter, line, rest);
+        ok = !out.failed && !converter.failed;
+    }
+
+    ok = ok && !ferror(input);
+    if (ok && pending) {
+        /* Последняя строка без перевода строки */
+        writeRpn(&out, &converter);
+    }
+    ok = outputFlush(&out) && ok && !converter.failed;
+
+    rpnFree(&converter);
+    free(block);
+    if (path != NULL) {
+        fclose(input);
+    }
+    return ok ? 0 : 1;
+}
+
+/*
+ * Разбирает строку привязок "a=1 b=-2". Возвращает FALSE при ошибке
+ * синтаксиса; переменные без привязки получают 0.
+ */
+static int parseBindings(const char *line, size_t length, ExprValue *variables)
+{
+    char *end;
+    long value;
+    size_t i = 0;
+    int name;
+
+    memset(variables, 0, VARIABLE_COUNT * sizeof(ExprValue));
+    for (;;) {
+        while (i < length && isspace((unsigned char)line[i])) {
+            i++;
+        }
+        if (i == length) {
+            return TRUE;
+        }
+        if (i + 2 >= length || line[i] < 'a' || line[i] > 'z' || line[i + 1] != '=') {
+            return FALSE;
+        }
+        name = line[i] - 'a';
+        value = strtol(line + i + 2, &end, 10);
+        if (end == line + i + 2 || end > line + length) {
+            return FALSE;
+        }
+        variables[name] = (ExprValue)(unsigned int)(unsigned long)value;
+        i = (size_t)(end - line);
+    }
+}
+
+/*
+ * Режим --eval <выражение> [файл]: значение для каждой строки привязок
+ * вида "a=1 b=-2"; переменные без привязки равны 0.
+ */
+static int runEval(const char *expr, const char *path)
+{
+    static OutputBuffer out;
+    ExprArena arena;
+    Bytecode program;
+    ExprValue variables[VARIABLE_COUNT];
+    ExprValue *stack = NULL;
+    FILE *input = stdin;
+    char *line = NULL;
+    char text[32];
+    size_t capacity = 0;
+    size_t length;
+    long root;
+    ParseStatus status;
+    int ok;
+
+    arenaInit(&arena);
+    bytecodeInit(&program);
+    status = parseExpression(expr, strlen(expr), &arena, &root);
+    if (status != PARSE_OK) {
+        reportParseFailure(status);
+        arenaFree(&arena);
+        return 1;
+    }
+    ok = compileExpression(&arena, root, &program);
+    arenaFree(&arena);
+    if (ok) {
+        stack = (ExprValue *)malloc((program.max_stack + 1) * sizeof(ExprValue));
+    }
+    if (stack == NULL) {
+        fprintf(stderr, "out of memory\n");
+        bytecodeFree(&program);
+        return 1;
+    }
+
+    if (path != NULL) {
+        input = fopen(path, "rb");
+        if (input == NULL) {
+            fprintf(stderr, "cannot open %s\n", path);
+            free(stack);
+            bytecodeFree(&program);
+            return 1;
+        }
+    }
+
+    outputInit(&out, stdout);
+    while (readLine(input, &line, &capacity, &length)) {
+        if (parseBindings(line, length, variables)) {
+            sprintf(text, "%d\n", bytecodeEval(&program, variables, stack));
+            outputWrite(&out, text, strlen(text));
+        } else {
+            outputWrite(&out, "bad bindings\n", 13);
+        }
+    }
+    ok = !ferror(input);
+    ok = outputFlush(&out) && ok;
+
+    free(line);
+    free(stack);
+    bytecodeFree(&program);
+    if (path != NULL) {
+        fclose(input);
+    }
+    return ok ? 0 : 1;
+}
+
+/*
+ * Режим --columns <выражение> <файл>: первая строка файла - имена
+ * переменных через пробел ("a b c"), каждая следующая - их значения.
+ * Пустые строки пропускаются. Печатает значение выражения для каждой
+ * строки; при ошибке в файле называет номер строки.
+ */
+static int runColumns(const char *expr, const char *path)
+{
+    static OutputBuffer out;
+    ExprArena arena;
+    Bytecode program;
+    ExprValue *columns[VARIABLE_COUNT];
+    ExprValue *grown;
+    ExprValue *result = NULL;
+    int order[VARIABLE_COUNT];
+    int width = 0;
+    FILE *input;
+    char *line = NULL;
+    char *cursor;
+    char *end;
+    char text[32];
+    size_t capacity = 0;
+    size_t length;
+    size_t rows = 0;
+    size_t row_capacity = 0;
+    size_t number = 1;           /* Номер прочитанной строки файла */
+    size_t bad_line = 0;         /* Строка с ошибкой; 0 - ошибки в данных нет */
+    size_t i;
+    long root;
+    ParseStatus status;
+    int no_memory = FALSE;
+    int k;
+    int ok;
+
+    arenaInit(&arena);
+    bytecodeInit(&program);
+    status = parseExpression(expr, strlen(expr), &arena, &root);
+    if (status != PARSE_OK) {
+        reportParseFailure(status);
+        arenaFree(&arena);
+        return 1;
+    }
+    ok = compileExpression(&arena, root, &program);
+    arenaFree(&arena);
+    if (!ok) {
+        fprintf(stderr, "out of memory\n");
+        bytecodeFree(&program);
+        return 1;
+    }
+
+    input = fopen(path, "rb");
+    if (input == NULL) {
+        fprintf(stderr, "cannot open %s\n", path);
+        bytecodeFree(&program);
+        return 1;
+    }
+
+    for (k = 0; k < VARIABLE_COUNT; k++) {
+        columns[k] = NULL;
+    }
+
+    /* Заголовок: порядок столбцов */
+    if (readLine(input, &line, &capacity, &length)) {
+        for (i = 0; i < length; i++) {
+            if (line[i] >= 'a' && line[i] <= 'z' && width < VARIABLE_COUNT) {
+                order[width++] = line[i] - 'a';
+            } else if (!isspace((unsigned char)line[i])) {
+                ok = FALSE;
+                bad_line = number;
+            }
+        }
+    }
+
+    while (ok && readLine(input, &line, &capacity, &length)) {
+        number++;
+        i = 0;
+        while (i < length && isspace((unsigned char)line[i])) {
+            i++;
+        }
+        if (i == length) {
+            continue;
+        }
+        if (rows == row_capacity) {
+            row_capacity = row_capacity * 2 + 1024;
+            for (k = 0; k < width && ok; k++) {
+                grown = (ExprValue *)realloc(columns[order[k]], row_capacity * sizeof(ExprValue));
+                if (grown == NULL) {
+                    ok = FALSE;
+                    no_memory = TRUE;
+                } else {
+                    columns[order[k]] = grown;
+                }
+            }
+            if (!ok) {
+                break;
+            }
+        }
+        cursor = line;
+        for (k = 0; k < width; k++) {
+            columns[order[k]][rows] = (ExprValue)(unsigned int)(unsigned long)strtol(cursor, &end, 10);
+            if (end == cursor) {
+                ok = FALSE;
+                bad_line = number;
+                break;
+            }
+            cursor = end;
+        }
+        rows++;
+    }
+    if (ok && ferror(input)) {
+        ok = FALSE;
+    }
+    fclose(input);
+
+    if (ok) {
+        result = (ExprValue *)malloc((rows + 1) * sizeof(ExprValue));
+        ok = (result != NULL) &&
+             evalColumns(&program, (const ExprValue *const *)columns, rows, result);
+        no_memory = !ok;
+    }
+    if (ok) {
+        outputInit(&out, stdout);
+        for (i = 0; i < rows; i++) {
+            sprintf(text, "%d\n", result[i]);
+            outputWrite(&out, text, strlen(text));
+        }
+        ok = outputFlush(&out);
+    } else if (no_memory) {
+        fprintf(stderr, "out of memory\n");
+    } else if (bad_line > 0) {
+        fprintf(stderr, "bad column file %s, line %lu\n", path, (unsigned long)bad_line);
+    } else {
+        fprintf(stderr, "bad column file %s\n", path);
+    }
+
+    for (k = 0; k < VARIABLE_COUNT; k++) {
+        free(columns[k]);
+    }
+    free(result);
+    free(line);
+    bytecodeFree(&program);
+    return ok ? 0 : 1;
+}
+
+/*
+ * Режим --incremental <сценарий>: первая строка - исходный текст,
+ * следующие - правки "позиция удалить вставка" (вставка - остаток
+ * строки после одного пробела, может быть пустой). Вердикт печатается
+ * для исходного текста и после каждой правки.
+ */
+static int runIncremental(const char *path)
+{
+    static OutputBuffer out;
+    IncrementalText text;
+    FILE *input;
+    char *line = NULL;
+    char *cursor;
+    char *end;
+    size_t capacity = 0;
+    size_t length;
+    unsigned long position;
+    unsigned long removed;
+    int ok = TRUE;
+
+    input = fopen(path, "rb");
+    if (input == NULL) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return 1;
+    }
+
+    incrementalInit(&text);
+    outputInit(&out, stdout);
+    if (readLine(input, &line, &capacity, &length)) {
+        ok = incrementalEdit(&text, 0, 0, line, length);
+        if (ok) {
+            writeVerdict(&out, incrementalAccepts(&text));
+        }
+    }
+
+    while (ok && readLine(input, &line, &capacity, &length)) {
+        position = strtoul(line, &end, 10);
+        cursor = end;
+        removed = strtoul(cursor, &end, 10);
+        if (end == cursor || end == line || (*end != ' ' && *end != '\0')) {
+            outputWrite(&out, "bad edit\n", 9);
+            continue;
+        }
+        if (*end == ' ') {
+            end++;
+        }
+        if (!incrementalEdit(&text, position, removed, end, length - (size_t)(end - line))) {
+            outputWrite(&out, "bad edit\n", 9);
+            continue;
+        }
+        writeVerdict(&out, incrementalAccepts(&text));
+    }
+    ok = ok && !ferror(input);
+    ok = outputFlush(&out) && ok;
+
+    incrementalFree(&text);
+    free(line);
+    fclose(input);
+    return ok ? 0 : 1;
+}
+
+/* Участок файла для параллельной проверки */
+typedef struct {
+    const char *path;
+    long start;
+    long end;
+    ChunkSummary summary;
+    int ok;
+} ParallelJob;
+
+/* Сводит участок файла [start, end), читая его своим потоком FILE */
+static void summarizeFileRange(ParallelJob *job)
+{
+    char *block;
+    ChunkSummary part;
+    FILE *input;
+    size_t want;
+    size_t filled;
+    long position = job->start;
+
+    chunkSummaryEmpty(&job->summary);
+    job->ok = FALSE;
+
+    block = (char *)malloc(INPUT_BLOCK_SIZE);
+    input = fopen(job->path, "rb");
+    if (block != NULL && input != NULL && fseek(input, job->start, SEEK_SET) == 0) {
+        job->ok = TRUE;
+        while (position < job->end) {
+            want = (job->end - position < INPUT_BLOCK_SIZE) ? (size_t)(job->end - position) : INPUT_BLOCK_SIZE;
+            filled = fread(block, 1, want, input);
+            if (filled == 0) {
+                job->ok = FALSE;
+                break;
+            }
+            chunkSummarize(block, filled, &part);
+            chunkCompose(&job->summary, &part, &job->summary);
+            position += (long)filled;
+        }
+    }
+
+    if (input != NULL) {
+        fclose(input);
+    }
+    free(block);
+}
+
+#ifdef VALIDATOR_THREADS
+static void *parallelThread(void *arg)
+{
+    summarizeFileRange((ParallelJob *)arg);
+    return NULL;
+}
+#endif
+
+/*
+ * Режим --parallel <файл> [потоков]: весь файл - одно выражение.
+ * Файл делится на равные участки, каждый сводится независимо, затем
+ * сводки объединяются слева направо (объединение ассоциативно, так что
+ * порядок участков важен, а порядок их обработки - нет). С
+ * -DVALIDATOR_THREADS участки обрабатываются потоками POSIX.
+ */
+static int runParallel(const char *path, int workers)
+{
+    ParallelJob jobs[PARALLEL_MAX];
+#ifdef VALIDATOR_THREADS
+    pthread_t threads[PARALLEL_MAX];
+    int started[PARALLEL_MAX];
+#endif
+    ChunkSummary total;
+    FILE *input;
+    long size;
+    int k;
+    int ok = TRUE;
+
+    input = fopen(path, "rb");
+    if (input == NULL) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return 1;
+    }
+    if (fseek(input, 0, SEEK_END) != 0 || (size = ftell(input)) < 0) {
+        fclose(input);
+        return 1;
+    }
+    fclose(input);
+
+    for (k = 0; k < workers; k++) {
+        jobs[k].path = path;
+        jobs[k].start = size / workers * k;
+        jobs[k].end = (k == workers - 1) ? size : size / workers * (k + 1);
+    }
+
+#ifdef VALIDATOR_THREADS
+    for (k = 0; k < workers; k++) {
+        started[k] = (pthread_create(&threads[k], NULL, parallelThread, &jobs[k]) == 0);
+        if (!started[k]) {
+            summarizeFileRange(&jobs[k]);
+        }
+    }
+    for (k = 0; k < workers; k++) {
+        if (started[k]) {
+            pthread_join(threads[k], NULL);
+        }
+    }
+#else
+    for (k = 0; k < workers; k++) {
+        summarizeFileRange(&jobs[k]);
+    }
+#endif
+
+    chunkSummaryEmpty(&total);
+    for (k = 0; k < workers; k++) {
+        ok = ok && jobs[k].ok;
+        chunkCompose(&total, &jobs[k].summary, &total);
+    }
+    if (!ok) {
+        fprintf(stderr, "read error: %s\n", path);
+        return 1;
+    }
+
+    if (chunkSummaryAccepts(&total)) {
+        printf("correct\n");
+    } else {
+        printf("incorrect\n");
+    }
+    return 0;
+}
+
+#ifdef VALIDATOR_THREADS
+
+/* Состояния ячейки кольца блоков в --threads */
+#define SLOT_EMPTY        0  /* Свободна: ее заполняет читающий поток */
+#define SLOT_FILLED       1  /* Блок строк ждет проверки */
+#define SLOT_DONE         2  /* Вердикты готовы к выводу */
+
+/* Блок целых строк и его вердикты */
+typedef struct {
+    int state;
+    char *data;
+    size_t length;
+    size_t capacity;
+    char *verdicts;
+    size_t verdict_length;
+    size_t verdict_capacity;
+} BatchSlot;
+
+/*
+ * Кольцо блоков. Блок с номером n лежит в ячейке n % size. Читающий
+ * поток заполняет блоки по порядку, рабочие разбирают их по номеру
+ * next_claim, а вывод идет строго по номерам - кольцо служит и буфером
+ * переупорядочения: быстрый блок ждет в ячейке, пока не выведены
+ * предыдущие. В C89 нет атомарных операций, поэтому счетчики защищены
+ * одним мьютексом; он берется раз на блок в мегабайт, а не на строку.
+ */
+typedef struct {
+    BatchSlot slots[2 * PARALLEL_MAX];
+    unsigned long size;          /* Ячеек в кольце */
+    unsigned long next_read;     /* Номер следующего заполняемого блока */
+    unsigned long next_claim;    /* Номер следующего блока для проверки */
+    int finished;                /* Входные данные кончились */
+    int failed;                  /* Рабочему потоку не хватило памяти */
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} BatchRing;
+
+/* Пишет вердикты всех строк блока; FALSE при нехватке памяти. */
+static int validateBlock(BatchSlot *slot)
+{
+    ValidatorState validator;
+    const char *line = slot->data;
+    const char *end = slot->data + slot->length;
+    const char *newline;
+    char *grown;
+    int valid;
+
+    slot->verdict_length = 0;
+    while (line < end) {
+        newline = (const char *)memchr(line, '\n', (size_t)(end - line));
+        if (newline == NULL) {
+            newline = end;   /* Последняя строка файла без '\n' */
+        }
+        validatorInit(&validator);
+        validatorFeed(&validator, line, (size_t)(newline - line));
+        valid = validatorAccepts(&validator);
+
+        if (slot->verdict_length + 10 > slot->verdict_capacity) {
+            grown = (char *)realloc(slot->verdicts, slot->verdict_capacity * 2 + 4096);
+            if (grown == NULL) {
+                return FALSE;
+            }
+            slot->verdicts = grown;
+            slot->verdict_capacity = slot->verdict_capacity * 2 + 4096;
+        }
+        memcpy(slot->verdicts + slot->verdict_length, valid ? "correct\n" : "incorrect\n", valid ? 8 : 10);
+        slot->verdict_length += valid ? 8 : 10;
+        line = newline + 1;
+    }
+    return TRUE;
+}
+
+/*
+ * Читает в ячейку следующий блок целых строк: остаток прошлого чтения
+ * (carry) и данные до последнего '\n'; хвост после него уходит в carry.
+ * Строка длиннее блока дочитывается целиком. Возвращает FALSE, если
+ * данных больше нет; *ok сбрасывается при нехватке памяти.
+ */
+static int batchFill(BatchSlot *slot, FILE *input, char *carry, size_t *carry_length, int *ok)
+{
+    const char *p;
+    char *grown;
+    size_t filled;
+
+    slot->length = 0;
+    for (;;) {
+        if (slot->capacity - slot->length < BATCH_BLOCK_SIZE + *carry_length) {
+            grown = (char *)realloc(slot->data, slot->length + 2 * BATCH_BLOCK_SIZE);
+            if (grown == NULL) {
+                *ok = FALSE;
+                return FALSE;
+            }
+            slot->data = grown;
+            slot->capacity = slot->length + 2 * BATCH_BLOCK_SIZE;
+        }
+        if (*carry_length > 0) {
+            memcpy(slot->data, carry, *carry_length);
+            slot->length = *carry_length;
+            *carry_length = 0;
+        }
+
+        filled = fread(slot->data + slot->length, 1, BATCH_BLOCK_SIZE, input);
+        if (filled == 0) {
+            return slot->length > 0;
+        }
+
+        /* Последний перевод строки среди прочитанного */
+        p = slot->data + slot->length + filled;
+        while (p > slot->data + slot->length && p[-1] != '\n') {
+            p--;
+        }
+        if (p > slot->data + slot->length) {
+            *carry_length = (size_t)(slot->data + slot->length + filled - p);
+            memcpy(carry, p, *carry_length);
+            slot->length = (size_t)(p - slot->data);
+            return TRUE;
+        }
+        slot->length += filled;
+    }
+}
+
+/* Рабочий поток --threads: берет блоки по номеру, пока чтение не кончится */
+static void *batchThread(void *arg)
+{
+    BatchRing *ring = (BatchRing *)arg;
+    BatchSlot *slot;
+    int ok;
+
+    pthread_mutex_lock(&ring->lock);
+    for (;;) {
+        if (ring->next_claim < ring->next_read) {
+            slot = &ring->slots[ring->next_claim++ % ring->size];
+            pthread_mutex_unlock(&ring->lock);
+            ok = validateBlock(slot);
+            pthread_mutex_lock(&ring->lock);
+            if (!ok) {
+                ring->failed = TRUE;
+            }
+            slot->state = SLOT_DONE;
+            pthread_cond_broadcast(&ring->changed);
+        } else if (ring->finished) {
+            break;
+        } else {
+            pthread_cond_wait(&ring->changed, &ring->lock);
+        }
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return NULL;
+}
+
+/*
+ * Режим --threads <потоков> [файл] (без -DVALIDATOR_THREADS вместо
+ * него выполняется --batch). Главный поток и читает, и выводит:
+ * готовый по порядку блок выводится сразу, иначе, если в кольце есть
+ * свободная ячейка, читается следующий блок; иначе поток ждет.
+ */
+static int runThreads(const char *path, int workers)
+{
+    static BatchRing ring;
+    static OutputBuffer out;
+    pthread_t threads[PARALLEL_MAX];
+    BatchSlot *slot;
+    FILE *input = stdin;
+    char *carry;
+    size_t carry_length = 0;
+    unsigned long next_write = 0;   /* Номер следующего выводимого блока */
+    unsigned long k;
+    int started = 0;
+    int reading;
+    int ok = TRUE;
+
+    if (path != NULL) {
+        input = fopen(path, "rb");
+        if (input == NULL) {
+            fprintf(stderr, "cannot open %s\n", path);
+            return 1;
+        }
+    }
+    carry = (char *)malloc(BATCH_BLOCK_SIZE);
+    outputInit(&out, stdout);
+
+    memset(ring.slots, 0, sizeof(ring.slots));
+    ring.size = 2 * (unsigned long)workers;
+    ring.next_read = 0;
+    ring.next_claim = 0;
+    ring.finished = FALSE;
+    ring.failed = FALSE;
+    pthread_mutex_init(&ring.lock, NULL);
+    pthread_cond_init(&ring.changed, NULL);
+    while (carry != NULL && started < workers &&
+           pthread_create(&threads[started], NULL, batchThread, &ring) == 0) {
+        started++;
+    }
+
+    if (started == 0) {
+        /* Потоков нет - обычная последовательная проверка */
+        ok = (carry != NULL) && validateLines(input, &out, FALSE, NULL);
+    }
+
+    while (started > 0) {
+        pthread_mutex_lock(&ring.lock);
+        for (;;) {
+            slot = &ring.slots[next_write % ring.size];
+            if (next_write < ring.next_read && slot->state == SLOT_DONE) {
+                reading = FALSE;
+                break;
+            }
+            if (!ring.finished && ring.next_read - next_write < ring.size) {
+                slot = &ring.slots[ring.next_read % ring.size];
+                reading = TRUE;
+                break;
+            }
+            if (ring.finished && next_write == ring.next_read) {
+                slot = NULL;
+                break;
+            }
+            pthread_cond_wait(&ring.changed, &ring.lock);
+        }
+        pthread_mutex_unlock(&ring.lock);
+
+        if (slot == NULL) {
+            break;
+        }
+        if (!reading) {
+            outputWrite(&out, slot->verdicts, slot->verdict_length);
+            slot->state = SLOT_EMPTY;   /* Рабочие смотрят только на номера блоков */
+            next_write++;
+            continue;
+        }
+
+        reading = batchFill(slot, input, carry, &carry_length, &ok);
+        pthread_mutex_lock(&ring.lock);
+        if (reading) {
+            slot->state = SLOT_FILLED;
+            ring.next_read++;
+        } else {
+            ring.finished = TRUE;
+        }
+        pthread_cond_broadcast(&ring.changed);
+        pthread_mutex_unlock(&ring.lock);
+    }
+
+    for (k = 0; k < (unsigned long)started; k++) {
+        pthread_join(threads[k], NULL);
+    }
+    pthread_mutex_destroy(&ring.lock);
+    pthread_cond_destroy(&ring.changed);
+
+    ok = ok && !ring.failed && !ferror(input);
+    ok = outputFlush(&out) && ok;
+    for (k = 0; k < ring.size; k++) {
+        free(ring.slots[k].data);
+        free(ring.slots[k].verdicts);
+    }
+    free(carry);
+    if (path != NULL) {
+        fclose(input);
+    }
+    return ok ? 0 : 1;
+}
+
+#endif
+
+/* Линейный конгруэнтный генератор: одинаковая последовательность на любой платформе */
+static unsigned long randomNext(unsigned long *seed)
+{
+    *seed = (*seed * 1103515245UL + 12345UL) & 0xFFFFFFFFUL;
+    return *seed >> 8;
+}
+
+/* Случайное число из [0, bound), bound не больше 2^24 */
+static size_t randomBelow(unsigned long *seed, size_t bound)
+{
+    return (size_t)(randomNext(seed) % bound);
+}
+
+/*
+ * Пишет в out случайное корректное выражение длиной около target байт
+ * (не больше target + FUZZ_SLACK) и возвращает его длину. Порождение
+ * идет по той же грамматике: операнд - число, переменная, унарный знак
+ * перед операндом или выражение в скобках; между лексемами иногда
+ * стоят пробелы. После target байт новые скобки не открываются, а
+ * открытые закрываются.
+ */
+static size_t generateExpression(unsigned long *seed, char *out, size_t target)
+{
+    static const char operators[] = "+-*/%";
+    size_t length = 0;
+    size_t depth = 0;
+    size_t digits;
+    size_t choice;
+    int expect_operand = TRUE;
+
+    for (;;) {
+        if (randomBelow(seed, 4) == 0) {
+            out[length++] = ' ';
+        }
+        if (expect_operand) {
+            choice = randomBelow(seed, 8);
+            if (choice == 0 && length < target) {
+                out[length++] = operators[randomBelow(seed, 2)];
+            } else if (choice == 1 && length < target && depth < FUZZ_MAX_DEPTH) {
+                out[length++] = '(';
+                depth++;
+            } else if (choice < 5) {
+                for (digits = randomBelow(seed, 3) + 1; digits > 0; digits--) {
+                    out[length++] = (char)('0' + randomBelow(seed, 10));
+                }
+                expect_operand = FALSE;
+            } else {
+                out[length++] = (char)('a' + randomBelow(seed, VARIABLE_COUNT));
+                expect_operand = FALSE;
+            }
+        } else if (length >= target || (depth > 0 && randomBelow(seed, 4) == 0)) {
+            if (depth == 0) {
+                break;
+            }
+            out[length++] = ')';
+            depth--;
+        } else {
+            out[length++] = operators[randomBelow(seed, 5)];
+            expect_operand = TRUE;
+        }
+    }
+    return length;
+}
+
+/* Позиция первого с start (по кругу) байта из set; length - такого нет */
+static size_t findAny(const char *text, size_t length, size_t start, const char *set)
+{
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        if (strchr(set, text[(start + i) % length]) != NULL) {
+            return (start + i) % length;
+        }
+    }
+    return length;
+}
+
+/*
+ * Портит выражение "почти правильной" ошибкой: выброшенная скобка,
+ * удвоенный оператор, буква сразу за цифрой ("7a"), скобки без
+ * оператора между ними ("(a+b)(c-d)") или случайный печатный байт.
+ * Длина растет не больше чем на 5. Результат не обязательно
+ * некорректен ("1++2" допустимо) - вердикт все равно сверяется с
+ * эталоном.
+ */
+static size_t mutateExpression(unsigned long *seed, char *text, size_t length)
+{
+    const char *insert = NULL;
+    char symbol[2];
+    size_t at = length;
+
+    if (length == 0) {
+        return 0;
+    }
+    switch (randomBelow(seed, 5)) {
+    case 0:
+        at = findAny(text, length, randomBelow(seed, length), "()");
+        if (at < length) {
+            memmove(text + at, text + at + 1, length - at - 1);
+            return length - 1;
+        }
+        break;
+    case 1:
+        at = findAny(text, length, randomBelow(seed, length), "+-*/%");
+        if (at < length) {
+            symbol[0] = text[at];
+            insert = symbol;
+            at++;
+        }
+        break;
+    case 2:
+        at = findAny(text, length, randomBelow(seed, length), "0123456789");
+        if (at < length) {
+            symbol[0] = (char)('a' + randomBelow(seed, VARIABLE_COUNT));
+            insert = symbol;
+            at++;
+        }
+        break;
+    case 3:
+        at = findAny(text, length, randomBelow(seed, length), ")abcdefghijklmnopqrstuvwxyz");
+        if (at < length) {
+            insert = "(c-d)";
+            at++;
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (insert == NULL) {
+        text[randomBelow(seed, length)] = (char)(' ' + randomBelow(seed, 95));
+        return length;
+    }
+    symbol[1] = '\0';
+    memmove(text + at + strlen(insert), text + at, length - at);
+    memcpy(text + at, insert, strlen(insert));
+    return length + strlen(insert);
+}
+
+/* Рабочая память движков, общая для всех случаев --fuzz */
+typedef struct {
+    ExprArena arena;
+    ExtendedValidator extended;
+    VerdictCache cache;
+    IncrementalText text;
+    RpnConverter rpn;
+    Bytecode program;
+    ExprValue variables[VARIABLE_COUNT];
+    ExprValue stack[FUZZ_MAX_LENGTH + FUZZ_SLACK + 8];
+    unsigned long mismatches;
+} FuzzContext;
+
+/*
+ * Вычисляет запись из rpnFinish при значениях variables с той же
+ * семантикой, что у байт-кода. stack - не меньше числа лексем.
+ */
+static ExprValue rpnEvaluate(const char *text, size_t length, const ExprValue *variables,
+                             ExprValue *stack)
+{
+    size_t count = 0;
+    size_t i = 0;
+    unsigned int value;
+
+    while (i < length) {
+        if (text[i] == ' ') {
+            i++;
+        } else if (text[i] == 'u' && i + 1 < length && (text[i + 1] == '-' || text[i + 1] == '+')) {
+            if (text[i + 1] == '-') {
+                stack[count - 1] = (ExprValue)(0U - (unsigned int)stack[count - 1]);
+            }
+            i += 2;
+        } else if (text[i] >= 'a' && text[i] <= 'z') {
+            stack[count++] = variables[text[i] - 'a'];
+            i++;
+        } else if (text[i] >= '0' && text[i] <= '9') {
+            value = 0;
+            while (i < length && text[i] >= '0' && text[i] <= '9') {
+                value = value * 10U + (unsigned int)(text[i] - '0');
+                i++;
+            }
+            stack[count++] = (ExprValue)value;
+        } else {
+            count--;
+            stack[count - 1] = evalBinary(text[i] == '+' ? OP_ADD : text[i] == '-' ? OP_SUB :
+                                          text[i] == '*' ? OP_MUL : text[i] == '/' ? OP_DIV : OP_MOD,
+                                          stack[count - 1], stack[count]);
+            i++;
+        }
+    }
+    return stack[0];
+}
+
+/* Учитывает и печатает расхождение движка engine с эталоном */
+static void fuzzCheck(FuzzContext *context, const char *engine, int verdict, int expected,
+                      const char *text, size_t length)
+{
+    if ((verdict != 0) != (expected != 0)) {
+        context->mismatches++;
+        fprintf(stderr, "%s %s \"%.*s\"\n", engine, verdict ? "accepts" : "rejects",
+                (int)length, text);
+    }
+}
+
+/*
+ * Проверяет text (завершен нулем) всеми движками и сверяет вердикты с
+ * isValidExpressionReference. Потоковые движки получают текст частями
+ * случайной длины, чтобы проверить и стыки частей. Возвращает вердикт
+ * эталона.
+ */
+static int fuzzCase(FuzzContext *context, unsigned long *seed, const char *text, size_t length)
+{
+    ValidatorState validator;
+    ChunkSummary total;
+    ChunkSummary piece;
+    ValidationError error;
+    size_t position;
+    size_t part;
+    ExprValue value;
+    long root;
+    int parsed;
+    int converted;
+    int expected;
+
+    expected = isValidExpressionReference(text);
+    fuzzCheck(context, "isValidExpression", isValidExpression(text), expected, text, length);
+
+    validatorInit(&validator);
+    validatorFeedScalar(&validator, text, length);
+    fuzzCheck(context, "scalar", validatorAccepts(&validator), expected, text, length);
+
+    validatorInit(&validator);
+    chunkSummaryEmpty(&total);
+    for (position = 0; position < length; position += part) {
+        part = randomBelow(seed, 2 * VECTOR_BLOCK + 8);
+        if (part > length - position) {
+            part = length - position;
+        }
+        validatorFeed(&validator, text + position, part);
+        chunkSummarize(text + position, part, &piece);
+        chunkCompose(&total, &piece, &total);
+    }
+    fuzzCheck(context, "chunked", validatorAccepts(&validator), expected, text, length);
+    fuzzCheck(context, "summary", chunkSummaryAccepts(&total), expected, text, length);
+
+    fuzzCheck(context, "diagnose", diagnoseExpression(text, length, &error), expected, text, length);
+
+    arenaReset(&context->arena);
+    parsed = (parseExpression(text, length, &context->arena, &root) == PARSE_OK);
+    fuzzCheck(context, "parse", parsed, expected, text, length);
+
+    rpnReset(&context->rpn);
+    for (position = 0; position < length; position += part) {
+        part = randomBelow(seed, 16);
+        if (part > length - position) {
+            part = length - position;
+        }
+        rpnFeed(&context->rpn, text + position, part);
+    }
+    converted = rpnFinish(&context->rpn);
+    fuzzCheck(context, "rpn", converted, expected, text, length);
+
+    /* Запись RPN должна вычисляться так же, как байт-код из дерева */
+    if (parsed && converted && compileExpression(&context->arena, root, &context->program)) {
+        for (part = 0; part < VARIABLE_COUNT; part++) {
+            context->variables[part] = (ExprValue)randomNext(seed) - 0x800000;
+        }
+        value = rpnEvaluate(context->rpn.output, context->rpn.length, context->variables,
+                            context->stack);
+        if (value != bytecodeEval(&context->program, context->variables, context->stack)) {
+            context->mismatches++;
+            fprintf(stderr, "rpn value %ld differs for \"%.*s\"\n", (long)value, (int)length, text);
+        }
+    }
+
+    fuzzCheck(context, "cache", cacheValidate(&context->cache, text, length), expected, text, length);
+
+    /* Текст собирается вставками в случайные места, затем часть вырезается и вставляется обратно */
+    incrementalEdit(&context->text, 0, context->text.length, text, 0);
+    for (position = 0; position < length; position += part) {
+        part = randomBelow(seed, 3 * LEAF_CAPACITY / 2) + 1;
+        if (part > length - position) {
+            part = length - position;
+        }
+        incrementalEdit(&context->text, position, 0, text + position, part);
+    }
+    position = randomBelow(seed, length + 1);
+    part = randomBelow(seed, length - position + 1);
+    incrementalEdit(&context->text, position, part, NULL, 0);
+    incrementalEdit(&context->text, position, 0, text + position, part);
+    fuzzCheck(context, "incremental", incrementalAccepts(&context->text), expected, text, length);
+
+    /* Расширенная грамматика шире исходной: корректное выражение должно приниматься */
+    if (expected) {
+        extendedReset(&context->extended);
+        extendedFeed(&context->extended, text, length);
+        fuzzCheck(context, "extended", extendedAccepts(&context->extended), TRUE, text, length);
+    }
+    return expected;
+}
+
+/*
+ * Режим --fuzz <зерно> <число>: четные случаи - корректные выражения
+ * генератора, нечетные - их порчи. Печатает сводку; код возврата 1,
+ * если хоть один движок разошелся с эталоном.
+ */
+static int runFuzz(unsigned long seed, unsigned long count)
+{
+    static char text[FUZZ_MAX_LENGTH + FUZZ_SLACK + 8];
+    FuzzContext context;
+    unsigned long valid = 0;
+    unsigned long i;
+    size_t length;
+
+    arenaInit(&context.arena);
+    extendedInit(&context.extended);
+    incrementalInit(&context.text);
+    rpnInit(&context.rpn);
+    bytecodeInit(&context.program);
+    context.mismatches = 0;
+    if (!cacheInit(&context.cache)) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    for (i = 0; i < count; i++) {
+        length = generateExpression(&seed, text, randomBelow(&seed, FUZZ_MAX_LENGTH) + 1);
+        if (i % 2 == 1) {
+            length = mutateExpression(&seed, text, length);
+        }
+        text[length] = '\0';
+        if (fuzzCase(&context, &seed, text, length)) {
+            valid++;
+        }
+    }
+    printf("%lu cases, %lu valid, %lu mismatches\n", count, valid, context.mismatches);
+
+    arenaFree(&context.arena);
+    extendedFree(&context.extended);
+    incrementalFree(&context.text);
+    rpnFree(&context.rpn);
+    bytecodeFree(&context.program);
+    cacheFree(&context.cache);
+    return context.mismatches == 0 ? 0 : 1;
+}
+
+/* Один прогон движка engine (номер из bench_engines) над выражением */
+static int benchEngine(int engine, const char *text, size_t length, ExtendedValidator *extended)
+{
+    ValidatorState validator;
+    ChunkSummary summary;
+
+    switch (engine) {
+    case 0:
+        return isValidExpressionReference(text);
+    case 1:
+        validatorInit(&validator);
+        validatorFeedScalar(&validator, text, length);
+        return validatorAccepts(&validator);
+    case 2:
+        validatorInit(&validator);
+        validatorFeed(&validator, text, length);
+        return validatorAccepts(&validator);
+    case 3:
+        chunkSummarize(text, length, &summary);
+        return chunkSummaryAccepts(&summary);
+    default:
+        extendedReset(extended);
+        extendedFeed(extended, text, length);
+        return extendedAccepts(extended);
+    }
+}
+
+/*
+ * Режим --bench: для длин 10, 100, ..., 10^8 байт строится корректное
+ * выражение, и каждый движок проверяет его повторно, пока не наберет
+ * BENCH_BUDGET байт (не меньше одного раза). Время - по clock().
+ */
+static int runBench(void)
+{
+    static const char *const bench_engines[BENCH_ENGINES] = {
+        "reference", "scalar", "feed", "summary", "extended"
+    };
+    ExtendedValidator extended;
+    unsigned long seed = 1;
+    unsigned long repeats;
+    unsigned long accepted;
+    unsigned long k;
+    size_t target;
+    size_t length;
+    double seconds;
+    clock_t start;
+    char *text;
+    int engine;
+
+    text = (char *)malloc(BENCH_MAX_LENGTH + FUZZ_SLACK + 1);
+    if (text == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    extendedInit(&extended);
+
+    printf("%10s  %-10s %14s %10s\n", "length", "engine", "expr/s", "MB/s");
+    for (target = 10; target <= BENCH_MAX_LENGTH; target *= 10) {
+        length = generateExpression(&seed, text, target);
+        text[length] = '\0';
+        repeats = (unsigned long)(BENCH_BUDGET / length) + 1;
+
+        for (engine = 0; engine < BENCH_ENGINES; engine++) {
+            accepted = 0;
+            start = clock();
+            for (k = 0; k < repeats; k++) {
+                accepted += (unsigned long)benchEngine(engine, text, length, &extended);
+            }
+            seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+            if (seconds <= 0.0) {
+                seconds = 1.0 / CLOCKS_PER_SEC;
+            }
+            printf("%10lu  %-10s %14.0f %10.1f%s\n", (unsigned long)length, bench_engines[engine],
+                   repeats / seconds, (double)length * repeats / seconds / 1e6,
+                   accepted == repeats ? "" : "  MISMATCH");
+        }
+    }
+
+    extendedFree(&extended);
+    free(text);
+    return 0;
+}
+
+/* Разбор аргументов командной строки для дополнительных режимов */
+static int runCommand(int argc, char *argv[])
+{
+    int workers;
+
+    if (strcmp(argv[1], "--batch") == 0 && argc <= 3) {
+        return runBatch(argc == 3 ? argv[2] : NULL, FALSE, FALSE);
+    }
+    if (strcmp(argv[1], "--extended") == 0 && argc <= 3) {
+        return runBatch(argc == 3 ? argv[2] : NULL, TRUE, FALSE);
+    }
+    if (strcmp(argv[1], "--cache") == 0 && argc <= 3) {
+        return runBatch(argc == 3 ? argv[2] : NULL, FALSE, TRUE);
+    }
+    if (strcmp(argv[1], "--explain") == 0 && argc <= 3) {
+        return runExplain(argc == 3 ? argv[2] : NULL);
+    }
+    if (strcmp(argv[1], "--ast") == 0 && argc <= 3) {
+        return runAst(argc == 3 ? argv[2] : NULL);
+    }
+    if (strcmp(argv[1], "--rpn") == 0 && argc <= 3) {
+        return runRpn(argc == 3 ? argv[2] : NULL);
+    }
+    if (strcmp(argv[1], "--eval") == 0 && (argc == 3 || argc == 4)) {
+        return runEval(argv[2], argc == 4 ? argv[3] : NULL);
+    }
+    if (strcmp(argv[1], "--columns") == 0 && argc == 4) {
+        return runColumns(argv[2], argv[3]);
+    }
+    if (strcmp(argv[1], "--incremental") == 0 && argc == 3) {
+        return runIncremental(argv[2]);
+    }
+    if (strcmp(argv[1], "--threads") == 0 && (argc == 3 || argc == 4)) {
+        workers = atoi(argv[2]);
+        if (workers >= 1 && workers <= PARALLEL_MAX) {
+#ifdef VALIDATOR_THREADS
+            return runThreads(argc == 4 ? argv[3] : NULL, workers);
+#else
+            return runBatch(argc == 4 ? argv[3] : NULL, FALSE, FALSE);
+#endif
+        }
+    }
+    if (strcmp(argv[1], "--fuzz") == 0 && argc == 4) {
+        return runFuzz(strtoul(argv[2], NULL, 10), strtoul(argv[3], NULL, 10));
+    }
+    if (strcmp(argv[1], "--bench") == 0 && argc == 2) {
+        return runBench();
+    }
+    if (strcmp(argv[1], "--parallel") == 0 && (argc == 3 || argc == 4)) {
+        workers = (argc == 4) ? atoi(argv[3]) : PARALLEL_WORKERS;
+        if (workers >= 1 && workers <= PARALLEL_MAX) {
+            return runParallel(argv[2], workers);
+        }
+    }
+
+    fprintf(stderr, "usage: %s [--batch [file]]\n"
+                    "       %s --extended [file]\n"
+                    "       %s --cache [file]\n"
+                    "       %s --explain [file]\n"
+                    "       %s --ast [file]\n"
+                    "       %s --rpn [file]\n"
+                    "       %s --eval <expression> [bindings file]\n"
+                    "       %s --columns <expression> <file>\n"
+                    "       %s --incremental <script>\n"
+                    "       %s --threads <workers> [file]\n"
+                    "       %s --fuzz <seed> <count>\n"
+                    "       %s --bench\n"
+                    "       %s --parallel <file> [workers]\n",
+            argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0],
+            argv[0], argv[0], argv[0], argv[0]);
+    return 2;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1) {
+        return runCommand(argc, argv);
+    }
+
+    /*
+     * Проверяется первая строка stdin без ограничения длины.
+     * Пустой ввод (сразу конец файла) - некорректное выражение:
+     * автомат остается в состоянии ожидания операнда.
+     */
+    if (validateFirstLine(stdin)) {
+        printf("correct\n");
+    } else {
+        printf("incorrect\n");
+    }
+
+    return 0;
+}
+
+/* --- Реализация функций --- */
+
+/* Сокращения классов для таблицы ниже */
+#define CS CLASS_SPACE
+#define CD CLASS_DIGIT
+#define CL CLASS_LETTER
+#define CO CLASS_OPEN
+#define CC CLASS_CLOSE
+#define CP CLASS_SIGN
+#define CM CLASS_MULOP
+#define CX CLASS_OTHER
+
+/* Класс каждого байта */
+static const unsigned char byte_class[256] = {
+    CX, CX, CX, CX, CX, CX, CX, CX, CX, CS, CS, CS, CS, CS, CX, CX,
+    CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX,
+    CS, CX, CX, CX, CX, CM, CX, CX, CO, CC, CM, CP, CX, CP, CX, CM,
+    CD, CD, CD, CD, CD, CD, CD, CD, CD, CD, CX, CX, CX, CX, CX, CX,
+    CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX,
+    CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX,
+    CX, CL, CL, CL, CL, CL, CL, CL, CL, CL, CL, CL, CL, CL, CL, CL,
+    CL, CL, CL, CL, CL, CL, CL, CL, CL, CL, CL, CX, CX, CX, CX, CX,
+    CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX,
+    CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX,
+    CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX,
+    CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX,
+    CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX,
+    CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX,
+    CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX,
+    CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX, CX
+};
+
+#undef CS
+#undef CD
+#undef CL
+#undef CO
+#undef CC
+#undef CP
+#undef CM
+#undef CX
+
+/*
+ * Переходы [состояние][класс]. Строки повторяют ветви исходного
+ * анализатора: в DFA_OPERAND допустимы число, переменная, '(' и унарный
+ * знак; в DFA_OPERATOR - бинарный оператор и ')'. DFA_NUMBER отличается
+ * от DFA_OPERATOR только тем, что цифра продолжает число.
+ */
+static const unsigned char dfa_transition[DFA_STATES][CLASS_COUNT] = {
+    /* DFA_OPERAND */
+    { DFA_STEP(DFA_OPERAND, 0),  DFA_STEP(DFA_NUMBER, 0),   DFA_STEP(DFA_OPERATOR, 0),
+      DFA_STEP(DFA_OPERAND, 1),  DFA_STEP(DFA_ERROR, 0),    DFA_STEP(DFA_OPERAND, 0),
+      DFA_STEP(DFA_ERROR, 0),    DFA_STEP(DFA_ERROR, 0) },
+    /* DFA_OPERATOR */
+    { DFA_STEP(DFA_OPERATOR, 0), DFA_STEP(DFA_ERROR, 0),    DFA_STEP(DFA_ERROR, 0),
+      DFA_STEP(DFA_ERROR, 0),    DFA_STEP(DFA_OPERATOR, -1), DFA_STEP(DFA_OPERAND, 0),
+      DFA_STEP(DFA_OPERAND, 0),  DFA_STEP(DFA_ERROR, 0) },
+    /* DFA_NUMBER */
+    { DFA_STEP(DFA_OPERATOR, 0), DFA_STEP(DFA_NUMBER, 0),   DFA_STEP(DFA_ERROR, 0),
+      DFA_STEP(DFA_ERROR, 0),    DFA_STEP(DFA_OPERATOR, -1), DFA_STEP(DFA_OPERAND, 0),
+      DFA_STEP(DFA_OPERAND, 0),  DFA_STEP(DFA_ERROR, 0) },
+    /* DFA_ERROR */
+    { DFA_STEP(DFA_ERROR, 0),    DFA_STEP(DFA_ERROR, 0),    DFA_STEP(DFA_ERROR, 0),
+      DFA_STEP(DFA_ERROR, 0),    DFA_STEP(DFA_ERROR, 0),    DFA_STEP(DFA_ERROR, 0),
+      DFA_STEP(DFA_ERROR, 0),    DFA_STEP(DFA_ERROR, 0) }
+};
+
+void validatorInit(ValidatorState *validator)
+{
+    validator->state = DFA_OPERAND;
+    validator->balance = 0;
+    validator->lowest = 0;
+}
+
+/*
+ * Табличная проверка: на байт - загрузка класса и загрузка перехода,
+ * без вызовов функций. Ошибка состояния поглощающая, поэтому уход
+ * баланса в минус не прерывает цикл, а только запоминается в lowest.
+ */
+void validatorFeedScalar(ValidatorState *validator, const char *data, size_t length)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + length;
+    unsigned int state = validator->state;
+    unsigned int step;
+    long balance = validator->balance;
+    long lowest = validator->lowest;
+
+    for (; p < end && state != DFA_ERROR; p++) {
+        step = dfa_transition[state][byte_class[*p]];
+        state = step & 3;
+        balance += (long)(step >> 2) - 1;
+        if (balance < lowest) {
+            lowest = balance;
+        }
+    }
+
+    validator->state = state;
+    validator->balance = balance;
+    validator->lowest = lowest;
+}
+
+#ifdef __SSE2__
+
+#define MASK32 0xFFFFFFFFUL
+
+/* Маска байтов v из диапазона [low, high] (0 < low, high < 0x7F) */
+static __m128i vectorRange(__m128i v, int low, int high)
+{
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8((char)(low - 1))),
+                         _mm_cmplt_epi8(v, _mm_set1_epi8((char)(high + 1))));
+}
+
+/* Маска байтов v, равных одному из символов a, b, c */
+static __m128i vectorAny(__m128i v, int a, int b, int c)
+{
+    return _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)a)),
+                                     _mm_cmpeq_epi8(v, _mm_set1_epi8((char)b))),
+                        _mm_cmpeq_epi8(v, _mm_set1_epi8((char)c)));
+}
+
+/* Объединяет маски двух половин блока в 32-битную */
+static unsigned long vectorMask(__m128i low, __m128i high)
+{
+    return (unsigned long)(unsigned int)_mm_movemask_epi8(low) |
+           ((unsigned long)(unsigned int)_mm_movemask_epi8(high) << 16);
+}
+
+/*
+ * Префиксные суммы изменений баланса по 16 байтам: open и close - маски
+ * сравнения (0xFF в байтах '(' и ')'). Возвращает наименьшую префиксную
+ * сумму, а в *total - сумму по всем 16 байтам.
+ */
+static long vectorBalance(__m128i open, __m128i close, long *total)
+{
+    __m128i sums = _mm_sub_epi8(close, open);   /* '(' = +1, ')' = -1 */
+    __m128i low;
+
+    sums = _mm_add_epi8(sums, _mm_slli_si128(sums, 1));
+    sums = _mm_add_epi8(sums, _mm_slli_si128(sums, 2));
+    sums = _mm_add_epi8(sums, _mm_slli_si128(sums, 4));
+    sums = _mm_add_epi8(sums, _mm_slli_si128(sums, 8));
+
+    /* Суммы лежат в [-16, 16]: сдвиг на 16 позволяет брать беззнаковый минимум */
+    low = _mm_add_epi8(sums, _mm_set1_epi8(16));
+    low = _mm_min_epu8(low, _mm_srli_si128(low, 8));
+    low = _mm_min_epu8(low, _mm_srli_si128(low, 4));
+    low = _mm_min_epu8(low, _mm_srli_si128(low, 2));
+    low = _mm_min_epu8(low, _mm_srli_si128(low, 1));
+
+    *total = (long)(signed char)(_mm_cvtsi128_si32(_mm_srli_si128(sums, 15)) & 0xFF);
+    return (long)(_mm_cvtsi128_si32(low) & 0xFF) - 16;
+}
+
+/*
+ * Векторная проверка по VECTOR_BLOCK байт (в духе первой стадии simdjson).
+ *
+ * Если выбросить пробелы и цифры, продолжающие число, остается
+ * последовательность значимых лексем, и состояние перед каждой из них
+ * определяется одной предыдущей значимой лексемой: после числа,
+ * переменной и ')' ожидается оператор, после '(' и операторов - операнд.
+ * Поэтому блок проверяется без посимвольного цикла:
+ * 1. маски классов получаются сравнениями SSE2;
+ * 2. маска "после байта ожидается оператор" протягивается от значимых
+ *    байтов через незначимые удвоением сдвига (1, 2, 4, 8, 16);
+ * 3. операнд и '(' недопустимы там, где ожидается оператор, а '*', '/',
+ *    '%' и ')' - там, где ожидается операнд; знак допустим везде;
+ * 4. баланс скобок - префиксные суммы с минимумом.
+ * Возвращает число обработанных байт; хвост короче блока и состояние
+ * ошибки остаются побайтовому автомату.
+ */
+static size_t validatorFeedVector(ValidatorState *validator, const char *data, size_t length)
+{
+    size_t done = 0;
+    __m128i low;
+    __m128i high;
+    __m128i open_low;
+    __m128i open_high;
+    __m128i close_low;
+    __m128i close_high;
+    unsigned long space;
+    unsigned long digit;
+    unsigned long letter;
+    unsigned long open;
+    unsigned long close;
+    unsigned long sign;
+    unsigned long mulop;
+    unsigned long number;
+    unsigned long significant;
+    unsigned long after;      /* После байта ожидается оператор */
+    unsigned long known;
+    unsigned long before;     /* Перед байтом ожидается оператор */
+    unsigned long errors;
+    unsigned long carry_operator;
+    unsigned long carry_digit;
+    int shift;
+    long min_low;
+    long min_high;
+    long total_low;
+    long total_high;
+
+    while (validator->state != DFA_ERROR && length - done >= VECTOR_BLOCK) {
+        low = _mm_loadu_si128((const __m128i *)(data + done));
+        high = _mm_loadu_si128((const __m128i *)(data + done + 16));
+
+        space = vectorMask(_mm_or_si128(_mm_cmpeq_epi8(low, _mm_set1_epi8(' ')), vectorRange(low, 9, 13)),
+                           _mm_or_si128(_mm_cmpeq_epi8(high, _mm_set1_epi8(' ')), vectorRange(high, 9, 13)));
+        digit = vectorMask(vectorRange(low, '0', '9'), vectorRange(high, '0', '9'));
+        letter = vectorMask(vectorRange(low, 'a', 'z'), vectorRange(high, 'a', 'z'));
+        open_low = _mm_cmpeq_epi8(low, _mm_set1_epi8('('));
+        open_high = _mm_cmpeq_epi8(high, _mm_set1_epi8('('));
+        close_low = _mm_cmpeq_epi8(low, _mm_set1_epi8(')'));
+        close_high = _mm_cmpeq_epi8(high, _mm_set1_epi8(')'));
+        open = vectorMask(open_low, open_high);
+        close = vectorMask(close_low, close_high);
+        sign = vectorMask(vectorAny(low, '+', '-', '-'), vectorAny(high, '+', '-', '-'));
+        mulop = vectorMask(vectorAny(low, '*', '/', '%'), vectorAny(high, '*', '/', '%'));
+
+        carry_digit = (validator->state == DFA_NUMBER) ? 1UL : 0UL;
+        carry_operator = (validator->state != DFA_OPERAND) ? 1UL : 0UL;
+
+        /* Начала чисел: цифра, перед которой нет цифры */
+        number = digit & ~((digit << 1) | carry_digit);
+        significant = number | letter | open | close | sign | mulop;
+
+        /* Протягивание состояния от значимых байтов через незначимые */
+        after = number | letter | close;
+        known = significant;
+        for (shift = 1; shift < VECTOR_BLOCK; shift <<= 1) {
+            after |= (after << shift) & ~known & MASK32;
+            known |= (known << shift) & MASK32;
+        }
+        if (carry_operator) {
+            after |= ~known & MASK32;
+        }
+
+        before = ((after << 1) | carry_operator) & MASK32;
+        errors = ((number | letter | open) & before) | ((close | mulop) & ~before);
+        errors |= ~(space | digit | significant) & MASK32;
+        if (errors != 0) {
+            validator->state = DFA_ERROR;
+            break;
+        }
+
+        if ((open | close) != 0) {
+            min_low = vectorBalance(open_low, close_low, &total_low);
+            min_high = vectorBalance(open_high, close_high, &total_high);
+            if (total_low + min_high < min_low) {
+                min_low = total_low + min_high;
+            }
+            if (validator->balance + min_low < validator->lowest) {
+                validator->lowest = validator->balance + min_low;
+            }
+            validator->balance += total_low + total_high;
+        }
+
+        /* Состояние после последнего байта блока */
+        if ((digit >> (VECTOR_BLOCK - 1)) & 1UL) {
+            validator->state = DFA_NUMBER;
+        } else if ((after >> (VECTOR_BLOCK - 1)) & 1UL) {
+            validator->state = DFA_OPERATOR;
+        } else {
+            validator->state = DFA_OPERAND;
+        }
+        done += VECTOR_BLOCK;
+    }
+    return done;
+}
+
+#endif
+
+/*
+ * С SSE2 длинные участки идут через векторную проверку, остаток - через
+ * табличный автомат; результат не зависит от того, как текст разбит на
+ * части.
+ */
+void validatorFeed(ValidatorState *validator, const char *data, size_t length)
+{
+    size_t done = 0;
+
+#ifdef __SSE2__
+    done = validatorFeedVector(validator, data, length);
+#endif
+    validatorFeedScalar(validator, data + done, length - done);
+}
+
+int validatorAccepts(const ValidatorState *validator)
+{
+    return validator->lowest >= 0 && validator->balance == 0 &&
+           (validator->state == DFA_OPERATOR || validator->state == DFA_NUMBER);
+}
+
+int isValidExpression(const char *expr)
+{
+    ValidatorState validator;
+
+    validatorInit(&validator);
+    validatorFeed(&validator, expr, strlen(expr));
+    return validatorAccepts(&validator);
+}
+
+int isValidExpressionReference(const char *expr)
+{
+    /* Объявление всех переменных в начале функции, как того требует ANSI C. */
+    int i;
+    int len;
+    char current_char;
+    int parenthesis_balance = 0; /* Счетчик для проверки баланса скобок */
+    State current_state = STATE_EXPECT_OPERAND;
+
+    len = strlen(expr);
+
+    /* Пустая строка или строка, состоящая только из пробелов, не является корректным выражением. */
+    /* Этот случай будет корректно обработан проверкой конечного состояния в конце функции. */
+
+    for (i = 0; i < len; ++i) {
+        current_char = expr[i];
+
+        if (isspace(current_char)) {
+            /* Пробельные символы игнорируются */
+            continue;
+        }
+
+        if (current_state == STATE_EXPECT_OPERAND) {
+            if (isdigit(current_char)) {
+                /* Нашли начало числа. Пропускаем все последующие цифры. */
+                while (i + 1 < len && isdigit(expr[i + 1])) {
+                    i++;
+                }
+                current_state = STATE_EXPECT_OPERATOR;
+            } else if (islower(current_char)) {
+                /* Нашли переменную */
+                current_state = STATE_EXPECT_OPERATOR;
+            } else if (current_char == '(') {
+                parenthesis_balance++;
+                /* После открывающей скобки мы снова ожидаем операнд */
+                current_state = STATE_EXPECT_OPERAND;
+            } else if (current_char == '+' || current_char == '-') {
+                /* Это унарный плюс или минус. После него все еще ожидается операнд. */
+                current_state = STATE_EXPECT_OPERAND;
+            } else {
+                /* В состоянии ожидания операнда встречен недопустимый символ */
+                return FALSE;
+            }
+        } else { /* current_state == STATE_EXPECT_OPERATOR */
+            if (strchr("+-*/%", current_char) != NULL) {
+                /* Нашли бинарный оператор. Далее ожидаем операнд. */
+                current_state = STATE_EXPECT_OPERAND;
+            } else if (current_char == ')') {
+                parenthesis_balance--;
+                /* После закрывающей скобки мы все еще ожидаем оператор, e.g. "(a+b)*c" */
+                current_state = STATE_EXPECT_OPERATOR;
+            } else {
+                /*
+                 * Ошибка: два операнда подряд без оператора.
+                 * Примеры: "7a", "(a+b)(c-d)"
+                 */
+                return FALSE;
+            }
+        }
+
+        /*
+         * Анализ безопасности: Немедленная проверка дисбаланса скобок.
+         * Если счетчик стал отрицательным, значит закрывающая скобка встретилась раньше открывающей.
+         * Это предотвращает дальнейшую обработку заведомо некорректной строки.
+         */
+        if (parenthesis_balance < 0) {
+            return FALSE;
+        }
+    }
+
+    /*
+     * Финальные проверки после прохода по всей строке:
+     * 1. Баланс скобок должен быть равен нулю.
+     * 2. Выражение не может заканчиваться на бинарный оператор (это означает, что
+     *    конечное состояние должно быть STATE_EXPECT_OPERATOR). Если оно STATE_EXPECT_OPERAND,
+     *    значит выражение оборвалось после оператора, например "a+".
+     */
+    if (parenthesis_balance == 0 && current_state == STATE_EXPECT_OPERATOR) {
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* --- Расширенная грамматика --- */
+
+/* Сокращения классов для таблицы ниже */
+#define ES EXT_SPACE
+#define ED EXT_DIGIT
+#define EA EXT_ALPHA
+#define EP EXT_DOT
+#define EO EXT_OPEN
+#define EC EXT_CLOSE
+#define EG EXT_SIGN
+#define EM EXT_MULOP
+#define EK EXT_COMMA
+#define EX EXT_OTHER
+
+/* Класс каждого байта для расширенной грамматики */
+static const unsigned char extended_class[256] = {
+    EX, EX, EX, EX, EX, EX, EX, EX, EX, ES, ES, ES, ES, ES, EX, EX,
+    EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX,
+    ES, EX, EX, EX, EX, EM, EX, EX, EO, EC, EM, EG, EK, EG, EP, EM,
+    ED, ED, ED, ED, ED, ED, ED, ED, ED, ED, EX, EX, EX, EX, EX, EX,
+    EX, EA, EA, EA, EA, EA, EA, EA, EA, EA, EA, EA, EA, EA, EA, EA,
+    EA, EA, EA, EA, EA, EA, EA, EA, EA, EA, EA, EX, EX, EX, EX, EA,
+    EX, EA, EA, EA, EA, EA, EA, EA, EA, EA, EA, EA, EA, EA, EA, EA,
+    EA, EA, EA, EA, EA, EA, EA, EA, EA, EA, EA, EX, EX, EX, EX, EX,
+    EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX,
+    EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX,
+    EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX,
+    EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX,
+    EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX,
+    EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX,
+    EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX,
+    EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX, EX
+};
+
+#undef ES
+#undef ED
+#undef EA
+#undef EP
+#undef EO
+#undef EC
+#undef EG
+#undef EM
+#undef EK
+#undef EX
+
+/* Сокращение: ошибка */
+#define EE EXT_STEP(EXT_ERROR, ACT_NONE)
+
+/* Дополнение строки до EXT_ROW элементов */
+#define EPAD EE, EE, EE, EE, EE, EE
+
+/*
+ * Переходы [состояние * EXT_ROW + класс] в порядке классов: пробел,
+ * цифра, буква, '.', '(', ')', знак, '*' '/' '%', ',', прочее. Состояния
+ * "после операнда" (EXT_OPERATOR, EXT_NUMBER, EXT_FRACTION, EXT_NAME)
+ * различаются только тем, что продолжает текущую лексему.
+ */
+static const unsigned char extended_transition[EXT_STATES * EXT_ROW] = {
+    /* EXT_OPERAND */
+    EXT_STEP(EXT_OPERAND, ACT_NONE), EXT_STEP(EXT_NUMBER, ACT_NONE), EXT_STEP(EXT_NAME, ACT_NONE),
+    EE, EXT_STEP(EXT_OPERAND, ACT_GROUP), EE,
+    EXT_STEP(EXT_OPERAND, ACT_NONE), EE, EE, EE, EPAD,
+    /* EXT_CALL */
+    EXT_STEP(EXT_CALL, ACT_NONE), EXT_STEP(EXT_NUMBER, ACT_NONE), EXT_STEP(EXT_NAME, ACT_NONE),
+    EE, EXT_STEP(EXT_OPERAND, ACT_GROUP), EXT_STEP(EXT_OPERATOR, ACT_CLOSE),
+    EXT_STEP(EXT_OPERAND, ACT_NONE), EE, EE, EE, EPAD,
+    /* EXT_OPERATOR */
+    EXT_STEP(EXT_OPERATOR, ACT_NONE), EE, EE,
+    EE, EE, EXT_STEP(EXT_OPERATOR, ACT_CLOSE),
+    EXT_STEP(EXT_OPERAND, ACT_NONE), EXT_STEP(EXT_OPERAND, ACT_NONE), EXT_STEP(EXT_OPERAND, ACT_COMMA), EE, EPAD,
+    /* EXT_NUMBER */
+    EXT_STEP(EXT_OPERATOR, ACT_NONE), EXT_STEP(EXT_NUMBER, ACT_NONE), EE,
+    EXT_STEP(EXT_POINT, ACT_NONE), EE, EXT_STEP(EXT_OPERATOR, ACT_CLOSE),
+    EXT_STEP(EXT_OPERAND, ACT_NONE), EXT_STEP(EXT_OPERAND, ACT_NONE), EXT_STEP(EXT_OPERAND, ACT_COMMA), EE, EPAD,
+    /* EXT_POINT */
+    EE, EXT_STEP(EXT_FRACTION, ACT_NONE), EE, EE, EE, EE, EE, EE, EE, EE, EPAD,
+    /* EXT_FRACTION */
+    EXT_STEP(EXT_OPERATOR, ACT_NONE), EXT_STEP(EXT_FRACTION, ACT_NONE), EE,
+    EE, EE, EXT_STEP(EXT_OPERATOR, ACT_CLOSE),
+    EXT_STEP(EXT_OPERAND, ACT_NONE), EXT_STEP(EXT_OPERAND, ACT_NONE), EXT_STEP(EXT_OPERAND, ACT_COMMA), EE, EPAD,
+    /* EXT_NAME */
+    EXT_STEP(EXT_OPERATOR, ACT_NONE), EXT_STEP(EXT_NAME, ACT_NONE), EXT_STEP(EXT_NAME, ACT_NONE),
+    EE, EXT_STEP(EXT_CALL, ACT_CALL), EXT_STEP(EXT_OPERATOR, ACT_CLOSE),
+    EXT_STEP(EXT_OPERAND, ACT_NONE), EXT_STEP(EXT_OPERAND, ACT_NONE), EXT_STEP(EXT_OPERAND, ACT_COMMA), EE, EPAD,
+    /* EXT_ERROR */
+    EE, EE, EE, EE, EE, EE, EE, EE, EE, EE, EPAD
+};
+
+#undef EPAD
+#undef EE
+
+void extendedInit(ExtendedValidator *validator)
+{
+    validator->calls = NULL;
+    validator->capacity = 0;
+    extendedReset(validator);
+}
+
+void extendedReset(ExtendedValidator *validator)
+{
+    validator->state = EXT_OPERAND;
+    validator->depth = 0;
+    validator->call_depth = 0;
+    validator->count = 0;
+    validator->failed = FALSE;
+}
+
+void extendedFree(ExtendedValidator *validator)
+{
+    free(validator->calls);
+    validator->calls = NULL;
+    validator->capacity = 0;
+}
+
+/*
+ * Особые переходы: '(' вызова, ',' и ')' на уровне текущего вызова
+ * (в том числе ')' без пары - на уровне 0, где call_depth == 0).
+ * Глубину меняет вызывающий. Возвращает строку таблицы нового
+ * состояния: row или строку ошибки.
+ */
+static unsigned int extendedSpecial(ExtendedValidator *validator, unsigned int step, unsigned int row)
+{
+    size_t *grown;
+
+    if (step & ACT_KIND_CALL) {
+        if (validator->count == validator->capacity) {
+            grown = (size_t *)realloc(validator->calls, (validator->capacity * 2 + 16) * sizeof(size_t));
+            if (grown == NULL) {
+                validator->failed = TRUE;
+                return EXT_ERROR * EXT_ROW;
+            }
+            validator->calls = grown;
+            validator->capacity = validator->capacity * 2 + 16;
+        }
+        validator->calls[validator->count++] = validator->call_depth;
+        validator->call_depth = validator->depth + 1;
+        return row;
+    }
+    if (step & ACT_COMMA) {
+        /* Запятая допустима только прямо внутри скобки вызова */
+        return (validator->call_depth != 0 && validator->depth == validator->call_depth)
+             ? row : EXT_ERROR * EXT_ROW;
+    }
+    if (validator->call_depth == 0) {
+        return EXT_ERROR * EXT_ROW;   /* ')' без пары */
+    }
+    validator->call_depth = validator->calls[--validator->count];
+    return row;
+}
+
+/*
+ * Тот же цикл, что в validatorFeedScalar: загрузка класса и перехода на
+ * байт. Обычные скобки (около десятой части байтов типичной формулы)
+ * не ветвятся: глубина меняется на push - pop из флагов перехода.
+ * Ветвь берется только на '(' вызова, на ',' и на ')' при depth ==
+ * call_depth: такая ')' закрывает вызов, а при call_depth == 0 - не
+ * имеет пары.
+ */
+void extendedFeed(ExtendedValidator *validator, const char *data, size_t length)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + length;
+    size_t row = validator->state * EXT_ROW;   /* Строка таблицы текущего состояния */
+    unsigned int step;
+    size_t depth = validator->depth;
+    size_t call_depth = validator->call_depth;
+
+    for (; p < end && row != EXT_ERROR * EXT_ROW; p++) {
+        step = extended_transition[row + extended_class[*p]];
+        row = step & ~(unsigned int)(EXT_ROW - 1);
+
+        if ((step & (ACT_KIND_CALL | ACT_COMMA)) != 0 ||
+            ((depth ^ call_depth) | (~step & ACT_POP)) == 0) {
+            validator->depth = depth;
+            row = extendedSpecial(validator, step, (unsigned int)row);
+            if (row == EXT_ERROR * EXT_ROW) {
+                break;
+            }
+            call_depth = validator->call_depth;
+        }
+        depth = depth + (step & ACT_PUSH) - ((step >> 1) & 1);
+    }
+
+    validator->state = (unsigned int)(row / EXT_ROW);
+    validator->depth = depth;
+}
+
+int extendedAccepts(const ExtendedValidator *validator)
+{
+    return validator->depth == 0 &&
+           (validator->state == EXT_OPERATOR || validator->state == EXT_NUMBER ||
+            validator->state == EXT_FRACTION || validator->state == EXT_NAME);
+}
+
+/* --- Диагностика --- */
+
+/*
+ * Повторяет переходы dfa_transition, но вместо перехода в DFA_ERROR
+ * сообщает причину. Дополнительно запоминает последнюю значимую лексему
+ * (для оборванного выражения) и последнюю '(', поднявшую баланс с 0 до 1:
+ * если в конце баланс положителен, именно она осталась незакрытой
+ * снаружи всех остальных.
+ */
+int diagnoseExpression(const char *expr, size_t length, ValidationError *error)
+{
+    const unsigned char *p = (const unsigned char *)expr;
+    unsigned int state = DFA_OPERAND;
+    unsigned int symbol_class;
+    size_t i;
+    size_t last_token = 0;
+    size_t outer_open = 0;
+    long balance = 0;
+    int seen_token = FALSE;
+
+    error->reason = ERROR_NONE;
+    error->offset = 0;
+
+    for (i = 0; i < length; i++) {
+        symbol_class = byte_class[p[i]];
+        if (symbol_class == CLASS_SPACE) {
+            if (state == DFA_NUMBER) {
+                state = DFA_OPERATOR;
+            }
+            continue;
+        }
+
+        error->offset = i;
+        if (symbol_class == CLASS_OTHER) {
+            error->reason = ERROR_INVALID_CHAR;
+            return FALSE;
+        }
+
+        if (state == DFA_OPERAND) {
+            switch (symbol_class) {
+            case CLASS_DIGIT:
+                state = DFA_NUMBER;
+                break;
+            case CLASS_LETTER:
+                state = DFA_OPERATOR;
+                break;
+            case CLASS_OPEN:
+                if (balance++ == 0) {
+                    outer_open = i;
+                }
+                break;
+            case CLASS_SIGN:
+                break;
+            case CLASS_MULOP:
+                error->reason = ERROR_UNEXPECTED_OPERATOR;
+                return FALSE;
+            default: /* CLASS_CLOSE */
+                error->reason = ERROR_UNEXPECTED_CLOSE;
+                return FALSE;
+            }
+        } else {
+            switch (symbol_class) {
+            case CLASS_DIGIT:
+                if (state != DFA_NUMBER) {
+                    error->reason = ERROR_TWO_OPERANDS;
+                    return FALSE;
+                }
+                break;
+            case CLASS_LETTER:
+            case CLASS_OPEN:
+                error->reason = ERROR_TWO_OPERANDS;
+                return FALSE;
+            case CLASS_SIGN:
+            case CLASS_MULOP:
+                state = DFA_OPERAND;
+                break;
+            default: /* CLASS_CLOSE */
+                if (balance == 0) {
+                    error->reason = ERROR_UNBALANCED_CLOSE;
+                    return FALSE;
+                }
+                balance--;
+                state = DFA_OPERATOR;
+                break;
+            }
+        }
+        last_token = i;
+        seen_token = TRUE;
+    }
+
+    if (state == DFA_OPERAND) {
+        error->reason = seen_token ? ERROR_TRAILING_OPERATOR : ERROR_EMPTY;
+        error->offset = seen_token ? last_token : length;
+        return FALSE;
+    }
+    if (balance > 0) {
+        error->reason = ERROR_UNCLOSED_OPEN;
+        error->offset = outer_open;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+const char *errorReasonText(ErrorReason reason)
+{
+    switch (reason) {
+    case ERROR_NONE:                return "no error";
+    case ERROR_EMPTY:               return "empty expression";
+    case ERROR_INVALID_CHAR:        return "invalid character";
+    case ERROR_UNEXPECTED_OPERATOR: return "operator where an operand is expected";
+    case ERROR_UNEXPECTED_CLOSE:    return "')' where an operand is expected";
+    case ERROR_TWO_OPERANDS:        return "two operands in a row";
+    case ERROR_UNBALANCED_CLOSE:    return "unbalanced ')'";
+    case ERROR_TRAILING_OPERATOR:   return "operand expected at end of expression";
+    case ERROR_UNCLOSED_OPEN:       return "unclosed '('";
+    }
+    return "unknown error";
+}
+
+/* --- Синтаксическое дерево --- */
+
+/* Состояние разбора одного выражения */
+typedef struct {
+    const char *text;
+    size_t length;
+    size_t pos;
+    ExprArena *arena;
+    int depth;
+    ParseStatus status;          /* Почему разбор прерван: PARSE_INVALID по умолчанию */
+} Parser;
+
+void arenaInit(ExprArena *arena)
+{
+    arena->nodes = NULL;
+    arena->count = 0;
+    arena->capacity = 0;
+}
+
+void arenaReset(ExprArena *arena)
+{
+    arena->count = 0;
+}
+
+void arenaFree(ExprArena *arena)
+{
+    free(arena->nodes);
+    arenaInit(arena);
+}
+
+/* Добавляет узел и возвращает его индекс; NO_NODE - нет памяти */
+static long arenaNode(ExprArena *arena, NodeKind kind, ExprValue value, long left, long right)
+{
+    AstNode *grown;
+    AstNode *node;
+
+    if (arena->count == arena->capacity) {
+        grown = (AstNode *)realloc(arena->nodes, (arena->capacity * 2 + 64) * sizeof(AstNode));
+        if (grown == NULL) {
+            return NO_NODE;
+        }
+        arena->nodes = grown;
+        arena->capacity = arena->capacity * 2 + 64;
+    }
+
+    node = &arena->nodes[arena->count];
+    node->kind = kind;
+    node->value = value;
+    node->left = left;
+    node->right = right;
+    return (long)arena->count++;
+}
+
+/* Узел для разбора: нехватка памяти запоминается как причина остановки */
+static long parserNode(Parser *parser, NodeKind kind, ExprValue value, long left, long right)
+{
+    long node = arenaNode(parser->arena, kind, value, left, right);
+
+    if (node == NO_NODE) {
+        parser->status = PARSE_NO_MEMORY;
+    }
+    return node;
+}
+
+/* Пропускает пробелы и возвращает текущий байт (0 в конце текста) */
+static int parserPeek(Parser *parser)
+{
+    while (parser->pos < parser->length &&
+           byte_class[(unsigned char)parser->text[parser->pos]] == CLASS_SPACE) {
+        parser->pos++;
+    }
+    return parser->pos < parser->length ? (unsigned char)parser->text[parser->pos] : 0;
+}
+
+static long parseBinary(Parser *parser, int min_priority);
+
+/*
+ * Операнд с унарными знаками. Знаки разбираются циклом, а не
+ * рекурсией: узел каждого следующего знака подвешивается к предыдущему,
+ * операнд - к последнему, так что "- - - a" не расходует стек.
+ */
+static long parseOperand(Parser *parser)
+{
+    long first = NO_NODE;
+    long last = NO_NODE;
+    long node;
+    unsigned int value;
+    int c = parserPeek(parser);
+
+    while (c == '+' || c == '-') {
+        node = parserNode(parser, c == '-' ? NODE_NEGATE : NODE_PLUS, 0, NO_NODE, NO_NODE);
+        if (node == NO_NODE) {
+            return NO_NODE;
+        }
+        if (last == NO_NODE) {
+            first = node;
+        } else {
+            parser->arena->nodes[last].left = node;
+        }
+        last = node;
+        parser->pos++;
+        c = parserPeek(parser);
+    }
+
+    if (c >= '0' && c <= '9') {
+        /* Переполнение числа - по модулю 2^32, как и у операций */
+        value = 0;
+        while (parser->pos < parser->length &&
+               byte_class[(unsigned char)parser->text[parser->pos]] == CLASS_DIGIT) {
+            value = value * 10U + (unsigned int)(parser->text[parser->pos] - '0');
+            parser->pos++;
+        }
+        node = parserNode(parser, NODE_NUMBER, (ExprValue)value, NO_NODE, NO_NODE);
+    } else if (c >= 'a' && c <= 'z') {
+        parser->pos++;
+        node = parserNode(parser, NODE_VARIABLE, (ExprValue)(c - 'a'), NO_NODE, NO_NODE);
+    } else if (c == '(') {
+        parser->pos++;
+        if (++parser->depth > PARSE_MAX_DEPTH) {
+            parser->status = PARSE_TOO_DEEP;
+            return NO_NODE;
+        }
+        node = parseBinary(parser, 1);
+        if (node == NO_NODE || parserPeek(parser) != ')') {
+            return NO_NODE;
+        }
+        parser->pos++;
+        parser->depth--;
+    } else {
+        return NO_NODE;
+    }
+
+    if (node != NO_NODE && last != NO_NODE) {
+        parser->arena->nodes[last].left = node;
+        node = first;
+    }
+    return node;
+}
+
+/* Приоритет бинарного оператора c; 0 - не оператор */
+static int binaryPriority(int c)
+{
+    switch (c) {
+    case '+':
+    case '-':
+        return 1;
+    case '*':
+    case '/':
+    case '%':
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+/* Подъем по приоритетам: все операторы левоассоциативны */
+static long parseBinary(Parser *parser, int min_priority)
+{
+    long left;
+    long right;
+    int c;
+    int priority;
+    NodeKind kind;
+
+    left = parseOperand(parser);
+    while (left != NO_NODE) {
+        c = parserPeek(parser);
+        priority = binaryPriority(c);
+        if (priority == 0 || priority < min_priority) {
+            break;
+        }
+        parser->pos++;
+
+        if (++parser->depth > PARSE_MAX_DEPTH) {
+            parser->status = PARSE_TOO_DEEP;
+            return NO_NODE;
+        }
+        right = parseBinary(parser, priority + 1);
+        parser->depth--;
+        if (right == NO_NODE) {
+            return NO_NODE;
+        }
+
+        switch (c) {
+        case '+': kind = NODE_ADD; break;
+        case '-': kind = NODE_SUB; break;
+        case '*': kind = NODE_MUL; break;
+        case '/': kind = NODE_DIV; break;
+        default:  kind = NODE_MOD; break;
+        }
+        left = parserNode(parser, kind, 0, left, right);
+    }
+    return left;
+}
+
+ParseStatus parseExpression(const char *expr, size_t length, ExprArena *arena, long *root)
+{
+    Parser parser;
+    ValidatorState validator;
+
+    parser.text = expr;
+    parser.length = length;
+    parser.pos = 0;
+    parser.arena = arena;
+    parser.depth = 0;
+    parser.status = PARSE_INVALID;
+
+    *root = parseBinary(&parser, 1);
+    if (*root != NO_NODE && parserPeek(&parser) == 0 && parser.pos == length) {
+        return PARSE_OK;
+    }
+
+    /* Разбор прерван до конца текста: корректность решает автомат */
+    if (parser.status != PARSE_INVALID) {
+        validatorInit(&validator);
+        validatorFeed(&validator, expr, length);
+        if (validatorAccepts(&validator)) {
+            return parser.status;
+        }
+    }
+    return PARSE_INVALID;
+}
+
+/* --- Байт-код --- */
+
+void bytecodeInit(Bytecode *program)
+{
+    program->code = NULL;
+    program->length = 0;
+    program->capacity = 0;
+    program->max_stack = 0;
+}
+
+void bytecodeFree(Bytecode *program)
+{
+    free(program->code);
+    bytecodeInit(program);
+}
+
+/* Добавляет команду; FALSE - нет памяти */
+static int bytecodeEmit(Bytecode *program, OpCode op, ExprValue argument)
+{
+    Instruction *grown;
+
+    if (program->length == program->capacity) {
+        program->capacity = program->capacity * 2 + 16;
+        grown = (Instruction *)realloc(program->code, program->capacity * sizeof(Instruction));
+        if (grown == NULL) {
+            return FALSE;
+        }
+        program->code = grown;
+    }
+    program->code[program->length].op = op;
+    program->code[program->length].argument = argument;
+    program->length++;
+    return TRUE;
+}
+
+/*
+ * Деление с отбрасыванием дробной части (как в C99). В C89 округление
+ * частного отрицательных чисел зависит от реализации, поэтому знаки
+ * обрабатываются явно через беззнаковые модули.
+ */
+ExprValue evalBinary(OpCode op, ExprValue left, ExprValue right)
+{
+    unsigned int a = (unsigned int)left;
+    unsigned int b = (unsigned int)right;
+    unsigned int magnitude_a;
+    unsigned int magnitude_b;
+    unsigned int result;
+
+    switch (OP_BASE(op)) {
+    case OP_ADD:
+        return (ExprValue)(a + b);
+    case OP_SUB:
+        return (ExprValue)(a - b);
+    case OP_MUL:
+        return (ExprValue)(a * b);
+    default:
+        break;
+    }
+
+    if (right == 0) {
+        return 0;
+    }
+    magnitude_a = (left < 0) ? 0U - a : a;
+    magnitude_b = (right < 0) ? 0U - b : b;
+    if (OP_BASE(op) == OP_DIV) {
+        result = magnitude_a / magnitude_b;
+        return (ExprValue)(((left < 0) != (right < 0)) ? 0U - result : result);
+    }
+    /* Остаток имеет знак делимого */
+    result = magnitude_a % magnitude_b;
+    return (ExprValue)((left < 0) ? 0U - result : result);
+}
+
+/* Команда бинарного оператора для вида узла */
+static OpCode nodeOperation(NodeKind kind)
+{
+    switch (kind) {
+    case NODE_ADD: return OP_ADD;
+    case NODE_SUB: return OP_SUB;
+    case NODE_MUL: return OP_MUL;
+    case NODE_DIV: return OP_DIV;
+    default:       return OP_MOD;
+    }
+}
+
+/*
+ * Обратный обход дерева по явному стеку (как в writeAst). Свертка
+ * опирается на то, что код любого составного операнда заканчивается
+ * операцией: если последняя команда - OP_CONST, то весь операнд - число,
+ * если OP_NEGATE - операнд сам начинается с унарного минуса. По той же
+ * причине правый операнд из одной команды OP_CONST или OP_VARIABLE
+ * вливается в бинарную команду.
+ */
+int compileExpression(const ExprArena *arena, long root, Bytecode *program)
+{
+    const AstNode *node;
+    Instruction *last;
+    long *stack;
+    long *grown;
+    long index;
+    size_t capacity = 64;
+    size_t depth = 0;
+    size_t height = 0;
+    size_t i;
+    int visit;
+    int ok = TRUE;
+
+    program->length = 0;
+    program->max_stack = 0;
+
+    stack = (long *)malloc(capacity * sizeof(long));
+    if (stack == NULL) {
+        return FALSE;
+    }
+    stack[depth++] = root * 3 + VISIT_ENTER;
+
+    while (ok && depth > 0) {
+        index = stack[--depth];
+        visit = (int)(index % 3);
+        node = &arena->nodes[index / 3];
+
+        if (depth + 2 > capacity) {
+            grown = (long *)realloc(stack, capacity * 2 * sizeof(long));
+            if (grown == NULL) {
+                ok = FALSE;
+                break;
+            }
+            stack = grown;
+            capacity *= 2;
+        }
+
+        if (visit == VISIT_ENTER) {
+            if (node->kind == NODE_NUMBER) {
+                ok = bytecodeEmit(program, OP_CONST, node->value);
+            } else if (node->kind == NODE_VARIABLE) {
+                ok = bytecodeEmit(program, OP_VARIABLE, node->value);
+            } else {
+                stack[depth++] = index + VISIT_LEFT;
+                stack[depth++] = node->left * 3 + VISIT_ENTER;
+            }
+            continue;
+        }
+
+        last = &program->code[program->length - 1];
+        if (node->kind == NODE_PLUS) {
+            /* Унарный плюс не порождает команд */
+        } else if (node->kind == NODE_NEGATE) {
+            if (last->op == OP_CONST) {
+                last->argument = (ExprValue)(0U - (unsigned int)last->argument);
+            } else if (last->op == OP_NEGATE) {
+                program->length--;
+            } else {
+                ok = bytecodeEmit(program, OP_NEGATE, 0);
+            }
+        } else if (visit == VISIT_LEFT) {
+            stack[depth++] = index - VISIT_LEFT + VISIT_RIGHT;
+            stack[depth++] = node->right * 3 + VISIT_ENTER;
+        } else if (last->op == OP_CONST && program->length >= 2 && last[-1].op == OP_CONST) {
+            /* Оба операнда - числа */
+            last[-1].argument = evalBinary(nodeOperation(node->kind), last[-1].argument, last->argument);
+            program->length--;
+        } else if (last->op == OP_CONST) {
+            last->op = (OpCode)(nodeOperation(node->kind) + 1);
+        } else if (last->op == OP_VARIABLE) {
+            last->op = (OpCode)(nodeOperation(node->kind) + 2);
+        } else {
+            ok = bytecodeEmit(program, nodeOperation(node->kind), 0);
+        }
+    }
+    free(stack);
+
+    /* Глубина стека вычисления */
+    for (i = 0; ok && i < program->length; i++) {
+        if (program->code[i].op == OP_CONST || program->code[i].op == OP_VARIABLE) {
+            if (++height > program->max_stack) {
+                program->max_stack = height;
+            }
+        } else if (program->code[i].op >= OP_ADD &&
+                   program->code[i].op == OP_BASE(program->code[i].op)) {
+            height--;
+        }
+    }
+    return ok;
+}
+
+ExprValue bytecodeEval(const Bytecode *program, const ExprValue *variables, ExprValue *stack)
+{
+    const Instruction *pc = program->code;
+    const Instruction *end = pc + program->length;
+    ExprValue *top = stack - 1;   /* Вершина стека */
+
+    for (; pc < end; pc++) {
+        switch (pc->op) {
+        case OP_CONST:
+            *++top = pc->argument;
+            break;
+        case OP_VARIABLE:
+            *++top = variables[pc->argument];
+            break;
+        case OP_NEGATE:
+            *top = (ExprValue)(0U - (unsigned int)*top);
+            break;
+        case OP_ADD:
+            top--;
+            *top = (ExprValue)((unsigned int)top[0] + (unsigned int)top[1]);
+            break;
+        case OP_ADD_CONST:
+            *top = (ExprValue)((unsigned int)*top + (unsigned int)pc->argument);
+            break;
+        case OP_ADD_VARIABLE:
+            *top = (ExprValue)((unsigned int)*top + (unsigned int)variables[pc->argument]);
+            break;
+        case OP_SUB:
+            top--;
+            *top = (ExprValue)((unsigned int)top[0] - (unsigned int)top[1]);
+            break;
+        case OP_SUB_CONST:
+            *top = (ExprValue)((unsigned int)*top - (unsigned int)pc->argument);
+            break;
+        case OP_SUB_VARIABLE:
+            *top = (ExprValue)((unsigned int)*top - (unsigned int)variables[pc->argument]);
+            break;
+        case OP_MUL:
+            top--;
+            *top = (ExprValue)((unsigned int)top[0] * (unsigned int)top[1]);
+            break;
+        case OP_MUL_CONST:
+            *top = (ExprValue)((unsigned int)*top * (unsigned int)pc->argument);
+            break;
+        case OP_MUL_VARIABLE:
+            *top = (ExprValue)((unsigned int)*top * (unsigned int)variables[pc->argument]);
+            break;
+        case OP_DIV:
+        case OP_MOD:
+            top--;
+            *top = evalBinary(pc->op, top[0], top[1]);
+            break;
+        case OP_DIV_CONST:
+        case OP_MOD_CONST:
+            *top = evalBinary(pc->op, *top, pc->argument);
+            break;
+        default: /* OP_DIV_VARIABLE, OP_MOD_VARIABLE */
+            *top = evalBinary(pc->op, *top, variables[pc->argument]);
+            break;
+        }
+    }
+    return *top;
+}
+
+/* --- Столбцовое вычисление --- */
+
+#ifdef __SSE2__
+/* Младшие 32 бита произведений по четырем полосам (в SSE2 нет pmulld) */
+static __m128i vectorMultiply(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+#endif
+
+/*
+ * Ядро бинарной операции над блоком: out[i] = left[i] op right[i], или
+ * out[i] = left[i] op constant, если right == NULL. Сложение, вычитание
+ * и умножение идут по четыре полосы SSE2; деление и остаток - поэлементно
+ * через evalBinary, чтобы сохранить правила для 0 и отрицательных чисел.
+ */
+static void columnKernel(OpCode op, ExprValue *out, const ExprValue *left,
+                         const ExprValue *right, ExprValue constant, size_t count)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i a;
+    __m128i b = _mm_set1_epi32(constant);
+    __m128i c;
+#endif
+
+    op = OP_BASE(op);
+#ifdef __SSE2__
+    if (op == OP_ADD || op == OP_SUB || op == OP_MUL) {
+        for (; i + 4 <= count; i += 4) {
+            a = _mm_loadu_si128((const __m128i *)(left + i));
+            if (right != NULL) {
+                b = _mm_loadu_si128((const __m128i *)(right + i));
+            }
+            if (op == OP_ADD) {
+                c = _mm_add_epi32(a, b);
+            } else if (op == OP_SUB) {
+                c = _mm_sub_epi32(a, b);
+            } else {
+                c = vectorMultiply(a, b);
+            }
+            _mm_storeu_si128((__m128i *)(out + i), c);
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        out[i] = evalBinary(op, left[i], right != NULL ? right[i] : constant);
+    }
+}
+
+/*
+ * Стек вычисления - массив указателей на блоки. Переменная не
+ * копируется: ее ячейка стека указывает прямо в столбец. Результаты
+ * операций пишутся в собственный буфер уровня стека (buffers), так что
+ * рабочая память - max_stack блоков по COLUMN_BLOCK значений.
+ */
+int evalColumns(const Bytecode *program, const ExprValue *const *columns,
+                size_t rows, ExprValue *result)
+{
+    const ExprValue **slot;
+    const ExprValue *right;
+    const Instruction *pc;
+    const Instruction *end = program->code + program->length;
+    ExprValue *buffers;
+    ExprValue *zeros;
+    ExprValue *target;
+    size_t start;
+    size_t count;
+    size_t i;
+    size_t top;
+
+    slot = (const ExprValue **)malloc((program->max_stack + 1) * sizeof(ExprValue *));
+    buffers = (ExprValue *)malloc((program->max_stack + 1) * COLUMN_BLOCK * sizeof(ExprValue));
+    zeros = (ExprValue *)calloc(COLUMN_BLOCK, sizeof(ExprValue));
+    if (slot == NULL || buffers == NULL || zeros == NULL) {
+        free(slot);
+        free(buffers);
+        free(zeros);
+        return FALSE;
+    }
+
+    for (start = 0; start < rows; start += count) {
+        count = (rows - start < COLUMN_BLOCK) ? rows - start : COLUMN_BLOCK;
+        top = 0;
+
+        for (pc = program->code; pc < end; pc++) {
+            if (pc->op == OP_CONST) {
+                target = buffers + top * COLUMN_BLOCK;
+                for (i = 0; i < count; i++) {
+                    target[i] = pc->argument;
+                }
+                slot[top++] = target;
+                continue;
+            }
+            if (pc->op == OP_VARIABLE) {
+                slot[top++] = (columns[pc->argument] != NULL) ? columns[pc->argument] + start : zeros;
+                continue;
+            }
+
+            /* Остальные команды заменяют вершину стека */
+            target = buffers + (top - 1) * COLUMN_BLOCK;
+            switch (pc->op) {
+            case OP_NEGATE:
+                for (i = 0; i < count; i++) {
+                    target[i] = (ExprValue)(0U - (unsigned int)slot[top - 1][i]);
+                }
+                slot[top - 1] = target;
+                break;
+            case OP_ADD_CONST:
+            case OP_SUB_CONST:
+            case OP_MUL_CONST:
+            case OP_DIV_CONST:
+            case OP_MOD_CONST:
+                columnKernel(pc->op, target, slot[top - 1], NULL, pc->argument, count);
+                slot[top - 1] = target;
+                break;
+            case OP_ADD_VARIABLE:
+            case OP_SUB_VARIABLE:
+            case OP_MUL_VARIABLE:
+            case OP_DIV_VARIABLE:
+            case OP_MOD_VARIABLE:
+                right = (columns[pc->argument] != NULL) ? columns[pc->argument] + start : zeros;
+                columnKernel(pc->op, target, slot[top - 1], right, 0, count);
+                slot[top - 1] = target;
+                break;
+            default:
+                top--;
+                target = buffers + (top - 1) * COLUMN_BLOCK;
+                columnKernel(pc->op, target, slot[top - 1], slot[top], 0, count);
+                slot[top - 1] = target;
+                break;
+            }
+        }
+        memcpy(result + start, slot[0], count * sizeof(ExprValue));
+    }
+
+    free(slot);
+    free(buffers);
+    free(zeros);
+    return TRUE;
+}
+
+/* --- Сводки участков --- */
+
+void chunkSummaryEmpty(ChunkSummary *summary)
+{
+    int s;
+
+    for (s = 0; s < DFA_STATES; s++) {
+        summary->end_state[s] = (unsigned char)s;
+    }
+    summary->delta = 0;
+    summary->lowest = 0;
+}
+
+/*
+ * Участок прогоняется сразу из трех начальных состояний, пока все
+ * неошибочные пути не сойдутся в одно состояние (обычно за одну-две
+ * лексемы). Дальше достаточно одного прохода validatorFeed. Скобки на
+ * любом неошибочном пути одни и те же, поэтому баланс считается один раз.
+ */
+void chunkSummarize(const char *data, size_t length, ChunkSummary *summary)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    unsigned int state[DFA_STATES];
+    unsigned int common;
+    ValidatorState validator;
+    size_t i = 0;
+    int s;
+    int merged = FALSE;
+
+    for (s = 0; s < DFA_STATES; s++) {
+        state[s] = (unsigned int)s;
+    }
+    validatorInit(&validator);
+
+    while (i < length && !merged) {
+        for (s = 0; s < DFA_ERROR; s++) {
+            state[s] = dfa_transition[state[s]][byte_class[p[i]]] & 3;
+        }
+        if (p[i] == '(') {
+            validator.balance++;
+        } else if (p[i] == ')' && --validator.balance < validator.lowest) {
+            validator.lowest = validator.balance;
+        }
+        i++;
+
+        /* Сошлись ли все живые пути */
+        common = DFA_ERROR;
+        merged = TRUE;
+        for (s = 0; s < DFA_ERROR; s++) {
+            if (state[s] == DFA_ERROR) {
+                continue;
+            }
+            if (common != DFA_ERROR && state[s] != common) {
+                merged = FALSE;
+            }
+            common = state[s];
+        }
+    }
+
+    if (merged && i < length) {
+        validator.state = common;
+        validatorFeed(&validator, data + i, length - i);
+        for (s = 0; s < DFA_ERROR; s++) {
+            if (state[s] != DFA_ERROR) {
+                state[s] = validator.state;
+            }
+        }
+    }
+
+    for (s = 0; s < DFA_STATES; s++) {
+        summary->end_state[s] = (unsigned char)state[s];
+    }
+    summary->delta = validator.balance;
+    summary->lowest = validator.lowest;
+}
+
+void chunkCompose(const ChunkSummary *left, const ChunkSummary *right, ChunkSummary *out)
+{
+    ChunkSummary result;
+    int s;
+
+    for (s = 0; s < DFA_STATES; s++) {
+        result.end_state[s] = right->end_state[left->end_state[s]];
+    }
+    result.delta = left->delta + right->delta;
+    result.lowest = left->lowest;
+    if (left->delta + right->lowest < result.lowest) {
+        result.lowest = left->delta + right->lowest;
+    }
+    *out = result;
+}
+
+int chunkSummaryAccepts(const ChunkSummary *summary)
+{
+    unsigned int state = summary->end_state[DFA_OPERAND];
+
+    return summary->lowest >= 0 && summary->delta == 0 &&
+           (state == DFA_OPERATOR || state == DFA_NUMBER);
+}
+
+/* --- Инкрементальная проверка --- */
+
+void incrementalInit(IncrementalText *text)
+{
+    size_t i;
+
+    for (i = 0; i < LEAF_SPARES; i++) {
+        text->spare[i] = NULL;
+    }
+    text->leaves = NULL;
+    text->count = 0;
+    text->capacity = 0;
+    text->tree = NULL;
+    text->width = 0;
+    text->length = 0;
+}
+
+void incrementalFree(IncrementalText *text)
+{
+    size_t i;
+
+    for (i = 0; i < text->count; i++) {
+        free(text->leaves[i]);
+    }
+    for (i = 0; i < LEAF_SPARES; i++) {
+        free(text->spare[i]);
+    }
+    free(text->leaves);
+    free(text->tree);
+    incrementalInit(text);
+}
+
+/* Пересчитывает сводку листа index и путь от него до корня: O(log n). */
+static void incrementalUpdate(IncrementalText *text, size_t index)
+{
+    TextLeaf *leaf = text->leaves[index];
+    SummaryNode *tree = text->tree;
+    size_t node = text->width + index;
+
+    chunkSummarize(leaf->text, leaf->length, &leaf->summary);
+    tree[node].summary = leaf->summary;
+    tree[node].length = leaf->length;
+    for (node /= 2; node > 0; node /= 2) {
+        chunkCompose(&tree[2 * node].summary, &tree[2 * node + 1].summary, &tree[node].summary);
+        tree[node].length = tree[2 * node].length + tree[2 * node + 1].length;
+    }
+}
+
+/*
+ * Строит дерево заново из сводок листьев: O(n / LEAF_TARGET). Нужно
+ * только при изменении набора листьев, то есть не чаще раза на сотни
+ * правленых байт. Память дерева выделена заранее.
+ */
+static void incrementalRebuild(IncrementalText *text)
+{
+    SummaryNode *tree = text->tree;
+    size_t i;
+
+    for (i = 0; i < text->width; i++) {
+        if (i < text->count) {
+            tree[text->width + i].summary = text->leaves[i]->summary;
+            tree[text->width + i].length = text->leaves[i]->length;
+        } else {
+            chunkSummaryEmpty(&tree[text->width + i].summary);
+            tree[text->width + i].length = 0;
+        }
+    }
+    for (i = text->width - 1; i > 0; i--) {
+        chunkCompose(&tree[2 * i].summary, &tree[2 * i + 1].summary, &tree[i].summary);
+        tree[i].length = tree[2 * i].length + tree[2 * i + 1].length;
+    }
+}
+
+/*
+ * Готовит место под count листьев: массив указателей и дерево (ширина
+ * только растет). После успешного вызова дерево надо перестроить.
+ */
+static int incrementalReserve(IncrementalText *text, size_t count)
+{
+    TextLeaf **leaves;
+    SummaryNode *tree;
+    size_t width = (text->width == 0) ? 1 : text->width;
+
+    if (count > text->capacity) {
+        leaves = (TextLeaf **)realloc(text->leaves, count * 2 * sizeof(TextLeaf *));
+        if (leaves == NULL) {
+            return FALSE;
+        }
+        text->leaves = leaves;
+        text->capacity = count * 2;
+    }
+    while (width < count) {
+        width *= 2;
+    }
+    if (width != text->width) {
+        tree = (SummaryNode *)realloc(text->tree, 2 * width * sizeof(SummaryNode));
+        if (tree == NULL) {
+            return FALSE;
+        }
+        text->tree = tree;
+        text->width = width;
+        incrementalRebuild(text);
+    }
+    return TRUE;
+}
+
+/* Лист, содержащий байт *position (< длины текста); в *position - смещение в листе. */
+static size_t incrementalLocate(const IncrementalText *text, size_t *position)
+{
+    size_t node = 1;
+
+    while (node < text->width) {
+        if (*position < text->tree[2 * node].length) {
+            node = 2 * node;
+        } else {
+            *position -= text->tree[2 * node].length;
+            node = 2 * node + 1;
+        }
+    }
+    return node - text->width;
+}
+
+/*
+ * Вставка, не помещающаяся в лист: текст листа вместе со вставкой
+ * режется на новые листья по LEAF_TARGET байт. Листья берутся из
+ * spare[1..], joined - буфер под склеенный текст; память под них и под
+ * дерево выделена заранее, так что разрезание не отказывает.
+ */
+static void incrementalSplice(IncrementalText *text, size_t index, size_t offset,
+                              const char *data, size_t length,
+                              TextLeaf **spare, char *joined)
+{
+    TextLeaf *leaf = text->leaves[index];
+    size_t total = leaf->length + length;
+    size_t pieces = (total + LEAF_TARGET - 1) / LEAF_TARGET;
+    size_t part;
+    size_t i;
+
+    memcpy(joined, leaf->text, offset);
+    memcpy(joined + offset, data, length);
+    memcpy(joined + offset + length, leaf->text + offset, leaf->length - offset);
+
+    /* Первый кусок остается в старом листе, остальные встают за ним */
+    memmove(text->leaves + index + pieces, text->leaves + index + 1,
+            (text->count - index - 1) * sizeof(TextLeaf *));
+    for (i = 0; i < pieces; i++) {
+        if (i > 0) {
+            text->leaves[index + i] = spare[i];
+            spare[i] = NULL;
+        }
+        leaf = text->leaves[index + i];
+        part = (total - i * LEAF_TARGET < LEAF_TARGET) ? total - i * LEAF_TARGET : LEAF_TARGET;
+        memcpy(leaf->text, joined + i * LEAF_TARGET, part);
+        leaf->length = part;
+        chunkSummarize(leaf->text, part, &leaf->summary);
+    }
+    text->count += pieces - 1;
+    text->length += length;
+    incrementalRebuild(text);
+}
+
+/* Вставка в текст с заранее выделенной памятью (см. incrementalSplice). */
+static void incrementalInsert(IncrementalText *text, size_t position, const char *data, size_t length,
+                              TextLeaf **spare, char *joined)
+{
+    TextLeaf *leaf;
+    size_t index;
+    size_t offset = position;
+
+    if (text->count == 0) {
+        /* Пустой текст: один пустой лист, дальше - обычная вставка */
+        leaf = spare[0];
+        spare[0] = NULL;
+        leaf->length = 0;
+        chunkSummaryEmpty(&leaf->summary);
+        text->leaves[text->count++] = leaf;
+    }
+
+    if (position == text->length) {
+        index = text->count - 1;
+        offset = text->leaves[index]->length;
+    } else {
+        index = incrementalLocate(text, &offset);
+    }
+    leaf = text->leaves[index];
+    if (leaf->length + length > LEAF_CAPACITY) {
+        incrementalSplice(text, index, offset, data, length, spare, joined);
+        return;
+    }
+
+    memmove(leaf->text + offset + length, leaf->text + offset, leaf->length - offset);
+    memcpy(leaf->text + offset, data, length);
+    leaf->length += length;
+    text->length += length;
+    incrementalUpdate(text, index);
+}
+
+/*
+ * Удаление идет по листьям. Опустевший лист выбрасывается, а короткий
+ * (меньше LEAF_MERGE) сливается с соседом, если вместе они помещаются
+ * в лист, - так число листьев остается порядка n / LEAF_TARGET.
+ */
+static void incrementalRemove(IncrementalText *text, size_t position, size_t length)
+{
+    TextLeaf *leaf;
+    TextLeaf *next;
+    size_t index;
+    size_t offset;
+    size_t part;
+    size_t i;
+    size_t kept = 0;
+    int emptied = FALSE;
+
+    while (length > 0) {
+        offset = position;
+        index = incrementalLocate(text, &offset);
+        leaf = text->leaves[index];
+        part = (leaf->length - offset < length) ? leaf->length - offset : length;
+
+        memmove(leaf->text + offset, leaf->text + offset + part, leaf->length - offset - part);
+        leaf->length -= part;
+        text->length -= part;
+        length -= part;
+
+        if (leaf->length > 0 && leaf->length < LEAF_MERGE && text->count > 1) {
+            if (index + 1 == text->count) {
+                index--;   /* Последний лист сливается с предыдущим */
+            }
+            leaf = text->leaves[index];
+            next = text->leaves[index + 1];
+            if (leaf->length + next->length <= LEAF_CAPACITY) {
+                memcpy(leaf->text + leaf->length, next->text, next->length);
+                leaf->length += next->length;
+                next->length = 0;
+                incrementalUpdate(text, index + 1);
+                emptied = TRUE;
+            }
+        }
+
+        /* Дерево должно быть верным для поиска следующего отрезка */
+        incrementalUpdate(text, index);
+        if (leaf->length == 0) {
+            emptied = TRUE;
+        }
+    }
+
+    if (emptied) {
+        for (i = 0; i < text->count; i++) {
+            if (text->leaves[i]->length > 0) {
+                text->leaves[kept++] = text->leaves[i];
+            } else {
+                free(text->leaves[i]);
+            }
+        }
+        text->count = kept;
+        incrementalRebuild(text);
+    }
+}
+
+/*
+ * Вся память для вставки выделяется до удаления, поэтому при нехватке
+ * памяти текст остается прежним. После удаления лист не длиннее
+ * LEAF_CAPACITY, так что вставка занимает не больше spares листьев.
+ * Обычной короткой вставке хватает запаса text->spare и буфера на
+ * стеке; на куче память берется только под длинные вставки.
+ */
+int incrementalEdit(IncrementalText *text, size_t position, size_t removed,
+                    const char *inserted, size_t length)
+{
+    char local[2 * LEAF_CAPACITY];
+    TextLeaf **spare = text->spare;
+    char *joined = local;
+    size_t spares = (LEAF_CAPACITY + length + LEAF_TARGET - 1) / LEAF_TARGET;
+    size_t i;
+    int ok = TRUE;
+
+    if (position > text->length || removed > text->length - position) {
+        return FALSE;
+    }
+    if (length == 0) {
+        incrementalRemove(text, position, removed);
+        return TRUE;
+    }
+
+    if (length > LEAF_CAPACITY) {
+        spare = (TextLeaf **)calloc(spares, sizeof(TextLeaf *));
+        joined = (char *)malloc(LEAF_CAPACITY + length);
+        ok = spare != NULL && joined != NULL;
+    }
+    ok = ok && incrementalReserve(text, text->count + spares);
+    for (i = 0; ok && i < spares; i++) {
+        if (spare[i] == NULL) {
+            spare[i] = (TextLeaf *)malloc(sizeof(TextLeaf));
+            ok = spare[i] != NULL;
+        }
+    }
+
+    if (ok) {
+        incrementalRemove(text, position, removed);
+        incrementalInsert(text, position, inserted, length, spare, joined);
+    }
+    if (length > LEAF_CAPACITY) {
+        for (i = 0; spare != NULL && i < spares; i++) {
+            free(spare[i]);   /* Неиспользованные листья */
+        }
+        free(spare);
+        free(joined);
+    }
+    return ok;
+}
+
+int incrementalAccepts(const IncrementalText *text)
+{
+    ChunkSummary empty;
+
+    if (text->width == 0) {
+        chunkSummaryEmpty(&empty);
+        return chunkSummaryAccepts(&empty);
+    }
+    return chunkSummaryAccepts(&text->tree[1].summary);
+}
+
+/* --- Кэш вердиктов --- */
+
+int cacheInit(VerdictCache *cache)
+{
+    size_t size = 2 * CACHE_ENTRIES;
+    size_t i;
+
+    cache->entries = (CacheEntry *)malloc(CACHE_ENTRIES * sizeof(CacheEntry));
+    cache->index = (long *)malloc(size * sizeof(long));
+    if (cache->entries == NULL || cache->index == NULL) {
+        free(cache->entries);
+        free(cache->index);
+        return FALSE;
+    }
+    for (i = 0; i < size; i++) {
+        cache->index[i] = NO_ENTRY;
+    }
+    cache->mask = size - 1;
+    cache->count = 0;
+    cache->hand = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->window = 0;
+    cache->window_hits = 0;
+    cache->bypass = 0;
+    return TRUE;
+}
+
+void cacheFree(VerdictCache *cache)
+{
+    free(cache->entries);
+    free(cache->index);
+    cache->entries = NULL;
+    cache->index = NULL;
+}
+
+/*
+ * Удаляет запись из index обратным сдвигом: следующие за ней элементы
+ * цепочки переносятся в освободившуюся ячейку, если их домашняя ячейка
+ * не лежит (по кругу) между освободившейся и их текущей.
+ */
+static void cacheUnlink(VerdictCache *cache, long entry)
+{
+    size_t slot = (size_t)cache->entries[entry].hash & cache->mask;
+    size_t next;
+    size_t home;
+
+    while (cache->index[slot] != entry) {
+        slot = (slot + 1) & cache->mask;
+    }
+    for (;;) {
+        cache->index[slot] = NO_ENTRY;
+        next = slot;
+        do {
+            next = (next + 1) & cache->mask;
+            if (cache->index[next] == NO_ENTRY) {
+                return;
+            }
+            home = (size_t)cache->entries[cache->index[next]].hash & cache->mask;
+        } while (((next - home) & cache->mask) < ((next - slot) & cache->mask));
+        cache->index[slot] = cache->index[next];
+        slot = next;
+    }
+}
+
+/*
+ * Запись для нового ключа. Пока кэш не заполнен - следующая свободная,
+ * затем - по CLOCK: стрелка снимает бит попадания и вытесняет первую
+ * запись без него. Новая запись получает бит только при первом
+ * попадании, поэтому поток неповторяющихся строк вытесняет сам себя,
+ * не трогая часто встречающиеся формулы.
+ */
+static long cacheVictim(VerdictCache *cache)
+{
+    long entry;
+
+    if (cache->count < CACHE_ENTRIES) {
+        return (long)cache->count++;
+    }
+    while (cache->entries[cache->hand].referenced) {
+        cache->entries[cache->hand].referenced = FALSE;
+        cache->hand = (cache->hand + 1) % CACHE_ENTRIES;
+    }
+    entry = (long)cache->hand;
+    cache->hand = (cache->hand + 1) % CACHE_ENTRIES;
+    cacheUnlink(cache, entry);
+    return entry;
+}
+
+/*
+ * Хэш ключа: по 4 байта за шаг (FNV-1a над словами), затем
+ * перемешивание финализатором MurmurHash3, чтобы младшие биты,
+ * по которым выбирается ячейка, зависели от всех байтов.
+ */
+static unsigned long cacheHash(const char *key, size_t size)
+{
+    unsigned long hash = 2166136261UL ^ (unsigned long)size;
+    unsigned long word;
+    size_t i;
+
+    for (i = 0; i + 4 <= size; i += 4) {
+        word = (unsigned long)(unsigned char)key[i] |
+               (unsigned long)(unsigned char)key[i + 1] << 8 |
+               (unsigned long)(unsigned char)key[i + 2] << 16 |
+               (unsigned long)(unsigned char)key[i + 3] << 24;
+        hash = ((hash ^ word) * 16777619UL) & 0xFFFFFFFFUL;
+    }
+    for (; i < size; i++) {
+        hash = ((hash ^ (unsigned char)key[i]) * 16777619UL) & 0xFFFFFFFFUL;
+    }
+
+    hash ^= hash >> 16;
+    hash = (hash * 0x85EBCA6BUL) & 0xFFFFFFFFUL;
+    hash ^= hash >> 13;
+    hash = (hash * 0xC2B2AE35UL) & 0xFFFFFFFFUL;
+    return hash ^ (hash >> 16);
+}
+
+/*
+ * Учитывает обращение в окне. Кэш окупается, только если почти все
+ * обращения - попадания: промах стоит хэширования, проверки и
+ * вытеснения, а попадание экономит лишь одну короткую проверку. Если
+ * в окне попаданий меньше CACHE_MIN_HITS, следующие CACHE_BYPASS строк
+ * проверяются мимо кэша, затем кэш пробуется снова.
+ */
+static void cacheCount(VerdictCache *cache, int hit)
+{
+    if (hit) {
+        cache->hits++;
+        cache->window_hits++;
+    } else {
+        cache->misses++;
+    }
+    if (++cache->window == CACHE_WINDOW) {
+        if (cache->window_hits < CACHE_MIN_HITS) {
+            cache->bypass = CACHE_BYPASS;
+        }
+        cache->window = 0;
+        cache->window_hits = 0;
+    }
+}
+
+int cacheValidate(VerdictCache *cache, const char *expr, size_t length)
+{
+    unsigned long hash;
+    ValidatorState validator;
+    CacheEntry *found;
+    size_t slot;
+    long entry;
+
+    validatorInit(&validator);
+    if (cache->bypass > 0 || length == 0 || length > CACHE_KEY_MAX) {
+        /* Кэш сейчас не окупается или строка не годится в ключ */
+        if (cache->bypass > 0) {
+            cache->bypass--;
+        }
+        validatorFeed(&validator, expr, length);
+        return validatorAccepts(&validator);
+    }
 
     /*
-     * Финальные проверки после прохода по всей строке:
-     * 1. Баланс скобок должен быть равен нулю.
-     * 2. Выражение не может заканчиваться на бинарный оператор (это означает, что
-     *    конечное состояние должно быть STATE_EXPECT_OPERATOR). Если оно STATE_EXPECT_OPERAND,
-     *    значит выражение оборвалось после оператора, например "a+".
+     * Ключ - сама строка, без нормализации пробелов: попадание должно
+     * стоить меньше прогона автомата, а побайтовая нормализация стоит
+     * столько же, сколько он.
      */
-    if (parenthesis_balance == 0 && current_state == STATE_EXPECT_OPERATOR) {
-        return TRUE;
+    hash = cacheHash(expr, length);
+    slot = (size_t)hash & cache->mask;
+    while ((entry = cache->index[slot]) != NO_ENTRY) {
+        found = &cache->entries[entry];
+        if (found->hash == hash && found->length == length && memcmp(found->key, expr, length) == 0) {
+            found->referenced = TRUE;
+            cacheCount(cache, TRUE);
+            return found->valid;
+        }
+        slot = (slot + 1) & cache->mask;
     }
 
-    return FALSE;
+    cacheCount(cache, FALSE);
+    validatorFeed(&validator, expr, length);
+    entry = cacheVictim(cache);
+    found = &cache->entries[entry];
+    found->hash = hash;
+    found->length = (unsigned char)length;
+    found->valid = (unsigned char)validatorAccepts(&validator);
+    found->referenced = FALSE;
+    memcpy(found->key, expr, length);
+
+    /* После вытеснения цепочка могла сдвинуться - ячейка ищется заново */
+    slot = (size_t)hash & cache->mask;
+    while (cache->index[slot] != NO_ENTRY) {
+        slot = (slot + 1) & cache->mask;
+    }
+    cache->index[slot] = entry;
+    return found->valid;
+}
+
+/* --- Обратная польская запись --- */
+
+void rpnInit(RpnConverter *converter)
+{
+    converter->stack = NULL;
+    converter->stack_capacity = 0;
+    converter->output = NULL;
+    converter->capacity = 0;
+    converter->failed = FALSE;
+    rpnReset(converter);
+}
+
+void rpnReset(RpnConverter *converter)
+{
+    converter->state = DFA_OPERAND;
+    converter->depth = 0;
+    converter->length = 0;
+}
+
+void rpnFree(RpnConverter *converter)
+{
+    free(converter->stack);
+    free(converter->output);
+    rpnInit(converter);
+}
+
+/* Дописывает байты к выводу; нехватка памяти обрывает разбор */
+static void rpnEmit(RpnConverter *converter, const char *text, size_t length)
+{
+    char *grown;
+
+    if (converter->length + length > converter->capacity) {
+        grown = (char *)realloc(converter->output, converter->capacity * 2 + length + 64);
+        if (grown == NULL) {
+            converter->failed = TRUE;
+            converter->state = DFA_ERROR;
+            return;
+        }
+        converter->output = grown;
+        converter->capacity = converter->capacity * 2 + length + 64;
+    }
+    memcpy(converter->output + converter->length, text, length);
+    converter->length += length;
+}
+
+/* Выводит операнд из одного символа (первую цифру числа или переменную) */
+static void rpnOperand(RpnConverter *converter, char c)
+{
+    char token[2];
+
+    token[0] = ' ';
+    token[1] = c;
+    if (converter->length == 0) {
+        rpnEmit(converter, token + 1, 1);
+    } else {
+        rpnEmit(converter, token, 2);
+    }
+}
+
+/* Выводит оператор, снятый со стека; перед оператором всегда есть операнд */
+static void rpnOperator(RpnConverter *converter, char op)
+{
+    char token[3];
+
+    token[0] = ' ';
+    if (op == RPN_PLUS || op == RPN_MINUS) {
+        token[1] = 'u';
+        token[2] = (op == RPN_PLUS) ? '+' : '-';
+        rpnEmit(converter, token, 3);
+    } else {
+        token[1] = op;
+        rpnEmit(converter, token, 2);
+    }
+}
+
+/* Приоритет элемента стека: '(' - 0, унарные знаки выше бинарных */
+static int rpnPriority(char op)
+{
+    switch (op) {
+    case '(':
+        return 0;
+    case '+':
+    case '-':
+        return 1;
+    case '*':
+    case '/':
+    case '%':
+        return 2;
+    default:
+        return 3;
+    }
+}
+
+/* Кладет op в стек */
+static void rpnPush(RpnConverter *converter, char op)
+{
+    char *grown;
+
+    if (converter->depth == converter->stack_capacity) {
+        grown = (char *)realloc(converter->stack, converter->stack_capacity * 2 + 64);
+        if (grown == NULL) {
+            converter->failed = TRUE;
+            converter->state = DFA_ERROR;
+            return;
+        }
+        converter->stack = grown;
+        converter->stack_capacity = converter->stack_capacity * 2 + 64;
+    }
+    converter->stack[converter->depth++] = op;
+}
+
+/* Бинарный оператор: все левоассоциативны, поэтому снимаются и равные по приоритету */
+static void rpnBinary(RpnConverter *converter, char op)
+{
+    int priority = rpnPriority(op);
+
+    while (converter->depth > 0 && rpnPriority(converter->stack[converter->depth - 1]) >= priority) {
+        rpnOperator(converter, converter->stack[--converter->depth]);
+    }
+    rpnPush(converter, op);
+}
+
+/* ')': выводит операторы до парной '('; без нее - ошибка */
+static void rpnClose(RpnConverter *converter)
+{
+    while (converter->depth > 0 && converter->stack[converter->depth - 1] != '(') {
+        rpnOperator(converter, converter->stack[--converter->depth]);
+    }
+    if (converter->depth == 0) {
+        converter->state = DFA_ERROR;
+    } else {
+        converter->depth--;
+    }
+}
+
+/*
+ * Переходы состояний те же, что в dfa_transition; состояние меняется
+ * до вывода, чтобы ошибка памяти при выводе оставила DFA_ERROR.
+ */
+void rpnFeed(RpnConverter *converter, const char *data, size_t length)
+{
+    size_t i;
+    int state;
+
+    for (i = 0; i < length && converter->state != DFA_ERROR; i++) {
+        state = converter->state;
+        switch (byte_class[(unsigned char)data[i]]) {
+        case CLASS_SPACE:
+            if (state == DFA_NUMBER) {
+                converter->state = DFA_OPERATOR;
+            }
+            break;
+        case CLASS_DIGIT:
+            if (state == DFA_NUMBER) {
+                rpnEmit(converter, data + i, 1);
+            } else if (state == DFA_OPERAND) {
+                converter->state = DFA_NUMBER;
+                rpnOperand(converter, data[i]);
+            } else {
+                converter->state = DFA_ERROR;
+            }
+            break;
+        case CLASS_LETTER:
+            if (state == DFA_OPERAND) {
+                converter->state = DFA_OPERATOR;
+                rpnOperand(converter, data[i]);
+            } else {
+                converter->state = DFA_ERROR;
+            }
+            break;
+        case CLASS_OPEN:
+            if (state == DFA_OPERAND) {
+                rpnPush(converter, '(');
+            } else {
+                converter->state = DFA_ERROR;
+            }
+            break;
+        case CLASS_CLOSE:
+            if (state == DFA_OPERAND) {
+                converter->state = DFA_ERROR;
+            } else {
+                converter->state = DFA_OPERATOR;
+                rpnClose(converter);
+            }
+            break;
+        case CLASS_SIGN:
+            converter->state = DFA_OPERAND;
+            if (state == DFA_OPERAND) {
+                rpnPush(converter, data[i] == '-' ? RPN_MINUS : RPN_PLUS);
+            } else {
+                rpnBinary(converter, data[i]);
+            }
+            break;
+        case CLASS_MULOP:
+            if (state == DFA_OPERAND) {
+                converter->state = DFA_ERROR;
+            } else {
+                converter->state = DFA_OPERAND;
+                rpnBinary(converter, data[i]);
+            }
+            break;
+        default:
+            converter->state = DFA_ERROR;
+            break;
+        }
+    }
+}
+
+int rpnFinish(RpnConverter *converter)
+{
+    if (converter->state != DFA_OPERATOR && converter->state != DFA_NUMBER) {
+        return FALSE;
+    }
+    while (converter->depth > 0) {
+        if (converter->stack[converter->depth - 1] == '(') {
+            return FALSE;   /* Незакрытая скобка */
+        }
+        rpnOperator(converter, converter->stack[--converter->depth]);
+    }
+    return !converter->failed;
+}
+
+/* --- Пакетный режим --- */
+
+void outputInit(OutputBuffer *out, FILE *stream)
+{
+    out->stream = stream;
+    out->length = 0;
+    out->failed = FALSE;
+}
+
+void outputWrite(OutputBuffer *out, const char *data, size_t length)
+{
+    size_t part;
+
+    while (length > 0) {
+        if (out->length == OUTPUT_BLOCK_SIZE && !outputFlush(out)) {
+            return;
+        }
+        part = OUTPUT_BLOCK_SIZE - out->length;
+        if (part > length) {
+            part = length;
+        }
+        memcpy(out->data + out->length, data, part);
+        out->length += part;
+        data += part;
+        length -= part;
+    }
+}
+
+int outputFlush(OutputBuffer *out)
+{
+    if (out->length > 0 && !out->failed) {
+        if (fwrite(out->data, 1, out->length, out->stream) != out->length) {
+            out->failed = TRUE;
+        }
+    }
+    out->length = 0;
+    if (fflush(out->stream) != 0) {
+        out->failed = TRUE;
+    }
+    return !out->failed;
+}
+
+/*
+ * Строки подаются автомату прямо из блока чтения. Строка, разорванная
+ * границей блока, не копируется: ее проверка продолжается со следующего
+ * блока с сохраненного состояния.
+ */
+int validateLines(FILE *input, OutputBuffer *out, int extended, VerdictCache *cache)
+{
+    ValidatorState validator;
+    ExtendedValidator extended_validator;
+    char *block;
+    const char *line;
+    const char *newline;
+    size_t filled;
+    size_t rest;
+    int pending = FALSE;   /* Есть начатая и не завершенная строка */
+    int ok = TRUE;
+
+    block = (char *)malloc(INPUT_BLOCK_SIZE);
+    if (block == NULL) {
+        return FALSE;
+    }
+
+    validatorInit(&validator);
+    extendedInit(&extended_validator);
+    while (ok && (filled = fread(block, 1, INPUT_BLOCK_SIZE, input)) > 0) {
+        line = block;
+        rest = filled;
+
+        while (rest > 0 && (newline = (const char *)memchr(line, '\n', rest)) != NULL) {
+            if (extended) {
+                extendedFeed(&extended_validator, line, (size_t)(newline - line));
+                writeVerdict(out, extendedAccepts(&extended_validator));
+                ok = ok && !extended_validator.failed;
+                extendedReset(&extended_validator);
+            } else if (cache != NULL && !pending) {
+                writeVerdict(out, cacheValidate(cache, line, (size_t)(newline - line)));
+            } else {
+                validatorFeed(&validator, line, (size_t)(newline - line));
+                writeVerdict(out, validatorAccepts(&validator));
+                validatorInit(&validator);
+            }
+            rest -= (size_t)(newline - line) + 1;
+            line = newline + 1;
+            pending = FALSE;
+        }
+
+        pending = (rest > 0);
+        if (extended) {
+            extendedFeed(&extended_validator, line, rest);
+        } else {
+            validatorFeed(&validator, line, rest);
+        }
+        if (out->failed || extended_validator.failed) {
+            ok = FALSE;
+        }
+    }
+
+    if (ok && ferror(input)) {
+        ok = FALSE;
+    }
+    if (ok && pending) {
+        /* Последняя строка без перевода строки */
+        writeVerdict(out, extended ? extendedAccepts(&extended_validator)
+                                   : validatorAccepts(&validator));
+    }
+
+    extendedFree(&extended_validator);
+    free(block);
+    return ok;
 }
\ No newline at end of file